@@ -0,0 +1,542 @@
+// bench.c
+#define _GNU_SOURCE // For getopt and clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"   // For the wire protocol the load generator speaks
+#include "otp_kernel.h" // For the kernels being measured
+#include "otp_parallel.h" // For the tiled multi-core transform
+#include "otp_client.h"   // For the pipelined client library
+
+// Bytes each kernel measurement processes in total, spread over as many calls as that takes
+#define KERNEL_TARGET_BYTES (256UL * 1024 * 1024)
+
+// Function to handle errors and terminate the program
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+// Function to read the monotonic clock in nanoseconds
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Function to fill a buffer with random alphabet characters
+static void fill_text(char *buf, size_t len, unsigned int *seed) {
+    for (size_t i = 0; i < len; i++) buf[i] = otp_char_of[rand_r(seed) % OTP_ALPHABET_SIZE];
+}
+
+// Kernel operations bench kernels times; the packed ones only for alphabets that can be packed
+static const char *const kernel_ops[] = { "encrypt", "decrypt", "pack", "unpack", "encrypt_packed" };
+#define KERNEL_OPS (OTP_PACKABLE ? 5 : 2)
+
+// Function to run one kernel operation over size symbols; the packed transform works on packed
+// copies of the input and key
+static void run_kernel_op(const struct otp_kernel *kernel, int op, const char *input, const char *key,
+                          const char *packed_input, const char *packed_key, char *output, size_t size) {
+    if (op == 0) kernel->encrypt(input, key, output, size);
+    else if (op == 1) kernel->decrypt(input, key, output, size);
+    else if (op == 2) kernel->pack(input, output, size);
+    else if (op == 3) kernel->unpack(packed_input, output, size);
+    else kernel->encrypt_packed(packed_input, packed_key, output, size);
+}
+
+// Function to time every supported kernel in both directions for message sizes from 16 bytes up to
+// max_size, along with packing and the packed transform. Sizes count symbols, a byte each unpacked.
+static void bench_kernels(size_t max_size) {
+    const struct otp_kernel *kernels[8];
+    int count = otp_supported_kernels(kernels, 8);
+
+    char *input = malloc(max_size);
+    char *key = malloc(max_size);
+    char *output = malloc(max_size);
+    char *packed_input = malloc(OTP_PACKED_SIZE(max_size));
+    char *packed_key = malloc(OTP_PACKED_SIZE(max_size));
+    if (!input || !key || !output || !packed_input || !packed_key) error("Error allocating kernel buffers");
+
+    unsigned int seed = 1;
+    fill_text(input, max_size, &seed);
+    fill_text(key, max_size, &seed);
+    otp_pack(input, packed_input, max_size);
+    otp_pack(key, packed_key, max_size);
+
+    printf("{\"benchmark\":\"kernels\",\"active\":\"%s\",\"results\":[", otp_active_kernel()->name);
+    int first = 1;
+    for (int k = 0; k < count; k++) {
+        for (int op = 0; op < KERNEL_OPS; op++) {
+            for (size_t size = 16; size <= max_size; size *= 4) {
+                size_t iterations = KERNEL_TARGET_BYTES / size;
+                if (iterations == 0) iterations = 1;
+
+                // One untimed call warms the caches and the page tables
+                run_kernel_op(kernels[k], op, input, key, packed_input, packed_key, output, size);
+
+                uint64_t start = now_ns();
+                for (size_t i = 0; i < iterations; i++)
+                    run_kernel_op(kernels[k], op, input, key, packed_input, packed_key, output, size);
+                uint64_t elapsed = now_ns() - start;
+
+                double bytes = (double)size * iterations;
+                printf("%s{\"kernel\":\"%s\",\"op\":\"%s\",\"bytes\":%zu,\"iterations\":%zu,"
+                       "\"ns_per_byte\":%.4f,\"gb_per_s\":%.3f}",
+                       first ? "" : ",", kernels[k]->name, kernel_ops[op],
+                       size, iterations, elapsed / bytes, bytes / elapsed);
+                first = 0;
+            }
+        }
+    }
+
+    // The tiled pool on top of the active kernel, for the sizes it actually splits
+    for (size_t size = OTP_PARALLEL_THRESHOLD; size <= max_size; size *= 4) {
+        size_t iterations = KERNEL_TARGET_BYTES / size;
+        if (iterations == 0) iterations = 1;
+        otp_parallel(otp_encrypt, input, key, output, size);
+
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < iterations; i++) otp_parallel(otp_encrypt, input, key, output, size);
+        uint64_t elapsed = now_ns() - start;
+
+        double bytes = (double)size * iterations;
+        printf("%s{\"kernel\":\"parallel\",\"threads\":%d,\"op\":\"encrypt\",\"bytes\":%zu,\"iterations\":%zu,"
+               "\"ns_per_byte\":%.4f,\"gb_per_s\":%.3f}",
+               first ? "" : ",", otp_parallel_threads(), size, iterations, elapsed / bytes, bytes / elapsed);
+        first = 0;
+    }
+    printf("]}\n");
+
+    free(input);
+    free(key);
+    free(output);
+    free(packed_input);
+    free(packed_key);
+}
+
+// Function to time the keygen binary producing a key of the given length
+static void bench_keygen(const char *keygen_path, size_t length) {
+    char length_arg[32];
+    snprintf(length_arg, sizeof(length_arg), "%zu", length);
+
+    uint64_t start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) error("Error forking keygen");
+    if (pid == 0) {
+        // Discard the key; only the time to produce it matters
+        if (!freopen("/dev/null", "w", stdout)) _exit(1);
+        execl(keygen_path, keygen_path, length_arg, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    uint64_t elapsed = now_ns() - start;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error: %s failed\n", keygen_path);
+        exit(1);
+    }
+
+    printf("{\"benchmark\":\"keygen\",\"bytes\":%zu,\"seconds\":%.4f,\"mb_per_s\":%.1f}\n",
+           length, elapsed / 1e9, length / (elapsed / 1e3));
+}
+
+// Settings and results shared by the load generator's client threads
+struct load_config {
+    int port;
+    int framed;                  // One persistent framed connection per client instead of one connection per request
+    int packed;                  // Framed connections carry packed symbols, packed and unpacked by each request
+    const char *client_handshake;
+    const char *server_handshake;
+    size_t message_len;
+    uint64_t deadline;           // Clients stop issuing requests at this time
+};
+
+struct load_client {
+    const struct load_config *config;
+    int index;
+    uint64_t *latencies;         // Nanoseconds per completed request
+    size_t count;
+    size_t cap;
+    size_t failures;
+};
+
+// Function to connect to the server on localhost and complete the handshake; returns the socket or -1
+static int open_session(const struct load_config *config) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) return -1;
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(config->port);
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    socket_nodelay(sockfd);
+
+    char reply[HANDSHAKE_LEN];
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 ||
+        write_full(sockfd, config->client_handshake, HANDSHAKE_LEN) < 0 ||
+        read_full(sockfd, reply, HANDSHAKE_LEN) != HANDSHAKE_LEN ||
+        memcmp(reply, config->server_handshake, HANDSHAKE_LEN) != 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// Function to record one request latency
+static void record_latency(struct load_client *client, uint64_t ns) {
+    if (client->count == client->cap) {
+        client->cap = client->cap ? client->cap * 2 : 4096;
+        client->latencies = realloc(client->latencies, client->cap * sizeof(uint64_t));
+        if (!client->latencies) error("Error allocating latency buffer");
+    }
+    client->latencies[client->count++] = ns;
+}
+
+// Function run by each simulated client: issue one request at a time until the deadline
+static void *load_client_main(void *arg) {
+    struct load_client *client = arg;
+    const struct load_config *config = client->config;
+    size_t len = config->message_len;
+
+    char *payload = malloc(len + 1);
+    char *key = malloc(len + 1);
+    char *result = malloc(len + 1);
+    char *packed = malloc(2 * OTP_PACKED_SIZE(len) + 1); // Payload and key, then the result, in packed mode
+    if (!payload || !key || !result || !packed) error("Error allocating client buffers");
+    unsigned int seed = client->index + 1;
+    fill_text(payload, len, &seed);
+    fill_text(key, len, &seed);
+
+    int sockfd = -1;
+    uint32_t next_id = 0;
+    int32_t mode = config->packed ? MODE_PACKED : MODE_FRAMED;
+    int32_t status = STATUS_OK;
+    size_t packed_len = OTP_PACKED_SIZE(len);
+
+    while (now_ns() < config->deadline) {
+        uint64_t start = now_ns();
+        int ok = 0;
+
+        if (config->framed) {
+            // Reuse one connection for every job
+            if (sockfd < 0) {
+                sockfd = open_session(config);
+                if (sockfd >= 0 && (write_full(sockfd, &mode, sizeof(mode)) < 0 ||
+                                    (config->packed && (read_full(sockfd, &status, sizeof(status)) != sizeof(status) ||
+                                                        status != STATUS_OK)))) {
+                    close(sockfd);
+                    sockfd = -1;
+                }
+            }
+            if (sockfd >= 0 && config->packed) {
+                // The client's share of the work is part of each request: pack on the way out, unpack on the way in
+                struct frame_header job, response;
+                memset(&job, 0, sizeof(job));
+                job.id = next_id++;
+                job.payload_len = len;
+                job.key_len = len;
+                char wire[sizeof(struct frame_header)];
+                encode_frame_header(&job, wire);
+                otp_pack(payload, packed, len);
+                otp_pack(key, packed + packed_len, len);
+                struct iovec iov[2] = { { wire, sizeof(wire) }, { packed, 2 * packed_len } };
+                ok = writev_full(sockfd, iov, 2) == 0 &&
+                     recv_frame_header(sockfd, &response) == 1 &&
+                     response.id == job.id && response.status == STATUS_OK && response.payload_len == len &&
+                     read_full(sockfd, packed, packed_len) == (ssize_t)packed_len;
+                if (ok) otp_unpack(packed, result, len);
+                if (!ok) {
+                    close(sockfd);
+                    sockfd = -1;
+                }
+            } else if (sockfd >= 0) {
+                struct frame_header job, response;
+                memset(&job, 0, sizeof(job));
+                job.id = next_id++;
+                job.payload_len = len;
+                job.key_len = len;
+                ok = send_frame(sockfd, &job, payload, key) == 0 &&
+                     recv_frame_header(sockfd, &response) == 1 &&
+                     response.id == job.id && response.status == STATUS_OK &&
+                     read_full(sockfd, result, response.payload_len) == (ssize_t)len;
+                if (!ok) {
+                    close(sockfd);
+                    sockfd = -1;
+                }
+            }
+        } else {
+            // The original protocol: a fresh connection and handshake for every message
+            sockfd = open_session(config);
+            if (sockfd >= 0) {
+                int message_len = len;
+                ok = write_full(sockfd, &message_len, sizeof(message_len)) == 0 &&
+                     write_full(sockfd, payload, len) == 0 &&
+                     write_full(sockfd, key, len) == 0 &&
+                     read_full(sockfd, result, len) == (ssize_t)len;
+                close(sockfd);
+                sockfd = -1;
+            }
+        }
+
+        if (ok) {
+            record_latency(client, now_ns() - start);
+        } else {
+            client->failures++;
+        }
+    }
+
+    if (sockfd >= 0) close(sockfd);
+    free(payload);
+    free(key);
+    free(result);
+    free(packed);
+    return NULL;
+}
+
+// Function to compare latencies for qsort
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to pick a percentile from sorted latencies, in microseconds
+static double percentile_us(const uint64_t *sorted, size_t count, double p) {
+    if (count == 0) return 0;
+    size_t i = (size_t)(p * (count - 1));
+    return sorted[i] / 1e3;
+}
+
+// Function to drive a server with concurrent closed-loop clients and report throughput and latency
+static void bench_load(struct load_config *config, int clients, double seconds) {
+    struct load_client *state = calloc(clients, sizeof(*state));
+    pthread_t *threads = malloc(clients * sizeof(*threads));
+    if (!state || !threads) error("Error allocating clients");
+
+    uint64_t start = now_ns();
+    config->deadline = start + (uint64_t)(seconds * 1e9);
+    for (int i = 0; i < clients; i++) {
+        state[i].config = config;
+        state[i].index = i;
+        if (pthread_create(&threads[i], NULL, load_client_main, &state[i]) != 0) error("Error starting client");
+    }
+
+    // Gather every client's latencies into one sorted array
+    size_t total = 0, failures = 0;
+    for (int i = 0; i < clients; i++) {
+        pthread_join(threads[i], NULL);
+        total += state[i].count;
+        failures += state[i].failures;
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t *all = malloc((total ? total : 1) * sizeof(uint64_t));
+    if (!all) error("Error allocating latency summary");
+    size_t n = 0;
+    for (int i = 0; i < clients; i++) {
+        memcpy(all + n, state[i].latencies, state[i].count * sizeof(uint64_t));
+        n += state[i].count;
+        free(state[i].latencies);
+    }
+    qsort(all, total, sizeof(uint64_t), compare_u64);
+
+    printf("{\"benchmark\":\"load\",\"port\":%d,\"protocol\":\"%s\",\"handshake\":\"%s\",\"clients\":%d,"
+           "\"message_bytes\":%zu,\"seconds\":%.3f,\"requests\":%zu,\"failures\":%zu,\"requests_per_s\":%.1f,"
+           "\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+           config->port, config->packed ? "packed" : config->framed ? "framed" : "single", config->client_handshake, clients,
+           config->message_len, elapsed / 1e9, total, failures, total / (elapsed / 1e9),
+           percentile_us(all, total, 0.50), percentile_us(all, total, 0.99),
+           percentile_us(all, total, 0.999), total ? all[total - 1] / 1e3 : 0.0);
+
+    free(all);
+    free(state);
+    free(threads);
+}
+
+// One request slot of the pipelined load generator, resubmitted each time its response arrives
+struct async_slot {
+    struct async_load *load;
+    char *output;
+    uint64_t start;
+};
+
+// State of the pipelined load generator
+struct async_load {
+    struct otp_client *client;
+    struct load_client stats;
+    const char *payload;
+    const char *key;
+    size_t len;
+};
+
+static void async_done(void *arg, const struct otp_result *result);
+
+// Function to submit a slot's next request
+static void async_submit(struct async_slot *slot) {
+    struct async_load *load = slot->load;
+    struct otp_request request;
+    memset(&request, 0, sizeof(request));
+    request.input = load->payload;
+    request.key = load->key;
+    request.len = load->len;
+    request.output = slot->output;
+    request.done = async_done;
+    request.arg = slot;
+    slot->start = now_ns();
+    if (otp_client_submit(load->client, &request) < 0) error("Error submitting request");
+}
+
+// Function called as each response arrives: record it and keep the slot busy until the deadline
+static void async_done(void *arg, const struct otp_result *result) {
+    struct async_slot *slot = arg;
+    struct async_load *load = slot->load;
+    uint64_t now = now_ns();
+    if (result->status == STATUS_OK && result->len == load->len) {
+        record_latency(&load->stats, now - slot->start);
+    } else {
+        load->stats.failures++;
+    }
+    if (now < load->stats.config->deadline) async_submit(slot);
+}
+
+// Function to drive a server from this one thread through the client library, keeping window requests
+// in flight over a pool of connections
+static void bench_async(struct load_config *config, int connections, int window, double seconds) {
+    char port[16];
+    snprintf(port, sizeof(port), "%d", config->port);
+
+    struct async_load load;
+    memset(&load, 0, sizeof(load));
+    load.client = otp_client_open(port, config->client_handshake, connections);
+    if (!load.client) error("Error connecting to server");
+    load.stats.config = config;
+    load.len = config->message_len;
+
+    char *payload = malloc(load.len + 1);
+    char *key = malloc(load.len + 1);
+    struct async_slot *slots = calloc(window, sizeof(*slots));
+    if (!payload || !key || !slots) error("Error allocating client buffers");
+    unsigned int seed = 1;
+    fill_text(payload, load.len, &seed);
+    fill_text(key, load.len, &seed);
+    load.payload = payload;
+    load.key = key;
+
+    uint64_t start = now_ns();
+    config->deadline = start + (uint64_t)(seconds * 1e9);
+    for (int i = 0; i < window; i++) {
+        slots[i].load = &load;
+        slots[i].output = malloc(load.len + 1);
+        if (!slots[i].output) error("Error allocating client buffers");
+        async_submit(&slots[i]);
+    }
+    while (otp_client_pending(load.client) > 0) {
+        if (otp_client_complete(load.client, NULL, 0, -1) < 0) error("Error waiting for server");
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    size_t total = load.stats.count;
+    qsort(load.stats.latencies, total, sizeof(uint64_t), compare_u64);
+    printf("{\"benchmark\":\"load\",\"port\":%d,\"protocol\":\"async\",\"handshake\":\"%s\",\"clients\":%d,"
+           "\"in_flight\":%d,\"message_bytes\":%zu,\"seconds\":%.3f,\"requests\":%zu,\"failures\":%zu,"
+           "\"requests_per_s\":%.1f,\"latency_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+           config->port, config->client_handshake, connections, window, load.len, elapsed / 1e9, total,
+           load.stats.failures, total / (elapsed / 1e9), percentile_us(load.stats.latencies, total, 0.50),
+           percentile_us(load.stats.latencies, total, 0.99), percentile_us(load.stats.latencies, total, 0.999),
+           total ? load.stats.latencies[total - 1] / 1e3 : 0.0);
+
+    otp_client_close(load.client);
+    for (int i = 0; i < window; i++) free(slots[i].output);
+    free(slots);
+    free(load.stats.latencies);
+    free(payload);
+    free(key);
+}
+
+// Function to print the usage message and exit
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s kernels [max_bytes]\n"
+            "       %s keygen keygen_path [key_length]\n"
+            "       %s load [-c clients] [-d seconds] [-n message_len] [-m single|framed|packed|async]\n"
+            "            [-w in_flight] [-x enc|dec] port\n",
+            program, program, program);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) usage(argv[0]);
+
+    if (strcmp(argv[1], "kernels") == 0) {
+        // Sizes grow by 4x from 16 bytes; pass 1073741824 to go all the way to 1 GB
+        size_t max_size = argc > 2 ? strtoull(argv[2], NULL, 10) : 64UL * 1024 * 1024;
+        if (max_size < 16) usage(argv[0]);
+        bench_kernels(max_size);
+    } else if (strcmp(argv[1], "keygen") == 0) {
+        if (argc < 3) usage(argv[0]);
+        bench_keygen(argv[2], argc > 3 ? strtoull(argv[3], NULL, 10) : 256UL * 1024 * 1024);
+    } else if (strcmp(argv[1], "load") == 0) {
+        struct load_config config;
+        memset(&config, 0, sizeof(config));
+        config.client_handshake = "ENC_CLIENT";
+        config.server_handshake = "ENC_SERVER";
+        config.message_len = 64;
+        int clients = 8;
+        int async = 0;
+        int window = 64;
+        double seconds = 5;
+
+        int opt;
+        optind = 2;
+        while ((opt = getopt(argc, argv, "c:d:n:m:w:x:")) != -1) {
+            if (opt == 'c') {
+                clients = atoi(optarg);
+            } else if (opt == 'd') {
+                seconds = atof(optarg);
+            } else if (opt == 'n') {
+                config.message_len = strtoull(optarg, NULL, 10);
+            } else if (opt == 'm') {
+                config.packed = strcmp(optarg, "packed") == 0;
+                config.framed = strcmp(optarg, "framed") == 0 || config.packed;
+                async = strcmp(optarg, "async") == 0;
+            } else if (opt == 'w') {
+                window = atoi(optarg);
+            } else if (opt == 'x' && strcmp(optarg, "dec") == 0) {
+                config.client_handshake = "DEC_CLIENT";
+                config.server_handshake = "DEC_SERVER";
+            } else if (opt != 'x' || strcmp(optarg, "enc") != 0) {
+                usage(argv[0]);
+            }
+        }
+        if (argc - optind != 1 || clients <= 0 || seconds <= 0 || window <= 0) usage(argv[0]);
+        // Single-message mode is capped by the server's buffer; bigger messages need framed mode
+        if (!config.framed && !async && config.message_len >= 1024) {
+            fprintf(stderr, "Error: single mode messages must be shorter than 1024 bytes\n");
+            exit(1);
+        }
+        config.port = atoi(argv[optind]);
+
+        // In async mode one thread keeps -w requests in flight over -c connections
+        if (async) {
+            bench_async(&config, clients, window, seconds);
+        } else {
+            bench_load(&config, clients, seconds);
+        }
+    } else {
+        usage(argv[0]);
+    }
+    return 0;
+}
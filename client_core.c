@@ -0,0 +1,1283 @@
+// client_core.c
+#define _GNU_SOURCE // For getopt_long and getline
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>   // For --local
+#include <dirent.h>   // For reading the input directory in batch mode
+#include <poll.h>     // For driving the batch connections together
+#include <sys/stat.h> // For fstat to size the input files
+#include <sys/mman.h> // For mapping the input files
+#include <sys/uio.h>  // For writev of a header, payload and key in one call
+#include <fcntl.h>    // For open, fallocate and splice
+#include <time.h>     // For the backoff clock and sleep
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h> // For connecting to a server's Unix socket
+#include <netinet/in.h>
+#include <netdb.h> // For gethostbyname and host information
+
+#include "client_core.h"
+#include "protocol.h" // For stream mode, framed mode and full-length socket I/O
+#include "otp_parallel.h" // For the tiled transform --local runs in-process
+#include "otp_kernel.h"   // For vectorized input validation
+
+// Where a batch job is in its life
+enum batch_state {
+    BATCH_PENDING,  // Not sent yet
+    BATCH_SENT,     // Sent, or being sent, on a connection and waiting for its response
+    BATCH_FINISHED  // Output written, or the failure reported
+};
+
+// A key file named by one or more batch jobs
+struct batch_key {
+    const char *path;
+    const char *data; // NULL if the file could not be opened
+    size_t len;
+    int fd;
+    uint32_t key_id;  // Handle in the server's key store, or 0 when the key is sent with every job
+    unsigned char token[KEY_TOKEN_LEN]; // Sent in place of the key with key_id
+};
+
+// One input file to transform into one output file
+struct batch_job {
+    char *input;
+    char *output;
+    int key;   // Index into the batch's keys
+    enum batch_state state;
+    int conn;  // Connection the job was sent on
+    int busy;  // Times the server has answered the job with STATUS_BUSY
+};
+
+// One framed connection with its half-written request and half-read response
+struct batch_conn {
+    int fd;        // -1 once the connection has failed
+    int in_flight; // Jobs sent, or being sent, whose responses have not arrived
+
+    // Request being written: header, payload and (unless stored) key
+    int sending;
+    char header[sizeof(struct frame_header)];
+    struct iovec iov[3];
+    int iov_count;
+    int iov_pos;
+    const char *mapped; // Input file mapping, released once the request is written
+    int mapped_fd;
+    char *packed;       // Packed payload and key of the request, in packed mode
+    size_t packed_cap;
+
+    // Response being read
+    char wire[sizeof(struct frame_header)];
+    size_t header_got;
+    struct frame_header response;
+    char *result;
+    size_t result_len; // Bytes of result on the wire: payload_len, or its packed size
+    size_t result_cap;
+    size_t result_got;
+};
+
+// Everything one batch run works through
+struct batch {
+    struct batch_key *keys;
+    int key_count;
+    struct batch_job *jobs;
+    int job_count;
+    struct batch_conn *conns;
+    int conn_count;
+    int next_job; // First job not yet sent
+    int finished; // Jobs finished either way
+    int failed;   // Jobs that failed
+    int *retry;   // Jobs the server was too busy for, to send again before any new one
+    int retry_count;
+    uint64_t resume_at; // While the server is busy, nothing is sent before this time (ms)
+    int packed;         // Symbols are packed on the wire
+    char *text;         // A packed result unpacked for writing out
+    size_t text_cap;
+};
+
+// Function to handle errors and terminate the program
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+// Function to map a file read-only; returns its text and sets len to its length without a trailing newline
+const char *map_file(const char *filename, int *fd, size_t *len) {
+    struct stat st;
+    *fd = open(filename, O_RDONLY);
+    if (*fd < 0 || fstat(*fd, &st) < 0) {
+        fprintf(stderr, "Error: could not open file %s\n", filename);
+        if (*fd >= 0) close(*fd);
+        return NULL;
+    }
+
+    *len = st.st_size;
+    if (*len == 0) return ""; // An empty file cannot be mapped
+
+    const char *content = mmap(NULL, *len, PROT_READ, MAP_PRIVATE, *fd, 0);
+    if (content == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map file %s\n", filename);
+        close(*fd);
+        return NULL;
+    }
+
+    // Leave the trailing newline out of the text
+    if (content[*len - 1] == '\n') (*len)--;
+    return content;
+}
+
+// Function to release a file mapped by map_file
+static void unmap_file(const char *content, int fd) {
+    struct stat st;
+    // The mapped length is the file size, not the text length map_file returned
+    if (fstat(fd, &st) == 0 && st.st_size > 0) munmap((void *)content, st.st_size);
+    close(fd);
+}
+
+// Function to read the monotonic clock in milliseconds
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to pick how long to wait before retrying a busy server: exponential backoff from the
+// server's hint, with jitter so that clients turned away together do not all return together
+static uint64_t backoff_ms(int attempt, uint32_t hint_ms) {
+    static unsigned seed;
+    if (!seed) seed = getpid() ^ (unsigned)now_ms();
+
+    uint64_t delay = hint_ms > RETRY_BASE_MS ? hint_ms : RETRY_BASE_MS;
+    for (int i = 0; i < attempt && delay < RETRY_MAX_MS; i++) delay *= 2;
+    if (delay > RETRY_MAX_MS) delay = RETRY_MAX_MS;
+
+    // Wait at least half the delay, plus a random share of the other half
+    return delay / 2 + rand_r(&seed) % (delay / 2 + 1);
+}
+
+// Function to sleep for a number of milliseconds
+static void sleep_ms(uint64_t ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+// Function to connect to a server's Unix socket, which skips the TCP stack entirely
+static int connect_unix(const char *path) {
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(server_addr.sun_path)) {
+        fprintf(stderr, "Error: socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(server_addr.sun_path, path);
+
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sockfd < 0) error("Error opening socket");
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        error("Error connecting to server");
+    return sockfd;
+}
+
+// Function to connect to the server on localhost
+static int connect_tcp(int port_number) {
+    struct sockaddr_in server_addr; // Structure to store server address information
+    struct hostent *server; // Host information
+    char hostname[] = "localhost"; // Define the hostname
+
+    // Create a socket for communication
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) error("Error opening socket");
+
+    // Retrieve host information
+    server = gethostbyname(hostname);
+    if (!server) {
+        fprintf(stderr, "Error: no such host\n");
+        exit(1);
+    }
+
+    // Set up the server address structure
+    memset((char *)&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    memcpy((char *)&server_addr.sin_addr.s_addr, server->h_addr_list[0], server->h_length);
+    server_addr.sin_port = htons(port_number);
+
+    // Connect to the server; requests are written whole, so Nagle's algorithm would only delay them
+    if (connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        error("Error connecting to server");
+    socket_nodelay(sockfd);
+    return sockfd;
+}
+
+// Function to connect to the server and exchange handshakes, retrying while the server is busy
+int connect_server(const char *address, const struct client_config *config) {
+    char buffer[HANDSHAKE_LEN + 1]; // Buffer for the handshake response
+
+    for (int attempt = 0;; attempt++) {
+        int sockfd = strchr(address, '/') ? connect_unix(address) : connect_tcp(atoi(address));
+
+        // Send a handshake message to identify the kind of client
+        if (write_full(sockfd, config->client_handshake, strlen(config->client_handshake)) < 0)
+            error("Error sending handshake");
+
+        // Read and verify the handshake response from the server
+        memset(buffer, 0, sizeof(buffer));
+        if (read_full(sockfd, buffer, HANDSHAKE_LEN) <= 0)
+            error("Error reading handshake response");
+
+        if (strcmp(buffer, BUSY_HANDSHAKE) == 0) {
+            // The server is at its connection limit; its hint is where the backoff starts
+            uint32_t hint = 0;
+            if (read_full(sockfd, &hint, sizeof(hint)) != (ssize_t)sizeof(hint)) hint = 0;
+            close(sockfd);
+            if (attempt + 1 >= RETRY_ATTEMPTS) {
+                fprintf(stderr, "Error: server is busy\n");
+                exit(1);
+            }
+            sleep_ms(backoff_ms(attempt, ntohl(hint)));
+            continue;
+        }
+
+        if (strcmp(buffer, config->server_handshake) != 0) {
+            fprintf(stderr, "Error: invalid server response during handshake: '%s'\n", buffer);
+            close(sockfd);
+            exit(1);
+        }
+        return sockfd;
+    }
+}
+
+// Where the result of a single message goes: standard output, or the file given with -o
+struct output {
+    int fd;
+    int direct;   // fd has O_DIRECT set: only whole aligned blocks are written until the last
+    int splice;   // Results move from the socket into fd with splice, never entering user space
+    int file;     // fd is a regular file, which splice reaches through pipe
+    int pipe[2];  // Made when first spliced through; a file cannot take a socket's data directly
+    char *buffer; // OUTPUT_BUFFER_SIZE bytes aligned to OUTPUT_ALIGN for reads and O_DIRECT writes, made when first needed
+    size_t held;  // Bytes at the start of buffer not written yet
+};
+
+// Function to open the output for a result of len bytes: the path, truncated, or standard output
+// when it is NULL. A regular file has its blocks reserved for len bytes up front and is written with
+// O_DIRECT if direct is set and its filesystem allows it; otherwise results from the server are
+// spliced into it, as they are into a pipe. Returns 0, or -1 with errno set.
+static int open_output(struct output *out, const char *path, int direct, size_t len) {
+    memset(out, 0, sizeof(*out));
+    out->pipe[0] = out->pipe[1] = -1;
+    out->fd = STDOUT_FILENO;
+    if (path) {
+        out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | (direct ? O_DIRECT : 0), 0644);
+        out->direct = direct && out->fd >= 0;
+        if (out->fd < 0 && direct && errno == EINVAL)
+            out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out->fd < 0) return -1;
+    }
+
+    struct stat st;
+    if (fstat(out->fd, &st) < 0) return 0;
+    if (S_ISFIFO(st.st_mode)) {
+        out->splice = 1;
+    } else if (S_ISREG(st.st_mode)) {
+        // The size is left alone, so a run cut short leaves no stretch of zeros after the result
+        off_t at = lseek(out->fd, 0, SEEK_CUR);
+        if (at >= 0 && len > 0) fallocate(out->fd, FALLOC_FL_KEEP_SIZE, at, len);
+        // Files opened for appending do not take splices on every kernel
+        out->file = 1;
+        out->splice = !out->direct && !(fcntl(out->fd, F_GETFL) & O_APPEND);
+    }
+    return 0;
+}
+
+// Function to allocate the output's buffer on first use; 0 or -1
+static int output_buffer(struct output *out) {
+    if (out->buffer) return 0;
+    if (posix_memalign((void **)&out->buffer, OUTPUT_ALIGN, OUTPUT_BUFFER_SIZE) == 0) return 0;
+    out->buffer = NULL;
+    return -1;
+}
+
+// Function to write the whole blocks held in the buffer, or all of it when not writing with O_DIRECT,
+// keeping the rest at the start of the buffer; 0 or -1
+static int flush_output(struct output *out) {
+    size_t n = out->direct ? out->held / OUTPUT_ALIGN * OUTPUT_ALIGN : out->held;
+    if (n == 0) return 0;
+    if (write_full(out->fd, out->buffer, n) < 0) return -1;
+    memmove(out->buffer, out->buffer + n, out->held - n);
+    out->held -= n;
+    return 0;
+}
+
+// Function to write len bytes already in memory to the output; 0 or -1
+static int write_output(struct output *out, const char *data, size_t len) {
+    if (!out->direct) return write_full(out->fd, data, len);
+    while (len > 0) {
+        // Whole blocks of an aligned source, such as a mapping, go straight out; the rest is gathered first
+        if (out->held == 0 && (uintptr_t)data % OUTPUT_ALIGN == 0 && len >= OUTPUT_ALIGN) {
+            size_t n = len / OUTPUT_ALIGN * OUTPUT_ALIGN;
+            if (write_full(out->fd, data, n) < 0) return -1;
+            data += n;
+            len -= n;
+            continue;
+        }
+        if (output_buffer(out) < 0) return -1;
+        size_t n = len < OUTPUT_BUFFER_SIZE - out->held ? len : OUTPUT_BUFFER_SIZE - out->held;
+        memcpy(out->buffer + out->held, data, n);
+        out->held += n;
+        data += n;
+        len -= n;
+        if (flush_output(out) < 0) return -1;
+    }
+    return 0;
+}
+
+// Function to move len bytes from the socket to the output with splice; returns how many moved before
+// splice refused them (only the first call can be refused), or -1 on any other failure
+static ssize_t splice_output(struct output *out, int sockfd, size_t len) {
+    if (out->file && out->pipe[1] < 0) {
+        if (pipe2(out->pipe, O_CLOEXEC) < 0) return 0;
+        fcntl(out->pipe[1], F_SETPIPE_SZ, STREAM_CHUNK_SIZE);
+    }
+
+    size_t done = 0;
+    while (done < len) {
+        int target = out->pipe[1] >= 0 ? out->pipe[1] : out->fd;
+        ssize_t n = splice(sockfd, NULL, target, NULL, len - done, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS) && done == 0) return 0;
+        if (n <= 0) return -1;
+
+        // Through a pipe, whatever reached it is passed on to the file before more is taken
+        for (ssize_t left = out->pipe[1] >= 0 ? n : 0; left > 0;) {
+            ssize_t m = splice(out->pipe[0], NULL, out->fd, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (m < 0 && errno == EINTR) continue;
+            if (m <= 0) {
+                // The file refused the splice, so what the pipe holds is copied out of it instead
+                if (m < 0 && (errno == EINVAL || errno == ENOSYS) && done == 0 && left == n) {
+                    if (output_buffer(out) < 0 || read_full(out->pipe[0], out->buffer, left) != left ||
+                        write_full(out->fd, out->buffer, left) < 0)
+                        return -1;
+                    return n;
+                }
+                return -1;
+            }
+            left -= m;
+        }
+        done += n;
+    }
+    return done;
+}
+
+// Function to take len result bytes from the socket and write them to the output; 0 or -1. Data is
+// spliced when the output allows it, and otherwise read into the aligned buffer and written from it.
+static int receive_output(void *arg, int sockfd, size_t len) {
+    struct output *out = arg;
+    if (out->splice) {
+        ssize_t moved = splice_output(out, sockfd, len);
+        if (moved < 0) return -1;
+        if ((size_t)moved < len) out->splice = 0;
+        len -= moved;
+    }
+    if (len > 0 && output_buffer(out) < 0) return -1;
+    while (len > 0) {
+        size_t n = len < OUTPUT_BUFFER_SIZE - out->held ? len : OUTPUT_BUFFER_SIZE - out->held;
+        if (read_full(sockfd, out->buffer + out->held, n) != (ssize_t)n) return -1;
+        out->held += n;
+        len -= n;
+        if (flush_output(out) < 0) return -1;
+    }
+    return 0;
+}
+
+// Function to finish the output, writing whatever is still held without O_DIRECT, since its last
+// block is partial, and close it. Returns 0, or -1 if anything failed.
+static int close_output(struct output *out) {
+    if (out->held > 0 && out->direct) {
+        fcntl(out->fd, F_SETFL, fcntl(out->fd, F_GETFL) & ~O_DIRECT);
+        out->direct = 0;
+    }
+    int status = flush_output(out);
+    if (out->fd != STDOUT_FILENO && close(out->fd) < 0) status = -1;
+    if (out->pipe[0] >= 0) close(out->pipe[0]);
+    if (out->pipe[1] >= 0) close(out->pipe[1]);
+    free(out->buffer);
+    return status;
+}
+
+// Function to send one message through a shared-memory region and write the result to out; returns the exit status
+static int send_shared(int sockfd, const char *input, const char *key, size_t len, struct output *out) {
+    struct shm_attach attach;
+    memset(&attach, 0, sizeof(attach));
+    attach.size = len > 0 ? 2 * (uint64_t)len : 1; // A mapping cannot be empty
+
+    // A memfd has no name another process could open; the server gets it only through the socket.
+    // Sealing it against shrinking lets the server trust the size it checks.
+    int fd = memfd_create("otp-client", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) error("Error creating shared memory");
+    char *region = MAP_FAILED;
+    if (ftruncate(fd, attach.size) == 0 && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK) == 0)
+        region = mmap(NULL, attach.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (region == MAP_FAILED) error("Error mapping shared memory");
+
+    // Lay out the message and its key; the server transforms the message where it lies
+    memcpy(region, input, len);
+    memcpy(region + len, key, len);
+
+    // Hand the region to the server: the mode and the attach message go in one message carrying the
+    // descriptor, which the server keeps once it has mapped the region
+    int32_t mode = MODE_SHARED;
+    int32_t status = -1;
+    struct iovec iov[2] = {{&mode, sizeof(mode)}, {&attach, sizeof(attach)}};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(sockfd, &msg, MSG_NOSIGNAL) != (ssize_t)(sizeof(mode) + sizeof(attach)) ||
+        read_full(sockfd, &status, sizeof(status)) != (ssize_t)sizeof(status))
+        status = -1;
+    close(fd);
+    if (status != STATUS_OK) {
+        fprintf(stderr, "Error: server could not map shared memory\n");
+        exit(1);
+    }
+
+    // Only the job descriptor crosses the socket, and its echo means the result is in place
+    struct shm_job job;
+    memset(&job, 0, sizeof(job));
+    job.id = 1;
+    job.offset = 0;
+    job.key_offset = len;
+    job.len = len;
+    if (write_full(sockfd, &job, sizeof(job)) < 0)
+        error("Error sending job");
+
+    struct shm_job result;
+    if (read_full(sockfd, &result, sizeof(result)) != (ssize_t)sizeof(result) || result.id != job.id ||
+        result.status != STATUS_OK) {
+        fprintf(stderr, "Error: server rejected the job\n");
+        exit(1);
+    }
+
+    // The result is written straight from the mapping
+    if (write_output(out, region, len) < 0) error("Error writing result");
+    munmap(region, attach.size);
+    return 0;
+}
+
+// Function to switch a connection to framed mode, with packed symbols if *packed is set and the
+// server can take them. A server that cannot closes the connection, so a new one is opened in
+// plain framed mode and *packed cleared. Returns the connection.
+static int start_framed(int sockfd, const char *address, const struct client_config *config, int *packed) {
+    int32_t mode = MODE_PACKED;
+    int32_t status;
+    if (*packed) {
+        if (write_full(sockfd, &mode, sizeof(mode)) == 0 &&
+            read_full(sockfd, &status, sizeof(status)) == sizeof(status) && status == STATUS_OK)
+            return sockfd;
+        close(sockfd);
+        *packed = 0;
+        sockfd = connect_server(address, config);
+    }
+
+    mode = MODE_FRAMED;
+    if (write_full(sockfd, &mode, sizeof(mode)) < 0)
+        error("Error sending framed mode");
+    return sockfd;
+}
+
+// Function to send a frame on a packed connection, packing its payload and key on the way; 0 or -1
+static int send_packed_frame(int fd, const struct frame_header *header, const char *payload, const char *key) {
+    size_t payload_bytes = OTP_PACKED_SIZE((size_t)header->payload_len);
+    size_t key_bytes = OTP_PACKED_SIZE((size_t)header->key_len);
+    char *packed = malloc(payload_bytes + key_bytes + 1);
+    if (!packed) return -1;
+    otp_pack(payload, packed, header->payload_len);
+    otp_pack(key, packed + payload_bytes, header->key_len);
+
+    char wire[sizeof(struct frame_header)];
+    encode_frame_header(header, wire);
+    struct iovec iov[2] = {
+        { wire, sizeof(wire) },
+        { packed, payload_bytes + key_bytes },
+    };
+    int result = writev_full(fd, iov, 2);
+    free(packed);
+    return result;
+}
+
+// Function to send one message in legacy, stream, framed or shared-memory mode and write the result,
+// then a newline, to output_file or standard output
+static int run_single(const char *input_file, const char *key_file, const char *address, const char *output_file,
+                      int direct, int stream_mode, int framed_mode, int shared_mode, int packed,
+                      const struct client_config *config) {
+    char buffer[BUFFER_SIZE]; // Buffer for reading the result
+
+    // The shared-memory region is passed as a descriptor, which only a Unix socket can carry
+    if (shared_mode && !strchr(address, '/')) {
+        fprintf(stderr, "Error: -S needs the server's Unix socket path\n");
+        exit(1);
+    }
+
+    // Map both files; the text is validated and sent without being copied into a buffer first
+    int input_fd, key_fd;
+    size_t input_len, key_len;
+    const char *input = map_file(input_file, &input_fd, &input_len);
+    const char *key = map_file(key_file, &key_fd, &key_len);
+    if (!input || !key) exit(1);
+
+    // Validate that the input contains only allowed characters
+    size_t valid = otp_validate(input, input_len);
+    if (valid < input_len) {
+        fprintf(stderr, "Error: input contains a bad character at offset %zu\n", valid);
+        exit(1);
+    }
+
+    // Ensure the key is at least as long as the input
+    if (key_len < input_len) {
+        fprintf(stderr, "Error: key is too short\n");
+        exit(1);
+    }
+
+    // The output is only opened now, so a bad input never truncates an existing file
+    struct output out;
+    if (open_output(&out, output_file, direct, input_len + 1) < 0)
+        error("Error opening output file");
+
+    if (shared_mode) {
+        // The message goes through shared memory, so its length is not limited by any buffer
+        int sockfd = connect_server(address, config);
+        int status = send_shared(sockfd, input, key, input_len, &out);
+        close(sockfd);
+        if (write_output(&out, "\n", 1) < 0 || close_output(&out) < 0) error("Error writing result");
+        return status;
+    }
+
+    // Messages too long for a single buffer are always streamed instead of truncated
+    if (input_len >= BUFFER_SIZE) stream_mode = 1;
+
+    int sockfd = connect_server(address, config);
+
+    if (stream_mode) {
+        // Stream the input and key in chunks straight from their files; results go to the output as they come back
+        if (send_stream(sockfd, input_fd, key_fd, input_len, receive_output, &out) < 0) {
+            close(sockfd);
+            exit(1);
+        }
+        if (write_output(&out, "\n", 1) < 0 || close_output(&out) < 0) error("Error writing result");
+
+        close(sockfd);
+        return 0;
+    }
+
+    if (framed_mode) {
+        // Switch the connection to framed mode and send the message as job 1
+        sockfd = start_framed(sockfd, address, config, &packed);
+
+        struct frame_header job;
+        memset(&job, 0, sizeof(job));
+        job.id = 1;
+        job.payload_len = input_len;
+        job.key_len = input_len;
+
+        // The response echoes the job id and carries the result; a busy server is asked again later
+        struct frame_header result;
+        int received;
+        for (int attempt = 0;; attempt++) {
+            if ((packed ? send_packed_frame(sockfd, &job, input, key) : send_frame(sockfd, &job, input, key)) < 0)
+                error("Error sending job");
+            received = recv_frame_header(sockfd, &result);
+            if (received != 1 || result.status != STATUS_BUSY || attempt + 1 >= RETRY_ATTEMPTS) break;
+            sleep_ms(backoff_ms(attempt, result.retry_after_ms));
+        }
+        if (received != 1 || result.id != job.id || result.status != STATUS_OK || result.payload_len != job.payload_len) {
+            fprintf(stderr, "Error: server rejected the job\n");
+            close(sockfd);
+            exit(1);
+        }
+        if (packed) {
+            char packed_result[OTP_PACKED_SIZE(BUFFER_SIZE)];
+            size_t packed_len = OTP_PACKED_SIZE((size_t)result.payload_len);
+            if (read_full(sockfd, packed_result, packed_len) != (ssize_t)packed_len)
+                error("Error reading result");
+            otp_unpack(packed_result, buffer, result.payload_len);
+        } else if (read_full(sockfd, buffer, result.payload_len) != (ssize_t)result.payload_len) {
+            error("Error reading result");
+        }
+        buffer[result.payload_len] = '\n';
+        if (write_output(&out, buffer, result.payload_len + 1) < 0 || close_output(&out) < 0)
+            error("Error writing result");
+
+        close(sockfd);
+        return 0;
+    }
+
+    // Send the length of the input, the input and the key to the server in one writev
+    int message_len = input_len;
+    struct iovec iov[3] = {
+        { &message_len, sizeof(message_len) },
+        { (void *)input, message_len },
+        { (void *)key, message_len },
+    };
+    if (writev_full(sockfd, iov, 3) < 0)
+        error("Error sending message");
+
+    // Read the result returned by the server; it is exactly as long as the message, however many reads that takes
+    if (read_full(sockfd, buffer, message_len) != message_len)
+        error("Error reading result");
+
+    // Write the result and its newline in one go
+    buffer[message_len] = '\n';
+    if (write_output(&out, buffer, message_len + 1) < 0 || close_output(&out) < 0)
+        error("Error writing result");
+
+    close(sockfd);
+    return 0;
+}
+
+// Function to find a key file among the batch's keys, adding it if it is new; returns its index
+static int add_batch_key(struct batch *b, const char *path) {
+    for (int i = 0; i < b->key_count; i++) {
+        if (strcmp(b->keys[i].path, path) == 0) return i;
+    }
+
+    b->keys = realloc(b->keys, (b->key_count + 1) * sizeof(*b->keys));
+    if (!b->keys) error("Error allocating keys");
+    struct batch_key *key = &b->keys[b->key_count];
+    memset(key, 0, sizeof(*key));
+    key->path = strdup(path);
+    key->data = map_file(path, &key->fd, &key->len);
+    return b->key_count++;
+}
+
+// Function to append a job to the batch
+static void add_batch_job(struct batch *b, const char *input, const char *output, int key) {
+    b->jobs = realloc(b->jobs, (b->job_count + 1) * sizeof(*b->jobs));
+    if (!b->jobs) error("Error allocating jobs");
+    struct batch_job *job = &b->jobs[b->job_count++];
+    job->input = strdup(input);
+    job->output = strdup(output);
+    job->key = key;
+    job->state = BATCH_PENDING;
+    job->conn = -1;
+    job->busy = 0;
+}
+
+// Function to read a manifest: one "input_file key_file output_file" job per line
+static void read_manifest(struct batch *b, const char *filename) {
+    FILE *manifest = fopen(filename, "r");
+    if (!manifest) error("Error opening manifest");
+
+    char *line = NULL;
+    size_t cap = 0;
+    int line_number = 0;
+    while (getline(&line, &cap, manifest) != -1) {
+        line_number++;
+        // Skip blank lines and comments
+        char *input = strtok(line, " \t\r\n");
+        if (!input || input[0] == '#') continue;
+
+        char *key = strtok(NULL, " \t\r\n");
+        char *output = strtok(NULL, " \t\r\n");
+        if (!key || !output || strtok(NULL, " \t\r\n")) {
+            fprintf(stderr, "Error: %s:%d: expected input_file key_file output_file\n", filename, line_number);
+            exit(1);
+        }
+        add_batch_job(b, input, output, add_batch_key(b, key));
+    }
+
+    free(line);
+    fclose(manifest);
+}
+
+// Function to add a job for every regular file in a directory, each written to the same name in output_dir
+static void read_directory(struct batch *b, const char *input_dir, const char *output_dir, const char *key_file) {
+    DIR *dir = opendir(input_dir);
+    if (!dir) error("Error opening input directory");
+
+    // Create the output directory if it does not exist yet
+    if (mkdir(output_dir, 0755) < 0 && errno != EEXIST) error("Error creating output directory");
+
+    int key = add_batch_key(b, key_file);
+    char input[4096], output[4096];
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') continue; // Skip hidden files, "." and ".."
+
+        struct stat st;
+        snprintf(input, sizeof(input), "%s/%s", input_dir, entry->d_name);
+        if (stat(input, &st) < 0 || !S_ISREG(st.st_mode)) continue;
+
+        snprintf(output, sizeof(output), "%s/%s", output_dir, entry->d_name);
+        add_batch_job(b, input, output, key);
+    }
+    closedir(dir);
+}
+
+// Function to report a job as finished, and as failed if reason is not NULL
+static void finish_job(struct batch *b, struct batch_job *job, const char *reason) {
+    if (reason) {
+        fprintf(stderr, "Error: %s: %s\n", job->input, reason);
+        b->failed++;
+    }
+    job->state = BATCH_FINISHED;
+    b->finished++;
+}
+
+// Function to give up on a connection and on every job waiting for a response on it
+static void fail_connection(struct batch *b, int c) {
+    struct batch_conn *conn = &b->conns[c];
+    close(conn->fd);
+    conn->fd = -1;
+    if (conn->sending) unmap_file(conn->mapped, conn->mapped_fd);
+    conn->sending = 0;
+    conn->in_flight = 0;
+
+    for (int i = 0; i < b->job_count; i++) {
+        if (b->jobs[i].state == BATCH_SENT && b->jobs[i].conn == c)
+            finish_job(b, &b->jobs[i], "connection to server lost");
+    }
+}
+
+// Function to write as much of a connection's current request as the socket takes
+static void continue_send(struct batch *b, int c) {
+    struct batch_conn *conn = &b->conns[c];
+    while (conn->iov_pos < conn->iov_count) {
+        ssize_t n = writev(conn->fd, conn->iov + conn->iov_pos, conn->iov_count - conn->iov_pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return; // Wait for POLLOUT
+            fail_connection(b, c);
+            return;
+        }
+
+        // Step past the fully written (and empty) pieces and trim the partly written one
+        while (conn->iov_pos < conn->iov_count && (size_t)n >= conn->iov[conn->iov_pos].iov_len) {
+            n -= conn->iov[conn->iov_pos].iov_len;
+            conn->iov_pos++;
+        }
+        if (n > 0) {
+            conn->iov[conn->iov_pos].iov_base = (char *)conn->iov[conn->iov_pos].iov_base + n;
+            conn->iov[conn->iov_pos].iov_len -= n;
+        }
+    }
+
+    // The whole request is on its way; the input file is no longer needed
+    unmap_file(conn->mapped, conn->mapped_fd);
+    conn->sending = 0;
+}
+
+// Function to describe a bad input byte as a job failure. The reason is printed before the next
+// job is looked at, so one buffer serves every job.
+static const char *bad_input_reason(size_t offset) {
+    static char reason[64];
+    snprintf(reason, sizeof(reason), "input contains a bad character at offset %zu", offset);
+    return reason;
+}
+
+// Function to map a job's input and check the same things the single-message client does; returns
+// why it cannot run, or NULL. Callers that validate the input as they transform it skip that check.
+static const char *open_job_input(struct batch *b, struct batch_job *job, const char **input, int *input_fd, size_t *len,
+                                  int validate) {
+    struct batch_key *key = &b->keys[job->key];
+    if (!key->data) return "could not open key file";
+
+    *input = map_file(job->input, input_fd, len);
+    if (!*input) return "could not open input file";
+
+    const char *reason = NULL;
+    size_t valid = validate ? otp_validate(*input, *len) : *len;
+    if (valid < *len) reason = bad_input_reason(valid);
+    else if (key->len < *len) reason = "key is too short";
+    if (reason) unmap_file(*input, *input_fd);
+    return reason;
+}
+
+// Function to pick the next job to send, retries first; returns -1 if there is none, or if the
+// server has asked for a pause that is not over yet
+static int next_batch_job(struct batch *b) {
+    if (b->retry_count == 0 && b->next_job == b->job_count) return -1;
+    if (b->resume_at) {
+        if (now_ms() < b->resume_at) return -1;
+        b->resume_at = 0;
+    }
+    if (b->retry_count > 0) return b->retry[--b->retry_count];
+    return b->next_job++;
+}
+
+// Function to check a pending job and start sending it on a connection
+static void start_job(struct batch *b, int c, int index) {
+    struct batch_conn *conn = &b->conns[c];
+    struct batch_job *job = &b->jobs[index];
+    struct batch_key *key = &b->keys[job->key];
+
+    int input_fd;
+    size_t len;
+    const char *input;
+    const char *reason = open_job_input(b, job, &input, &input_fd, &len, 1);
+    if (!reason && len > FRAME_MAX_PAYLOAD) {
+        unmap_file(input, input_fd);
+        reason = "input is too large for batch mode";
+    }
+    if (reason) {
+        finish_job(b, job, reason);
+        return;
+    }
+
+    // Job ids are indexes into the batch, so responses can arrive in any order
+    struct frame_header header;
+    memset(&header, 0, sizeof(header));
+    header.id = index;
+    header.payload_len = len;
+    if (key->key_id) {
+        header.flags = FRAME_KEY_REF;
+        header.key_id = key->key_id;
+        header.key_len = KEY_TOKEN_LEN;
+    } else {
+        header.key_len = len;
+    }
+    encode_frame_header(&header, conn->header);
+
+    conn->iov[0].iov_base = conn->header;
+    conn->iov[0].iov_len = sizeof(conn->header);
+    conn->iov[1].iov_base = (void *)input;
+    conn->iov[1].iov_len = len;
+    conn->iov[2].iov_base = key->key_id ? (void *)key->token : (void *)key->data;
+    conn->iov[2].iov_len = key->key_id ? KEY_TOKEN_LEN : len;
+    if (b->packed) {
+        // Packed requests go out from the connection's own buffer: the payload, then the key unless
+        // its token goes instead
+        size_t size = OTP_PACKED_SIZE(len);
+        size_t need = key->key_id ? size : 2 * size;
+        if (need > conn->packed_cap) {
+            conn->packed = realloc(conn->packed, need);
+            if (!conn->packed) error("Error allocating packed buffer");
+            conn->packed_cap = need;
+        }
+        otp_pack(input, conn->packed, len);
+        if (!key->key_id) otp_pack(key->data, conn->packed + size, len);
+        conn->iov[1].iov_base = conn->packed;
+        conn->iov[1].iov_len = size;
+        if (!key->key_id) {
+            conn->iov[2].iov_base = conn->packed + size;
+            conn->iov[2].iov_len = size;
+        }
+    }
+    conn->iov_count = 3;
+    conn->iov_pos = 0;
+    conn->mapped = input;
+    conn->mapped_fd = input_fd;
+    conn->sending = 1;
+    conn->in_flight++;
+
+    job->state = BATCH_SENT;
+    job->conn = c;
+    continue_send(b, c);
+}
+
+// Function to write a finished job's result and a trailing newline to its output file
+static const char *write_result_file(const char *filename, const char *result, size_t len) {
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return "could not open output file";
+
+    int ok = write_full(fd, result, len) == 0 && write_full(fd, "\n", 1) == 0;
+    if (close(fd) < 0) ok = 0;
+    return ok ? NULL : "could not write output file";
+}
+
+// Function to handle a complete response from a connection
+static void complete_response(struct batch *b, int c) {
+    struct batch_conn *conn = &b->conns[c];
+    struct frame_header *response = &conn->response;
+
+    // A response must answer a job that is waiting on this connection
+    if (response->id >= (uint32_t)b->job_count || b->jobs[response->id].state != BATCH_SENT ||
+        b->jobs[response->id].conn != c) {
+        fprintf(stderr, "Error: unexpected response from server\n");
+        fail_connection(b, c);
+        return;
+    }
+
+    struct batch_job *job = &b->jobs[response->id];
+    conn->in_flight--;
+    if (response->status == STATUS_BUSY && ++job->busy < RETRY_ATTEMPTS) {
+        // Send the job again once the server has had time to catch up, and hold back every other job until then
+        job->state = BATCH_PENDING;
+        b->retry[b->retry_count++] = response->id;
+        uint64_t resume_at = now_ms() + backoff_ms(job->busy - 1, response->retry_after_ms);
+        if (resume_at > b->resume_at) b->resume_at = resume_at;
+    } else if (response->status != STATUS_OK) {
+        char reason[64];
+        snprintf(reason, sizeof(reason), "server rejected the job (status %u)", response->status);
+        finish_job(b, job, reason);
+    } else if (b->packed) {
+        if (response->payload_len > b->text_cap) {
+            b->text = realloc(b->text, response->payload_len);
+            if (!b->text) error("Error allocating result buffer");
+            b->text_cap = response->payload_len;
+        }
+        otp_unpack(conn->result, b->text, response->payload_len);
+        finish_job(b, job, write_result_file(job->output, b->text, response->payload_len));
+    } else {
+        finish_job(b, job, write_result_file(job->output, conn->result, response->payload_len));
+    }
+}
+
+// Function to read whatever has arrived on a connection and complete every full response
+static void receive_responses(struct batch *b, int c) {
+    struct batch_conn *conn = &b->conns[c];
+    for (;;) {
+        // A response is complete once its header and its whole result are in
+        if (conn->header_got == sizeof(conn->wire) && conn->result_got == conn->result_len) {
+            complete_response(b, c);
+            if (conn->fd < 0) return;
+            conn->header_got = 0;
+            if (conn->in_flight == 0) return; // Nothing more to wait for
+            continue;
+        }
+
+        // Read the rest of the header, then the result that follows it
+        int in_header = conn->header_got < sizeof(conn->wire);
+        ssize_t n = in_header
+            ? read(conn->fd, conn->wire + conn->header_got, sizeof(conn->wire) - conn->header_got)
+            : read(conn->fd, conn->result + conn->result_got, conn->result_len - conn->result_got);
+        if (n == 0) {
+            fail_connection(b, c); // Server closed the connection
+            return;
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) fail_connection(b, c);
+            return;
+        }
+
+        if (!in_header) {
+            conn->result_got += n;
+            continue;
+        }
+        conn->header_got += n;
+        if (conn->header_got < sizeof(conn->wire)) continue;
+
+        // The header is in: make room for the result
+        decode_frame_header(conn->wire, &conn->response);
+        if (conn->response.payload_len > FRAME_MAX_PAYLOAD) {
+            fprintf(stderr, "Error: oversized response from server\n");
+            fail_connection(b, c);
+            return;
+        }
+        conn->result_len = b->packed ? OTP_PACKED_SIZE((size_t)conn->response.payload_len) : conn->response.payload_len;
+        if (conn->result_len > conn->result_cap) {
+            conn->result = realloc(conn->result, conn->result_len);
+            if (!conn->result) error("Error allocating result buffer");
+            conn->result_cap = conn->result_len;
+        }
+        conn->result_got = 0;
+    }
+}
+
+// Function to run every job in a batch over a pool of pipelined framed connections
+static int run_batch(struct batch *b, const char *address, int connections, const struct client_config *config) {
+    if (connections > b->job_count) connections = b->job_count;
+    if (connections < 1) connections = 1;
+
+    b->conns = calloc(connections, sizeof(*b->conns));
+    b->retry = malloc((b->job_count + 1) * sizeof(*b->retry));
+    if (!b->conns || !b->retry) error("Error allocating connections");
+    b->conn_count = connections;
+
+    // Open every connection and switch it to framed mode; the first one settles whether symbols
+    // are packed, and the rest follow it
+    for (int c = 0; c < connections; c++) {
+        int packed = b->packed;
+        b->conns[c].fd = start_framed(connect_server(address, config), address, config, &packed);
+        if (c == 0) b->packed = packed;
+        else if (packed != b->packed) error("Error switching to packed mode");
+    }
+
+    // Upload each key once so that jobs carry only their payload; keys the server will not store go inline
+    for (int i = 0; i < b->key_count; i++) {
+        struct batch_key *key = &b->keys[i];
+        if (!key->data || key->len == 0 || key->len > FRAME_MAX_PAYLOAD) continue;
+        int status;
+        if (b->packed) {
+            struct frame_header request, response;
+            memset(&request, 0, sizeof(request));
+            request.flags = FRAME_KEY_UPLOAD;
+            request.payload_len = key->len;
+            status = -1;
+            if (send_packed_frame(b->conns[0].fd, &request, key->data, NULL) == 0 &&
+                recv_frame_header(b->conns[0].fd, &response) == 1) {
+                status = response.status;
+                key->key_id = response.key_id;
+
+                // The token comes unpacked, as it is
+                if (status == STATUS_OK && (response.payload_len != KEY_TOKEN_LEN ||
+                                            read_full(b->conns[0].fd, key->token, KEY_TOKEN_LEN) != KEY_TOKEN_LEN))
+                    status = -1;
+            }
+        } else {
+            status = upload_key(b->conns[0].fd, key->data, key->len, &key->key_id, key->token);
+        }
+        if (status < 0) error("Error uploading key");
+        if (status != STATUS_OK) key->key_id = 0;
+    }
+
+    for (int c = 0; c < connections; c++) {
+        int flags = fcntl(b->conns[c].fd, F_GETFL);
+        fcntl(b->conns[c].fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    struct pollfd *fds = calloc(connections, sizeof(*fds));
+    if (!fds) error("Error allocating poll set");
+
+    while (b->finished < b->job_count) {
+        // Keep every live connection's window full
+        int live = 0;
+        int index;
+        for (int c = 0; c < connections; c++) {
+            struct batch_conn *conn = &b->conns[c];
+            while (conn->fd >= 0 && !conn->sending && conn->in_flight < BATCH_WINDOW &&
+                   (index = next_batch_job(b)) >= 0)
+                start_job(b, c, index);
+
+            fds[c].fd = conn->fd;
+            fds[c].events = (conn->sending ? POLLOUT : 0) | (conn->in_flight ? POLLIN : 0);
+            fds[c].revents = 0;
+            if (conn->fd >= 0 && fds[c].events) live++;
+        }
+        if (b->finished == b->job_count) break;
+
+        // While backing off from a busy server, wake up in time to send again
+        int timeout = -1;
+        if (b->resume_at) {
+            uint64_t now = now_ms();
+            if (b->resume_at <= now) {
+                // The pause is over: go round again to send
+                b->resume_at = 0;
+                continue;
+            }
+            timeout = b->resume_at - now;
+        }
+
+        // Every connection has failed; the remaining jobs cannot be sent
+        if (live == 0 && timeout < 0) {
+            while (b->retry_count > 0)
+                finish_job(b, &b->jobs[b->retry[--b->retry_count]], "no connection to server");
+            while (b->next_job < b->job_count)
+                finish_job(b, &b->jobs[b->next_job++], "no connection to server");
+            break;
+        }
+
+        if (poll(fds, connections, timeout) < 0) {
+            if (errno == EINTR) continue;
+            error("Error waiting for server");
+        }
+
+        for (int c = 0; c < connections; c++) {
+            if (b->conns[c].fd < 0 || !fds[c].revents) continue;
+            if (fds[c].revents & POLLOUT) continue_send(b, c);
+            if (b->conns[c].fd >= 0 && (fds[c].revents & (POLLIN | POLLERR | POLLHUP)))
+                receive_responses(b, c);
+        }
+    }
+
+    for (int c = 0; c < connections; c++) {
+        if (b->conns[c].fd >= 0) close(b->conns[c].fd);
+        free(b->conns[c].result);
+        free(b->conns[c].packed);
+    }
+    free(b->text);
+    free(b->retry);
+    free(fds);
+
+    if (b->failed) fprintf(stderr, "%d of %d files failed\n", b->failed, b->job_count);
+    return b->failed ? 1 : 0;
+}
+
+// Function to transform a whole message in-process and write it, then a newline, to out in large blocks.
+// The caller has validated the input; returns 0, or -1 if writing failed.
+static int transform_to_output(const char *input, const char *key, size_t len, struct output *out,
+                               const struct client_config *config) {
+    // Aligned, so an O_DIRECT output takes the blocks without copying them
+    size_t block = len < LOCAL_BLOCK_SIZE ? len : LOCAL_BLOCK_SIZE;
+    char *buffer;
+    if (posix_memalign((void **)&buffer, OUTPUT_ALIGN, block ? block : 1) != 0) return -1;
+
+    // The same kernels the server runs, spread over every core for large blocks
+    for (size_t done = 0; done < len; done += block) {
+        size_t n = len - done < block ? len - done : block;
+        if (otp_parallel_checked(config->transform, input + done, key + done, buffer, n) < n ||
+            write_output(out, buffer, n) < 0) {
+            free(buffer);
+            return -1;
+        }
+    }
+    free(buffer);
+    return write_output(out, "\n", 1);
+}
+
+// Function to transform one message without a server; the output matches what the server path writes
+static int run_local(const char *input_file, const char *key_file, const char *output_file, int direct,
+                     const struct client_config *config) {
+    int input_fd, key_fd;
+    size_t input_len, key_len;
+    const char *input = map_file(input_file, &input_fd, &input_len);
+    const char *key = map_file(key_file, &key_fd, &key_len);
+    if (!input || !key) exit(1);
+
+    // Validate the input before the output is opened, as the server path does, so a bad input never
+    // truncates an existing file or leaves part of a result behind
+    size_t valid = otp_validate(input, input_len);
+    if (valid < input_len) {
+        fprintf(stderr, "Error: input contains a bad character at offset %zu\n", valid);
+        exit(1);
+    }
+
+    // Ensure the key is at least as long as the input
+    if (key_len < input_len) {
+        fprintf(stderr, "Error: key is too short\n");
+        exit(1);
+    }
+
+    struct output out;
+    if (open_output(&out, output_file, direct, input_len + 1) < 0)
+        error("Error opening output file");
+    if (transform_to_output(input, key, input_len, &out, config) < 0 || close_output(&out) < 0)
+        error("Error writing result");
+    return 0;
+}
+
+// Function to run every job in a batch in-process, one after another
+static int run_local_batch(struct batch *b, const struct client_config *config) {
+    for (int i = 0; i < b->job_count; i++) {
+        struct batch_job *job = &b->jobs[i];
+        int input_fd;
+        size_t len;
+        const char *input;
+        // Bad inputs are turned away before their output file is opened, so a file already there is left alone
+        const char *reason = open_job_input(b, job, &input, &input_fd, &len, 1);
+        if (reason) {
+            finish_job(b, job, reason);
+            continue;
+        }
+
+        struct output out;
+        if (open_output(&out, job->output, 0, len + 1) < 0) {
+            reason = "could not open output file";
+        } else {
+            if (transform_to_output(input, b->keys[job->key].data, len, &out, config) < 0) reason = "could not write output file";
+            if (close_output(&out) < 0) reason = "could not write output file";
+        }
+        unmap_file(input, input_fd);
+        finish_job(b, job, reason);
+    }
+
+    if (b->failed) fprintf(stderr, "%d of %d files failed\n", b->failed, b->job_count);
+    return b->failed ? 1 : 0;
+}
+
+// Function to print how the client is used
+static void usage(const char *program, const struct client_config *config) {
+    fprintf(stderr, "Usage: %s [-s | -f [-z] | -S] [-o output_file [--direct]] %s_file key_file port|socket_path\n",
+            program, config->input_name);
+    fprintf(stderr, "       %s [-j connections] [-z] -b manifest_file port\n", program);
+    fprintf(stderr, "       %s [-j connections] [-z] -d input_dir -o output_dir key_file port\n", program);
+    fprintf(stderr, "       %s --local [-o output_file [--direct]] %s_file key_file\n", program, config->input_name);
+    fprintf(stderr, "       %s --local -b manifest_file | --local -d input_dir -o output_dir key_file\n", program);
+    exit(1);
+}
+
+// Function to parse the command line and run the client
+int client_main(int argc, char *argv[], const struct client_config *config) {
+    // Parse options; -s forces stream mode even for short messages, -f sends a framed job, -S passes
+    // the message through shared memory, -b and -d run a batch over -j connections, -z packs the
+    // symbols of framed jobs and batches, and --local skips the server entirely. -o names the output
+    // directory of a -d batch, or the file a single result is written to instead of standard output,
+    // with O_DIRECT if --direct is given.
+    static const struct option long_options[] = {
+        { "local", no_argument, NULL, 'L' },
+        { "direct", no_argument, NULL, 'D' },
+        { NULL, 0, NULL, 0 }
+    };
+    int local = 0;
+    int direct = 0;
+    int stream_mode = 0;
+    int framed_mode = 0;
+    int shared_mode = 0;
+    int packed = 0;
+    int connections = BATCH_CONNECTIONS;
+    const char *manifest = NULL;
+    const char *input_dir = NULL;
+    const char *output = NULL;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "sfSzj:b:d:o:", long_options, NULL)) != -1) {
+        if (opt == 'L') {
+            local = 1;
+        } else if (opt == 'D') {
+            direct = 1;
+        } else if (opt == 's') {
+            stream_mode = 1;
+        } else if (opt == 'f') {
+            framed_mode = 1;
+        } else if (opt == 'S') {
+            shared_mode = 1;
+        } else if (opt == 'z') {
+            packed = 1;
+        } else if (opt == 'j') {
+            connections = atoi(optarg);
+            if (connections < 1) usage(argv[0], config);
+        } else if (opt == 'b') {
+            manifest = optarg;
+        } else if (opt == 'd') {
+            input_dir = optarg;
+        } else if (opt == 'o') {
+            output = optarg;
+        } else {
+            usage(argv[0], config);
+        }
+    }
+
+    // Local runs take the same arguments without the port
+    int port_args = local ? 0 : 1;
+
+    if (manifest) {
+        // Batch from a manifest: the port is the only positional argument
+        if (argc - optind != port_args || input_dir || output || direct) usage(argv[0], config);
+        struct batch b;
+        memset(&b, 0, sizeof(b));
+        read_manifest(&b, manifest);
+        b.packed = packed;
+        if (local) return run_local_batch(&b, config);
+        return run_batch(&b, argv[optind], connections, config);
+    }
+
+    if (input_dir) {
+        // Batch over a directory: every file is transformed with the one key file
+        if (argc - optind != 1 + port_args || !output || direct) usage(argv[0], config);
+        struct batch b;
+        memset(&b, 0, sizeof(b));
+        read_directory(&b, input_dir, output, argv[optind]);
+        b.packed = packed;
+        if (local) return run_local_batch(&b, config);
+        return run_batch(&b, argv[optind + 1], connections, config);
+    }
+
+    // Check for proper usage with the required number of arguments
+    if (argc - optind != 2 + port_args || (direct && !output)) usage(argv[0], config);
+    if (local) return run_local(argv[optind], argv[optind + 1], output, direct, config);
+    return run_single(argv[optind], argv[optind + 1], argv[optind + 2], output, direct, stream_mode, framed_mode,
+                      shared_mode, packed, config);
+}
@@ -0,0 +1,50 @@
+// client_core.h
+#ifndef CLIENT_CORE_H
+#define CLIENT_CORE_H
+
+#include <stddef.h>
+
+#define BUFFER_SIZE 1024 // Define the maximum buffer size for data
+
+// Default number of connections kept open in batch mode
+#define BATCH_CONNECTIONS 4
+
+// Most jobs in flight on one batch connection at a time
+#define BATCH_WINDOW 32
+
+// Backoff when the server is busy: the first wait is at least RETRY_BASE_MS (or the server's hint),
+// it doubles with each attempt up to RETRY_MAX_MS, and the client gives up after RETRY_ATTEMPTS
+#define RETRY_BASE_MS 10
+#define RETRY_MAX_MS 2000
+#define RETRY_ATTEMPTS 10
+
+// --local transforms and writes the result in blocks this big, so memory use does not grow with the file
+#define LOCAL_BLOCK_SIZE (16 * 1024 * 1024)
+
+// Results that cannot be spliced from the socket are read into a buffer this big, aligned to
+// OUTPUT_ALIGN so that an output opened with O_DIRECT can be written from it
+#define OUTPUT_BUFFER_SIZE (1024 * 1024)
+#define OUTPUT_ALIGN 4096
+
+// What differs between the encryption and decryption clients
+struct client_config {
+    const char *client_handshake; // Sent to identify the client
+    const char *server_handshake; // Expected back from the right kind of server
+    const char *input_name;       // "plaintext" or "ciphertext", for usage and error messages
+    size_t (*transform)(const char *input, const char *key, char *output, size_t len); // Run in-process by --local, validating as it goes
+};
+
+// Function to handle errors and terminate the program
+void error(const char *msg);
+
+// Map a file read-only and set len to its length without a trailing newline; returns NULL on failure
+const char *map_file(const char *filename, int *fd, size_t *len);
+
+// Connect to the server and complete the handshake, backing off and retrying while the server is
+// busy; exits on failure. The address is a port on localhost, or a Unix socket path if it contains a '/'.
+int connect_server(const char *address, const struct client_config *config);
+
+// Parse the command line and run a single message or a batch; returns the exit status
+int client_main(int argc, char *argv[], const struct client_config *config);
+
+#endif
@@ -1,45 +1,186 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <time.h>
-
-// Define the allowed characters for the key and their count (This is inefficient but I'm lazy)
-#define ALLOWED_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZ "
-#define CHAR_COUNT 27
-
-// Function to generate a random key of specified length
-void generate_key(int length) {
-    // Seed the random number generator with the current time
-    srand((unsigned int)time(NULL));
-
-    for (int i = 0; i < length; i++) {
-        // Generate a random index within the range of allowed characters
-        int random_index = rand() % CHAR_COUNT;
-        // Print the corresponding character from the allowed set
-        printf("%c", ALLOWED_CHARS[random_index]);
-    }
-
-    // Add a newline character at the end for proper formatting
-    printf("\n");
-}
-
-int main(int argc, char *argv[]) {
-    // Check if the user provided exactly one argument for key length (Don't do more than one >:( )
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s key_length\n", argv[0]);
-        exit(EXIT_FAILURE); // Exit with failure if the usage is incorrect
-    }
-
-    // Parse the key length from the command-line argument
-    int key_length = atoi(argv[1]);
-    // Validate that the key length is a positive integer
-    if (key_length <= 0) {
-        fprintf(stderr, "Error: key_length must be a positive integer.\n");
-        exit(EXIT_FAILURE); // Exit with failure if the input is invalid
-    }
-
-    // Call the function to generate and print the key
-    generate_key(key_length);
-
-    // Exit the program successfully
-    return 0;
-}
+#define _GNU_SOURCE // For getrandom
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>     // For generating large keys on several threads
+#include <sys/random.h>  // For getrandom, the kernel's ChaCha20-based CSPRNG
+
+#include "otp_alphabet.h" // For the key alphabet and its compile-time character table
+
+// Bytes below the largest multiple of the alphabet size that fits in a byte's 256 values are
+// accepted and the rest rejected, so that every character is exactly equally likely
+#if 256 % OTP_ALPHABET_SIZE == 0
+#define ACCEPTED(b) 1
+#else
+#define ACCEPTED(b) ((b) < 256 - 256 % OTP_ALPHABET_SIZE)
+#endif
+
+// Characters generated and written per block, and random bytes pulled per getrandom call
+#define BLOCK_SIZE (1 << 20)
+#define RANDOM_BATCH 65536
+
+// Keys at least this long are generated on one thread per core
+#define PARALLEL_THRESHOLD (4 * BLOCK_SIZE)
+
+// Work shared by the generator threads: block b is made by thread b % threads, and blocks are written in order
+struct keygen_state {
+    size_t length;
+    size_t blocks;
+    int threads;
+    size_t next_block; // The only block allowed to be written right now
+    pthread_mutex_t lock;
+    pthread_cond_t turn;
+};
+
+struct generator {
+    struct keygen_state *state;
+    int index;
+};
+
+// Function to fill a buffer with cryptographically secure random bytes
+static void fill_random(unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = getrandom(buf, len, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error: getrandom failed");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Function to write a whole block to standard output
+static void write_block(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("Error: could not write key");
+            exit(EXIT_FAILURE);
+        }
+        buf += n;
+        len -= n;
+    }
+}
+
+// Function to generate len characters by rejection sampling batches of random bytes
+static void generate_block(char *out, size_t len, unsigned char *random) {
+    size_t filled = 0;
+    while (filled < len) {
+        fill_random(random, RANDOM_BATCH);
+        for (size_t i = 0; i < RANDOM_BATCH && filled < len; i++) {
+            // Branch-free: always store, but only advance past bytes below the limit
+            // otp_char_of[b] is the character of b modulo the alphabet size
+            out[filled] = otp_char_of[random[i]];
+            filled += ACCEPTED(random[i]);
+        }
+    }
+}
+
+// Function run by each generator: make its blocks, then write each one when its turn comes
+static void *generate_segment(void *arg) {
+    struct generator *generator = arg;
+    struct keygen_state *state = generator->state;
+    char *block = malloc(BLOCK_SIZE);
+    unsigned char *random = malloc(RANDOM_BATCH);
+    if (!block || !random) {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t b = generator->index; b < state->blocks; b += state->threads) {
+        size_t start = b * BLOCK_SIZE;
+        size_t len = state->length - start < BLOCK_SIZE ? state->length - start : BLOCK_SIZE;
+        generate_block(block, len, random);
+
+        // Wait for every earlier block to be written
+        pthread_mutex_lock(&state->lock);
+        while (state->next_block != b) pthread_cond_wait(&state->turn, &state->lock);
+        pthread_mutex_unlock(&state->lock);
+
+        write_block(block, len);
+
+        pthread_mutex_lock(&state->lock);
+        state->next_block++;
+        pthread_cond_broadcast(&state->turn);
+        pthread_mutex_unlock(&state->lock);
+    }
+
+    free(block);
+    free(random);
+    return NULL;
+}
+
+// Function to generate a random key of specified length
+void generate_key(size_t length) {
+    struct keygen_state state;
+    state.length = length;
+    state.blocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    state.next_block = 0;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.turn, NULL);
+
+    // Small keys are not worth starting threads for
+    state.threads = 1;
+    if (length >= PARALLEL_THRESHOLD) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cores > 1) state.threads = cores;
+    }
+
+    struct generator *generators = malloc(state.threads * sizeof(*generators));
+    pthread_t *threads = malloc(state.threads * sizeof(*threads));
+    if (!generators || !threads) {
+        fprintf(stderr, "Error: memory allocation failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < state.threads; i++) {
+        generators[i].state = &state;
+        generators[i].index = i;
+    }
+
+    if (state.threads == 1) {
+        generate_segment(&generators[0]);
+    } else {
+        for (int i = 0; i < state.threads; i++) {
+            if (pthread_create(&threads[i], NULL, generate_segment, &generators[i]) != 0) {
+                fprintf(stderr, "Error: could not start generator thread\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (int i = 0; i < state.threads; i++) pthread_join(threads[i], NULL);
+    }
+
+    // Add a newline character at the end for proper formatting
+    write_block("\n", 1);
+
+    free(generators);
+    free(threads);
+}
+
+int main(int argc, char *argv[]) {
+    // Check if the user provided exactly one argument for key length (Don't do more than one >:( )
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s key_length\n", argv[0]);
+        exit(EXIT_FAILURE); // Exit with failure if the usage is incorrect
+    }
+
+    // Parse the key length from the command-line argument; keys may be larger than an int
+    char *end;
+    long long key_length = strtoll(argv[1], &end, 10);
+    // Validate that the key length is a positive integer
+    if (*end != '\0' || key_length <= 0) {
+        fprintf(stderr, "Error: key_length must be a positive integer.\n");
+        exit(EXIT_FAILURE); // Exit with failure if the input is invalid
+    }
+
+    // Call the function to generate and print the key
+    generate_key((size_t)key_length);
+
+    // Exit the program successfully
+    return 0;
+}
@@ -0,0 +1,189 @@
+// keystore.c
+
+#define _GNU_SOURCE // For MAP_ANONYMOUS and MAP_NORESERVE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>    // For the process-shared allocation lock
+#include <sys/mman.h>   // For the shared mapping
+#include <sys/random.h> // For the keys' tokens
+
+#include "keystore.h"
+
+// What a slot of the entry table holds
+enum key_state {
+    KEY_FREE,  // Nothing: the slot can be given to a new key
+    KEY_READY, // A key that can be looked up; set last, with release ordering, once it is in place
+    KEY_DYING  // A released key still held by a job; freed when the last holder lets go
+};
+
+// Where one key lives in the data area
+struct key_entry {
+    size_t offset;
+    size_t len;
+    uint64_t owner;
+    uint64_t serial;
+    unsigned char token[KEY_TOKEN_LEN];
+    uint32_t refs; // Holders from key_store_get
+    int state;
+};
+
+// Layout of the start of the mapping; key bytes follow it
+struct key_store {
+    pthread_mutex_t lock; // Serializes changes across processes and threads; lookups never take it
+    size_t capacity;
+    uint64_t owners;      // Last owner handed out
+    uint64_t serials;     // Last serial handed out
+    uint32_t count;       // Keys taking space: ready ones and dying ones
+    uint32_t order[KEY_STORE_MAX_KEYS]; // Their slots by increasing offset, to find free space between them
+    struct key_entry entries[KEY_STORE_MAX_KEYS];
+    char data[];
+};
+
+// Function to map a new, empty store shared with every process forked after this call
+struct key_store *key_store_create(size_t capacity) {
+    // MAP_NORESERVE keeps a large store cheap until keys are actually uploaded
+    struct key_store *store = mmap(NULL, sizeof(struct key_store) + capacity, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (store == MAP_FAILED) return NULL;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutex_init(&store->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    store->capacity = capacity;
+    return store;
+}
+
+// Function to hand out an owner; 0 is never one, so a session can use it for "no keys yet"
+uint64_t key_store_owner(struct key_store *store) {
+    return __atomic_add_fetch(&store->owners, 1, __ATOMIC_RELAXED);
+}
+
+// Function to fill a token from the kernel's random number generator
+static int fill_token(unsigned char *token) {
+    size_t filled = 0;
+    while (filled < KEY_TOKEN_LEN) {
+        ssize_t n = getrandom(token + filled, KEY_TOKEN_LEN - filled, 0);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        filled += n;
+    }
+    return 0;
+}
+
+// Function to add a key in the first gap big enough for it; handles start at 1 so that 0 never names a key
+int key_store_add(struct key_store *store, const char *key, size_t len, uint64_t owner, uint32_t *id,
+                  unsigned char *token) {
+    pthread_mutex_lock(&store->lock);
+    if (store->count == KEY_STORE_MAX_KEYS) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+
+    // Keys are kept in offset order, so the gaps are between neighbours and after the last one
+    size_t offset = 0;
+    uint32_t at = 0;
+    while (at < store->count) {
+        const struct key_entry *next = &store->entries[store->order[at]];
+        if (next->offset - offset >= len) break;
+        offset = next->offset + next->len;
+        at++;
+    }
+    if (at == store->count && len > store->capacity - offset) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+
+    uint32_t slot = 0;
+    while (store->entries[slot].state != KEY_FREE) slot++;
+    struct key_entry *entry = &store->entries[slot];
+    if (fill_token(entry->token) < 0) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    entry->offset = offset;
+    entry->len = len;
+    entry->owner = owner;
+    entry->serial = ++store->serials;
+    memcpy(store->data + offset, key, len);
+    memmove(&store->order[at + 1], &store->order[at], (store->count - at) * sizeof(store->order[0]));
+    store->order[at] = slot;
+    store->count++;
+    memcpy(token, entry->token, KEY_TOKEN_LEN);
+    *id = slot + 1;
+
+    // Publish the entry only after its bytes are written, so lock-free readers never see a partial key
+    __atomic_store_n(&entry->state, KEY_READY, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&store->lock);
+    return 0;
+}
+
+// Function to compare tokens in constant time, so a wrong guess says nothing about how close it was
+static int token_equal(const unsigned char *a, const unsigned char *b) {
+    unsigned char diff = 0;
+    for (int i = 0; i < KEY_TOKEN_LEN; i++) diff |= a[i] ^ b[i];
+    return diff == 0;
+}
+
+// Function to find a key by handle and token, holding it
+const char *key_store_get(struct key_store *store, uint32_t id, const unsigned char *token, size_t *len,
+                          uint64_t *serial) {
+    if (id == 0 || id > KEY_STORE_MAX_KEYS) return NULL;
+
+    struct key_entry *entry = &store->entries[id - 1];
+    if (__atomic_load_n(&entry->state, __ATOMIC_ACQUIRE) != KEY_READY) return NULL;
+
+    // The hold is taken before the entry is checked again, so a key released in between is either
+    // seen as released here or not freed until this hold is let go
+    __atomic_add_fetch(&entry->refs, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&entry->state, __ATOMIC_SEQ_CST) != KEY_READY || !token_equal(entry->token, token)) {
+        key_store_put(store, id);
+        return NULL;
+    }
+
+    *len = entry->len;
+    *serial = entry->serial;
+    return store->data + entry->offset;
+}
+
+// Function to give a dying key's space and slot back, with the lock held, once nobody holds it
+static void free_if_unused(struct key_store *store, uint32_t slot) {
+    struct key_entry *entry = &store->entries[slot];
+    if (entry->state != KEY_DYING || __atomic_load_n(&entry->refs, __ATOMIC_SEQ_CST) != 0) return;
+
+    uint32_t at = 0;
+    while (store->order[at] != slot) at++;
+    memmove(&store->order[at], &store->order[at + 1], (store->count - at - 1) * sizeof(store->order[0]));
+    store->count--;
+    __atomic_store_n(&entry->state, KEY_FREE, __ATOMIC_RELEASE);
+}
+
+// Function to drop a hold; the last holder of a released key frees it
+void key_store_put(struct key_store *store, uint32_t id) {
+    struct key_entry *entry = &store->entries[id - 1];
+    if (__atomic_sub_fetch(&entry->refs, 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&entry->state, __ATOMIC_SEQ_CST) == KEY_DYING) {
+        pthread_mutex_lock(&store->lock);
+        free_if_unused(store, id - 1);
+        pthread_mutex_unlock(&store->lock);
+    }
+}
+
+// Function to release an owner's keys, freeing those nobody holds
+void key_store_release(struct key_store *store, uint64_t owner) {
+    pthread_mutex_lock(&store->lock);
+    for (uint32_t slot = 0; slot < KEY_STORE_MAX_KEYS; slot++) {
+        struct key_entry *entry = &store->entries[slot];
+        if (entry->state != KEY_READY || entry->owner != owner) continue;
+        __atomic_store_n(&entry->state, KEY_DYING, __ATOMIC_SEQ_CST);
+        free_if_unused(store, slot);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
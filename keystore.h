@@ -0,0 +1,41 @@
+// keystore.h
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h" // For KEY_TOKEN_LEN
+
+// Most keys one store can hold
+#define KEY_STORE_MAX_KEYS 4096
+
+// Registry of uploaded keys in one shared memory mapping. Created before the server forks or starts
+// threads, so every child process and worker sees the same keys. A key is found by its handle and
+// the random token it was given, so clients can only use keys whose token they were sent; it lives
+// until its owner, the session that uploaded it, releases its keys.
+struct key_store;
+
+// Map a store able to hold capacity bytes of key data; returns NULL on failure
+struct key_store *key_store_create(size_t capacity);
+
+// Pick an owner for a session's keys, unique for the life of the store
+uint64_t key_store_owner(struct key_store *store);
+
+// Copy a key into the store for owner, setting *id to its handle and token to its secret;
+// returns 0, or -1 when the store is full
+int key_store_add(struct key_store *store, const char *key, size_t len, uint64_t owner, uint32_t *id,
+                  unsigned char *token);
+
+// Look up a key by handle and token without locking, and hold it so it is not freed while in use.
+// Returns NULL for unknown handles and wrong tokens. *serial differs for every key ever added.
+const char *key_store_get(struct key_store *store, uint32_t id, const unsigned char *token, size_t *len,
+                          uint64_t *serial);
+
+// Let go of a key held by key_store_get
+void key_store_put(struct key_store *store, uint32_t id);
+
+// Free every key owner added; keys still held are freed when their last holder lets go
+void key_store_release(struct key_store *store, uint64_t owner);
+
+#endif
@@ -0,0 +1,138 @@
+// logring.c
+
+#define _GNU_SOURCE // For MAP_ANONYMOUS
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>     // For nanosleep while the ring is empty
+#include <unistd.h>
+#include <pthread.h>  // For the drain thread
+#include <sys/mman.h> // For the shared mapping
+
+#include "logring.h"
+
+// How long the drain thread sleeps when it finds the ring empty
+#define DRAIN_INTERVAL_NS (10 * 1000 * 1000)
+
+// One queued line. seq tells producers and the drain thread whose turn the slot is:
+// it equals the claiming position when free, and that position + 1 once the line is written.
+struct log_slot {
+    uint64_t seq;
+    uint32_t len;
+    char line[LOG_LINE_MAX];
+};
+
+// Bounded multi-producer, single-consumer queue shared by every process and thread of the server
+struct log_ring {
+    int level;
+    uint64_t head;    // Next position producers claim
+    uint64_t tail;    // Next position the drain thread reads; only it touches this
+    uint64_t dropped;
+    struct log_slot slots[LOG_RING_SLOTS];
+};
+
+static struct log_ring *ring;
+
+// Prefix written in front of each level's lines
+static const char *level_names[] = { "ERROR", "WARN", "INFO", "DEBUG" };
+
+// Function to parse a level name
+int log_parse_level(const char *name) {
+    if (strcmp(name, "error") == 0) return LOG_ERROR;
+    if (strcmp(name, "warn") == 0) return LOG_WARN;
+    if (strcmp(name, "info") == 0) return LOG_INFO;
+    if (strcmp(name, "debug") == 0) return LOG_DEBUG;
+    return -1;
+}
+
+// Function run by the drain thread: copy finished lines to stderr in order, sleeping while there are none
+static void *drain_ring(void *arg) {
+    (void)arg;
+    while (1) {
+        struct log_slot *slot = &ring->slots[ring->tail % LOG_RING_SLOTS];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->tail + 1) {
+            struct timespec pause = { 0, DRAIN_INTERVAL_NS };
+            nanosleep(&pause, NULL);
+            continue;
+        }
+
+        // Plain write rather than stdio, so a child forked meanwhile never inherits a held stream lock
+        if (write(STDERR_FILENO, slot->line, slot->len) < 0) {
+            // Nowhere left to report the failure; the line is lost
+        }
+
+        // Hand the slot back to producers one lap later
+        __atomic_store_n(&slot->seq, ring->tail + LOG_RING_SLOTS, __ATOMIC_RELEASE);
+        ring->tail++;
+    }
+    return NULL;
+}
+
+// Function to map the ring and start draining it
+int log_ring_start(enum log_level level) {
+    ring = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED) {
+        ring = NULL;
+        return -1;
+    }
+
+    ring->level = level;
+    for (uint64_t i = 0; i < LOG_RING_SLOTS; i++) ring->slots[i].seq = i;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, drain_ring, NULL) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
+
+// Function to check a level against the configured one
+int log_enabled(enum log_level level) {
+    return !ring || (int)level <= ring->level;
+}
+
+// Function to format a line and queue it, dropping it if the ring is full
+void log_message(enum log_level level, const char *format, ...) {
+    if (!log_enabled(level)) return;
+
+    char line[LOG_LINE_MAX];
+    int prefix = snprintf(line, sizeof(line), "%s: ", level_names[level]);
+    va_list args;
+    va_start(args, format);
+    int len = prefix + vsnprintf(line + prefix, sizeof(line) - prefix - 1, format, args);
+    va_end(args);
+    if (len > LOG_LINE_MAX - 2) len = LOG_LINE_MAX - 2; // Truncated lines keep their newline
+    line[len++] = '\n';
+
+    if (!ring) {
+        fwrite(line, 1, len, stderr);
+        return;
+    }
+
+    // Claim a position; a slot whose seq lags the position is still waiting to be drained
+    uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    struct log_slot *slot;
+    while (1) {
+        slot = &ring->slots[pos % LOG_RING_SLOTS];
+        int64_t lag = (int64_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (lag == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (lag < 0) {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(slot->line, line, len);
+    slot->len = len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Function to report how many lines were dropped
+uint64_t log_dropped(void) {
+    return ring ? __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED) : 0;
+}
@@ -0,0 +1,35 @@
+// logring.h
+#ifndef LOGRING_H
+#define LOGRING_H
+
+#include <stdint.h>
+
+// Lines the ring holds before new ones are dropped, and the longest line kept
+#define LOG_RING_SLOTS 1024
+#define LOG_LINE_MAX 240
+
+// Severity of a log line; lines above the configured level are discarded before formatting
+enum log_level {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+// Map the ring in shared memory and start the thread that drains it to stderr. Call before
+// forking, so child processes log into the same ring; returns 0, or -1 on failure.
+int log_ring_start(enum log_level level);
+
+// Parse "error", "warn", "info" or "debug"; returns -1 for anything else
+int log_parse_level(const char *name);
+
+// Check whether lines at a level are kept, to skip work that only feeds a log line
+int log_enabled(enum log_level level);
+
+// Queue a line without blocking or making a syscall; before log_ring_start it goes straight to stderr
+void log_message(enum log_level level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Lines dropped because the ring was full
+uint64_t log_dropped(void);
+
+#endif
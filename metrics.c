@@ -0,0 +1,228 @@
+// metrics.c
+
+#define _GNU_SOURCE // For MAP_ANONYMOUS and open_memstream
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>       // For clock_gettime
+#include <unistd.h>
+#include <pthread.h>    // For the exporter thread
+#include <sys/mman.h>   // For the shared mapping
+#include <sys/socket.h>
+#include <sys/time.h>   // For the exporter's receive timeout
+#include <netinet/in.h>
+#include <arpa/inet.h>  // For binding the exporter to the loopback address
+
+#include "metrics.h"
+#include "logring.h"
+#include "protocol.h" // For writev_full
+
+// One thread's (or child process's) share of the counters, on its own cache lines
+struct metrics_slot {
+    uint64_t counters[METRIC_COUNTER_COUNT];
+    uint64_t buckets[STAGE_COUNT][METRIC_BUCKETS + 1]; // The last bucket is +Inf
+    uint64_t sum_ns[STAGE_COUNT];
+    uint64_t count[STAGE_COUNT];
+} __attribute__((aligned(64)));
+
+// Layout of the shared mapping; the exporter sums the slots when scraped
+struct metrics {
+    int64_t gauges[GAUGE_COUNT];
+    uint32_t next_slot;
+    struct metrics_slot slots[METRIC_SLOTS];
+};
+
+static struct metrics *metrics;
+static __thread struct metrics_slot *slot;
+
+// Names and help text used in the exposition
+static const char *counter_names[METRIC_COUNTER_COUNT][2] = {
+    { "otp_connections_accepted_total", "Connections accepted." },
+    { "otp_handshake_failures_total", "Connections closed for a wrong handshake." },
+    { "otp_bytes_received_total", "Bytes read from clients." },
+    { "otp_bytes_sent_total", "Bytes written to clients." },
+    { "otp_jobs_total", "Jobs answered." },
+    { "otp_job_failures_total", "Framed jobs answered with an error status." },
+    { "otp_busy_rejections_total", "Connections and framed jobs turned away because the server was busy." },
+    { "otp_cache_hits_total", "Jobs answered from the response cache." },
+    { "otp_cache_misses_total", "Jobs looked up in the response cache and transformed." },
+};
+static const char *gauge_names[GAUGE_COUNT][2] = {
+    { "otp_active_connections", "Connections open right now." },
+    { "otp_queue_depth", "Jobs waiting for a worker thread." },
+};
+static const char *stage_names[STAGE_COUNT] = { "handshake", "read", "queue", "transform", "write" };
+
+// Function to pick this thread's slot the first time it counts something
+static struct metrics_slot *my_slot(void) {
+    if (!slot) slot = &metrics->slots[__atomic_fetch_add(&metrics->next_slot, 1, __ATOMIC_RELAXED) % METRIC_SLOTS];
+    return slot;
+}
+
+// Function to read the monotonic clock
+uint64_t metrics_now(void) {
+    if (!metrics) return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Function to forget the inherited slot after fork
+void metrics_reset_thread(void) {
+    slot = NULL;
+}
+
+// Function to add to a counter; slots may be shared once there are more threads than slots, so adds stay atomic
+void metrics_add(enum metric_counter counter, uint64_t n) {
+    if (!metrics) return;
+    __atomic_fetch_add(&my_slot()->counters[counter], n, __ATOMIC_RELAXED);
+}
+
+// Function to move a gauge up or down
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta) {
+    if (!metrics) return;
+    __atomic_fetch_add(&metrics->gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+// Function to record one latency sample ending now
+uint64_t metrics_observe(enum metric_stage stage, uint64_t start) {
+    if (!metrics) return 0;
+    uint64_t now = metrics_now();
+    metrics_record(stage, now - start);
+    return now;
+}
+
+// Function to record one latency sample of a known duration
+void metrics_record(enum metric_stage stage, uint64_t ns) {
+    if (!metrics) return;
+
+    // Bucket k counts samples of at most 2^k microseconds
+    uint64_t us = (ns + 999) / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket > METRIC_BUCKETS) bucket = METRIC_BUCKETS;
+
+    struct metrics_slot *s = my_slot();
+    __atomic_fetch_add(&s->buckets[stage][bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->sum_ns[stage], ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->count[stage], 1, __ATOMIC_RELAXED);
+}
+
+// Function to write every metric, summed over the slots, in Prometheus text format
+static void write_exposition(FILE *out) {
+    for (int c = 0; c < METRIC_COUNTER_COUNT; c++) {
+        uint64_t total = 0;
+        for (int i = 0; i < METRIC_SLOTS; i++) total += __atomic_load_n(&metrics->slots[i].counters[c], __ATOMIC_RELAXED);
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_names[c][0], counter_names[c][1],
+                counter_names[c][0], counter_names[c][0], (unsigned long long)total);
+    }
+
+    fprintf(out, "# HELP otp_log_dropped_total Log lines dropped because the log ring was full.\n"
+                 "# TYPE otp_log_dropped_total counter\notp_log_dropped_total %llu\n",
+            (unsigned long long)log_dropped());
+
+    for (int g = 0; g < GAUGE_COUNT; g++) {
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauge_names[g][0], gauge_names[g][1],
+                gauge_names[g][0], gauge_names[g][0],
+                (long long)__atomic_load_n(&metrics->gauges[g], __ATOMIC_RELAXED));
+    }
+
+    fprintf(out, "# HELP otp_stage_seconds Time spent in each stage of a request.\n"
+                 "# TYPE otp_stage_seconds histogram\n");
+    for (int st = 0; st < STAGE_COUNT; st++) {
+        uint64_t buckets[METRIC_BUCKETS + 1] = { 0 };
+        uint64_t sum_ns = 0, count = 0;
+        for (int i = 0; i < METRIC_SLOTS; i++) {
+            struct metrics_slot *s = &metrics->slots[i];
+            for (int b = 0; b <= METRIC_BUCKETS; b++) buckets[b] += __atomic_load_n(&s->buckets[st][b], __ATOMIC_RELAXED);
+            sum_ns += __atomic_load_n(&s->sum_ns[st], __ATOMIC_RELAXED);
+            count += __atomic_load_n(&s->count[st], __ATOMIC_RELAXED);
+        }
+
+        // Prometheus buckets are cumulative
+        uint64_t running = 0;
+        for (int b = 0; b < METRIC_BUCKETS; b++) {
+            running += buckets[b];
+            fprintf(out, "otp_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage_names[st],
+                    (double)(1ULL << b) * 1e-6, (unsigned long long)running);
+        }
+        running += buckets[METRIC_BUCKETS];
+        fprintf(out, "otp_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[st], (unsigned long long)running);
+        fprintf(out, "otp_stage_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[st], sum_ns * 1e-9);
+        fprintf(out, "otp_stage_seconds_count{stage=\"%s\"} %llu\n", stage_names[st], (unsigned long long)count);
+    }
+}
+
+// Function to answer one scrape: any request gets the current exposition
+static void serve_scrape(int fd) {
+    // Read (and ignore) the request so the client is not reset before it sees the response
+    char request[1024];
+    if (read(fd, request, sizeof(request)) < 0) return;
+
+    char *body = NULL;
+    size_t body_len = 0;
+    FILE *out = open_memstream(&body, &body_len);
+    if (!out) return;
+    write_exposition(out);
+    fclose(out);
+
+    char header[128];
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n",
+                              body_len);
+    // Header and body leave together, so a scraper never waits on a delayed second segment
+    struct iovec iov[2] = { { header, header_len }, { body, body_len } };
+    if (writev_full(fd, iov, 2) < 0)
+        log_message(LOG_WARN, "metrics scrape cut short: %s", strerror(errno));
+    free(body);
+}
+
+// Function run by the exporter thread: answer scrapes one at a time, forever
+static void *run_exporter(void *arg) {
+    int listen_socket = (int)(intptr_t)arg;
+    while (1) {
+        int fd = accept(listen_socket, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR && errno != ECONNABORTED) log_message(LOG_ERROR, "metrics accept: %s", strerror(errno));
+            continue;
+        }
+
+        // A stalled scraper must not hold up the next one for long
+        struct timeval timeout = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_scrape(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+// Function to map the counters and start the exporter
+int metrics_start(int port) {
+    struct metrics *shared = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) return -1;
+
+    // The exporter only listens on loopback; scraping from elsewhere goes through a local agent
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) return -1;
+    int yes = 1;
+    setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(listen_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_socket, 16) < 0) {
+        close(listen_socket);
+        return -1;
+    }
+
+    metrics = shared;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_exporter, (void *)(intptr_t)listen_socket) != 0) return -1;
+    pthread_detach(thread);
+    return 0;
+}
@@ -0,0 +1,64 @@
+// metrics.h
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+// Latency histograms have buckets at 1us, 2us, 4us, ... up to 2^(METRIC_BUCKETS-1) us, plus +Inf
+#define METRIC_BUCKETS 24
+
+// Independent counter slots; threads and child processes spread over them to avoid sharing cache lines
+#define METRIC_SLOTS 64
+
+// Monotonic totals
+enum metric_counter {
+    METRIC_CONNECTIONS,        // Connections accepted
+    METRIC_HANDSHAKE_FAILURES, // Connections closed for a wrong handshake
+    METRIC_BYTES_IN,           // Bytes read from clients
+    METRIC_BYTES_OUT,          // Bytes written to clients
+    METRIC_JOBS,               // Jobs answered
+    METRIC_JOB_FAILURES,       // Framed jobs answered with a non-OK status
+    METRIC_BUSY_REJECTIONS,    // Connections and framed jobs turned away because the server was busy
+    METRIC_CACHE_HITS,         // Jobs answered from the response cache
+    METRIC_CACHE_MISSES,       // Jobs looked up in the response cache and transformed
+    METRIC_COUNTER_COUNT
+};
+
+// Values that go up and down
+enum metric_gauge {
+    GAUGE_ACTIVE_CONNECTIONS, // Sessions open right now
+    GAUGE_QUEUE_DEPTH,        // Jobs waiting for a worker thread in epoll mode
+    GAUGE_COUNT
+};
+
+// Stages of a request, each with its own latency histogram
+enum metric_stage {
+    STAGE_HANDSHAKE, // Accept until the handshake is answered
+    STAGE_READ,      // Session ready until a whole job has been received
+    STAGE_QUEUE,     // Job complete until a worker thread picks it up (epoll mode)
+    STAGE_TRANSFORM, // Running the kernel or storing a key
+    STAGE_WRITE,     // Writing the response
+    STAGE_COUNT
+};
+
+// Map the shared counters and serve them in Prometheus text format on 127.0.0.1:port. Call
+// before forking, so child processes count into the same memory; returns 0, or -1 on failure.
+int metrics_start(int port);
+
+// Forget the calling thread's counter slot; call in a child after fork so it picks its own
+void metrics_reset_thread(void);
+
+// Monotonic time in nanoseconds, or 0 when metrics are off
+uint64_t metrics_now(void);
+
+// Add to a counter or gauge; no-ops when metrics are off
+void metrics_add(enum metric_counter counter, uint64_t n);
+void metrics_gauge_add(enum metric_gauge gauge, int64_t delta);
+
+// Record the time since start in a stage's histogram; returns the current time for the next stage
+uint64_t metrics_observe(enum metric_stage stage, uint64_t start);
+
+// Record a stage's duration, measured by the caller, in its histogram
+void metrics_record(enum metric_stage stage, uint64_t ns);
+
+#endif
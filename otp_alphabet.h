@@ -0,0 +1,70 @@
+// otp_alphabet.h
+#ifndef OTP_ALPHABET_H
+#define OTP_ALPHABET_H
+
+#include <stdint.h>
+
+// The alphabet is chosen when compiling: the default is the 27 symbols "A".."Z" and space.
+// Build with -DOTP_ALPHABET_PRINTABLE for the 95 printable ASCII characters, or with
+// -DOTP_ALPHABET_BYTES for all 256 byte values. Every program that shares keys or messages
+// must be built with the same alphabet.
+//
+// An alphabet is a run of RANGE consecutive byte values starting at FIRST, plus optionally one
+// EXTRA symbol (-1 for none) that comes last. Symbol indexes are 0..OTP_ALPHABET_SIZE-1 in that order.
+#if defined(OTP_ALPHABET_BYTES)
+#define OTP_ALPHABET_NAME "bytes"
+#define OTP_ALPHABET_FIRST 0
+#define OTP_ALPHABET_RANGE 256
+#define OTP_ALPHABET_EXTRA -1
+#elif defined(OTP_ALPHABET_PRINTABLE)
+#define OTP_ALPHABET_NAME "printable"
+#define OTP_ALPHABET_FIRST ' '
+#define OTP_ALPHABET_RANGE 95
+#define OTP_ALPHABET_EXTRA -1
+#else
+#define OTP_ALPHABET_NAME "caps"
+#define OTP_ALPHABET_FIRST 'A'
+#define OTP_ALPHABET_RANGE 26
+#define OTP_ALPHABET_EXTRA ' '
+#endif
+
+#define OTP_ALPHABET_SIZE (OTP_ALPHABET_RANGE + (OTP_ALPHABET_EXTRA >= 0))
+
+// Alphabets whose size is a power of two reduce sums with a mask instead of a compare
+#define OTP_ALPHABET_POW2 ((OTP_ALPHABET_SIZE & (OTP_ALPHABET_SIZE - 1)) == 0)
+
+// The vector kernels keep a sum of two indexes in a byte, so other alphabets must have at most 128 symbols
+#if OTP_ALPHABET_SIZE > 128 && !OTP_ALPHABET_POW2
+#error "alphabets of more than 128 symbols must have a power-of-two size"
+#endif
+
+// Symbol index of a byte (0..255). Bytes outside the alphabet are treated as the last symbol,
+// so every kernel gives the same output for any input.
+#define OTP_INDEX(c) ((((c) - OTP_ALPHABET_FIRST) & 0xFF) < OTP_ALPHABET_SIZE - 1 \
+                      ? (((c) - OTP_ALPHABET_FIRST) & 0xFF) : OTP_ALPHABET_SIZE - 1)
+
+// Whether a byte (0..255) is a symbol of the alphabet
+#define OTP_VALID(c) ((((c) - OTP_ALPHABET_FIRST) & 0xFF) < OTP_ALPHABET_RANGE || (c) == OTP_ALPHABET_EXTRA)
+
+// Character of symbol index i, taken modulo the alphabet size
+#define OTP_CHAR(i) (char)((i) % OTP_ALPHABET_SIZE < OTP_ALPHABET_RANGE \
+                           ? (OTP_ALPHABET_FIRST + (i) % OTP_ALPHABET_SIZE) & 0xFF : OTP_ALPHABET_EXTRA)
+
+// Expand F(n), F(n + 1), ... for 256 or 512 consecutive values, so tables are built by the compiler
+#define OTP_TABLE_4(F, n) F(n), F((n) + 1), F((n) + 2), F((n) + 3)
+#define OTP_TABLE_16(F, n) OTP_TABLE_4(F, n), OTP_TABLE_4(F, (n) + 4), OTP_TABLE_4(F, (n) + 8), OTP_TABLE_4(F, (n) + 12)
+#define OTP_TABLE_64(F, n) OTP_TABLE_16(F, n), OTP_TABLE_16(F, (n) + 16), OTP_TABLE_16(F, (n) + 32), OTP_TABLE_16(F, (n) + 48)
+#define OTP_TABLE_256(F, n) OTP_TABLE_64(F, n), OTP_TABLE_64(F, (n) + 64), OTP_TABLE_64(F, (n) + 128), OTP_TABLE_64(F, (n) + 192)
+#define OTP_TABLE_512(F, n) OTP_TABLE_256(F, n), OTP_TABLE_256(F, (n) + 256)
+
+// Byte to symbol index
+static const uint8_t otp_index_of[256] = { OTP_TABLE_256(OTP_INDEX, 0) };
+
+// 1 for bytes in the alphabet, 0 for the rest
+static const uint8_t otp_valid[256] = { OTP_TABLE_256(OTP_VALID, 0) };
+
+// Symbol index to character, modulo the alphabet size. Indexing it with the sum of two indexes
+// (or with a difference plus the alphabet size) reduces and maps back to a character in one load.
+static const char otp_char_of[512] = { OTP_TABLE_512(OTP_CHAR, 0) };
+
+#endif
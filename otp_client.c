@@ -0,0 +1,825 @@
+// otp_client.c
+#define _GNU_SOURCE // For rand_r and clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>     // For driving the connections together
+#include <time.h>     // For the backoff clock
+#include <limits.h>   // For IOV_MAX
+#include <sys/uio.h>  // For the iovecs that send many requests in one call
+#include <sys/socket.h>
+#include <sys/un.h>   // For connecting to a server's Unix socket
+#include <netinet/in.h>
+#include <arpa/inet.h> // For htonl and ntohl
+
+#include "otp_client.h"
+
+// Backoff when the server is busy, as the command-line clients do it: the first wait is at least
+// RETRY_BASE_MS (or the server's hint), it doubles up to RETRY_MAX_MS, and a request is given up
+// after RETRY_ATTEMPTS busy answers or lost connections
+#define RETRY_BASE_MS 10
+#define RETRY_MAX_MS 2000
+#define RETRY_ATTEMPTS 10
+
+// A failed connection is reopened at most this often
+#define RECONNECT_MS 1000
+
+// Responses are read through a buffer this big, so many small ones cost one read; larger results
+// are read straight into the caller's output
+#define RECEIVE_BUFFER_SIZE 65536
+
+// Pieces gathered into one send: a header, a payload and a key per request
+#define SEND_IOVS (IOV_MAX < 96 ? IOV_MAX : 96)
+
+// Where a pooled connection is in its life
+enum conn_state {
+    CONN_DOWN,       // No socket; reopened once reconnect_at has passed and requests are waiting
+    CONN_CONNECTING, // Non-blocking connect under way; the socket turns writable when it is done
+    CONN_HANDSHAKE,  // Handshake and mode written, waiting for the server's handshake
+    CONN_READY       // In framed mode and taking requests
+};
+
+// Where a request is in its life
+enum pending_state {
+    PENDING_FREE,    // Slot unused, on the free list
+    PENDING_WAITING, // Queued in the client, not yet given to a connection
+    PENDING_SENT,    // Written, or being written, to a connection and waiting for its response
+    PENDING_DONE     // Finished, with its result waiting to be collected
+};
+
+// A submitted request. Its slot index is the job id on the wire.
+struct pending {
+    struct otp_request request;
+    uint64_t ticket;
+    enum pending_state state;
+    int conn;      // Connection the request was sent on
+    int attempts;  // Busy answers and lost connections so far
+    int written;   // Result bytes have been written to output, so a resend could read back the result
+    uint64_t sent; // When it was last given to a connection, counted in requests
+    int next;      // Next slot in whichever list this one is on, or -1
+    char header[sizeof(struct frame_header)];
+    struct otp_result result;
+};
+
+// One framed connection with its requests being written and its response being read
+struct client_conn {
+    int fd;                  // -1 while the connection is down
+    enum conn_state state;
+    uint64_t reconnect_at;   // While down, no new attempt is made before this time (ms)
+    size_t handshake_got;    // Bytes of the server's handshake read so far, into buffer
+    int in_flight;           // Requests sent, or being sent, whose responses have not arrived
+
+    // Requests still being written, oldest first, and how much of the oldest is already out
+    int send_head;
+    int send_tail;
+    size_t send_offset;
+
+    // Response being read: its header, then its result
+    char *buffer;
+    size_t buffer_start;
+    size_t buffer_end;
+    int header_done;
+    struct frame_header response;
+    int receiving;           // Slot the current result belongs to
+    size_t result_got;
+};
+
+struct otp_client {
+    char *address;
+    char handshake[HANDSHAKE_LEN + 1];
+    char server_handshake[HANDSHAKE_LEN + 1];
+
+    struct client_conn *conns;
+    int conn_count;
+    struct pollfd *fds;
+
+    struct pending *slots;
+    int slot_count;
+    int free_head;
+    int wait_head;       // Requests not yet given to a connection, oldest first
+    int wait_tail;
+    int done_head;       // Finished requests whose results are waiting to be collected
+    int done_tail;
+    size_t outstanding;  // Submitted requests not yet collected or called back
+    int completed;       // Requests finished during the current otp_client_complete call
+
+    uint64_t next_ticket;
+    uint64_t resume_at;  // While the server is busy, nothing is sent before this time (ms)
+    int busy_streak;     // Busy pauses since the server last completed a request, for the backoff
+    uint64_t sent;       // Requests given to connections so far
+    uint64_t backed_off; // Value of sent when the client last slowed down; busy answers to requests
+                         // sent before then were already allowed for
+    int in_flight;       // Requests sent on any connection whose responses have not arrived
+    int window;          // Requests allowed in flight on all connections together: halved when the server
+    int window_credit;   // is busy, then grown by one for each window's worth of answered requests
+    unsigned seed;       // For backoff jitter
+};
+
+// Function to read the monotonic clock in milliseconds
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to pick how long to wait before retrying a busy server: exponential backoff from the
+// server's hint, with jitter so that requests turned away together do not all return together
+static uint64_t backoff_ms(struct otp_client *c, int attempt, uint32_t hint_ms) {
+    uint64_t delay = hint_ms > RETRY_BASE_MS ? hint_ms : RETRY_BASE_MS;
+    for (int i = 0; i < attempt && delay < RETRY_MAX_MS; i++) delay *= 2;
+    if (delay > RETRY_MAX_MS) delay = RETRY_MAX_MS;
+    return delay / 2 + rand_r(&c->seed) % (delay / 2 + 1);
+}
+
+// Function to start connecting a non-blocking socket to the address: a port on localhost, or a Unix
+// socket path. The connect may still be under way when it returns; returns -1 on failure.
+static int connect_address(const char *address) {
+    int sockfd;
+    if (strchr(address, '/')) {
+        struct sockaddr_un server_addr;
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(server_addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(server_addr.sun_path, address);
+        sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (sockfd >= 0 && connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            close(sockfd);
+            return -1;
+        }
+        return sockfd;
+    }
+
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(address));
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (sockfd >= 0 && connect(sockfd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 &&
+        errno != EINPROGRESS) {
+        close(sockfd);
+        return -1;
+    }
+
+    // Requests are written whole, so Nagle's algorithm would only delay them
+    if (sockfd >= 0) socket_nodelay(sockfd);
+    return sockfd;
+}
+
+// Function to start opening a connection without waiting for it; advance_conn finishes the connect
+// and the handshake as the socket becomes ready. Returns 0, or -1 with errno set.
+static int start_conn(struct otp_client *c, struct client_conn *conn) {
+    int sockfd = connect_address(c->address);
+    if (sockfd < 0) {
+        conn->reconnect_at = now_ms() + RECONNECT_MS;
+        return -1;
+    }
+
+    conn->fd = sockfd;
+    conn->state = CONN_CONNECTING;
+    conn->handshake_got = 0;
+    conn->in_flight = 0;
+    conn->send_head = conn->send_tail = -1;
+    conn->send_offset = 0;
+    conn->buffer_start = conn->buffer_end = 0;
+    conn->header_done = 0;
+    return 0;
+}
+
+// Function to append a slot to a list
+static void list_push(struct otp_client *c, int *head, int *tail, int slot) {
+    c->slots[slot].next = -1;
+    if (*tail >= 0) {
+        c->slots[*tail].next = slot;
+    } else {
+        *head = slot;
+    }
+    *tail = slot;
+}
+
+// Function to put a slot back at the front of the waiting list, so it goes out before newer requests
+static void wait_push_front(struct otp_client *c, int slot) {
+    c->slots[slot].state = PENDING_WAITING;
+    c->slots[slot].next = c->wait_head;
+    c->wait_head = slot;
+    if (c->wait_tail < 0) c->wait_tail = slot;
+}
+
+// Function to take a free slot, growing the table when none is left; returns -1 if out of memory
+static int take_slot(struct otp_client *c) {
+    if (c->free_head < 0) {
+        int count = c->slot_count ? c->slot_count * 2 : 64;
+        struct pending *slots = realloc(c->slots, count * sizeof(*slots));
+        if (!slots) return -1;
+        c->slots = slots;
+        for (int i = count - 1; i >= c->slot_count; i--) {
+            slots[i].state = PENDING_FREE;
+            slots[i].next = c->free_head;
+            c->free_head = i;
+        }
+        c->slot_count = count;
+    }
+    int slot = c->free_head;
+    c->free_head = c->slots[slot].next;
+    return slot;
+}
+
+// Function to return a slot to the free list
+static void free_slot(struct otp_client *c, int slot) {
+    c->slots[slot].state = PENDING_FREE;
+    c->slots[slot].next = c->free_head;
+    c->free_head = slot;
+}
+
+// Function to finish a request: call its callback, or keep its result for otp_client_complete
+static void finish(struct otp_client *c, int slot, int status, size_t len, uint32_t key_id) {
+    struct pending *p = &c->slots[slot];
+    p->result.ticket = p->ticket;
+    p->result.status = status;
+    p->result.len = len;
+    p->result.key_id = key_id;
+    p->result.arg = p->request.arg;
+    c->completed++;
+
+    if (!p->request.done) {
+        p->state = PENDING_DONE;
+        list_push(c, &c->done_head, &c->done_tail, slot);
+        return;
+    }
+
+    // The callback may submit more requests and so move the slot table; copy everything it needs first
+    struct otp_result result = p->result;
+    otp_callback done = p->request.done;
+    free_slot(c, slot);
+    c->outstanding--;
+    done(result.arg, &result);
+}
+
+// Function to check whether a request's output overlaps its input, so that a partly read result spoils it
+static int output_overlaps(const struct otp_request *r) {
+    return r->output && r->output < r->input + r->len && r->input < r->output + r->len;
+}
+
+// Function to drop a connection and send its unanswered requests again on others; a request that
+// has been through too many attempts, or whose input a partial result overwrote, is reported lost
+static void fail_conn(struct otp_client *c, int index) {
+    struct client_conn *conn = &c->conns[index];
+    close(conn->fd);
+    conn->fd = -1;
+    c->in_flight -= conn->in_flight;
+    conn->in_flight = 0;
+    conn->send_head = conn->send_tail = -1;
+
+    // A connection that was working is reopened at once; one that could not be opened waits
+    conn->reconnect_at = now_ms() + (conn->state == CONN_READY ? 0 : RECONNECT_MS);
+    conn->state = CONN_DOWN;
+
+    // They go back ahead of requests that were never sent
+    for (int slot = c->slot_count - 1; slot >= 0; slot--) {
+        struct pending *p = &c->slots[slot];
+        if (p->state != PENDING_SENT || p->conn != index) continue;
+        if (++p->attempts >= RETRY_ATTEMPTS || (p->written && output_overlaps(&p->request))) {
+            finish(c, slot, OTP_CLIENT_LOST, 0, 0);
+        } else {
+            wait_push_front(c, slot);
+        }
+    }
+}
+
+// Function to find what follows a request's payload: its key, a stored key's token, or nothing for an upload
+static const char *request_key(const struct otp_request *r, size_t *len) {
+    if (r->op == OTP_OP_UPLOAD_KEY) {
+        *len = 0;
+        return NULL;
+    }
+    if (!r->key) {
+        *len = KEY_TOKEN_LEN;
+        return (const char *)r->key_token;
+    }
+    *len = r->len;
+    return r->key;
+}
+
+// Function to write as much of a connection's queued requests as the socket takes, many per call
+static void flush_conn(struct otp_client *c, int index) {
+    struct client_conn *conn = &c->conns[index];
+    struct iovec iov[SEND_IOVS];
+
+    while (conn->fd >= 0 && conn->send_head >= 0) {
+        // Gather the unwritten part of each queued request: header, payload, then key
+        int count = 0;
+        size_t skip = conn->send_offset;
+        for (int slot = conn->send_head; slot >= 0 && count + 3 <= SEND_IOVS; slot = c->slots[slot].next) {
+            struct pending *p = &c->slots[slot];
+            size_t key_len;
+            const char *key = request_key(&p->request, &key_len);
+            const char *pieces[3] = { p->header, p->request.input, key };
+            size_t lengths[3] = { sizeof(p->header), p->request.len, key_len };
+            for (int i = 0; i < 3; i++) {
+                if (skip >= lengths[i]) {
+                    skip -= lengths[i];
+                    continue;
+                }
+                iov[count].iov_base = (void *)(pieces[i] + skip);
+                iov[count].iov_len = lengths[i] - skip;
+                skip = 0;
+                count++;
+            }
+        }
+
+        // A server that went away must fail the connection, not raise SIGPIPE in the caller
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) fail_conn(c, index); // Otherwise wait for POLLOUT
+            return;
+        }
+
+        // Retire the requests now fully written; they stay in flight until their responses arrive
+        conn->send_offset += n;
+        while (conn->send_head >= 0) {
+            struct pending *p = &c->slots[conn->send_head];
+            size_t key_len;
+            request_key(&p->request, &key_len);
+            size_t frame = sizeof(p->header) + p->request.len + key_len;
+            if (conn->send_offset < frame) break;
+            conn->send_offset -= frame;
+            conn->send_head = p->next;
+            if (conn->send_head < 0) conn->send_tail = -1;
+        }
+    }
+}
+
+// Function to give a waiting request to a connection: encode its header and queue it for writing
+static void start_request(struct otp_client *c, int index, int slot) {
+    struct client_conn *conn = &c->conns[index];
+    struct pending *p = &c->slots[slot];
+    const struct otp_request *r = &p->request;
+
+    // Job ids are slot indexes, so responses can be matched to requests in any order
+    struct frame_header header;
+    memset(&header, 0, sizeof(header));
+    header.id = slot;
+    header.payload_len = r->len;
+    if (r->op == OTP_OP_UPLOAD_KEY) {
+        header.flags = FRAME_KEY_UPLOAD;
+    } else {
+        if (r->op == OTP_OP_ENCRYPT) header.flags = FRAME_OP_ENCRYPT;
+        if (r->op == OTP_OP_DECRYPT) header.flags = FRAME_OP_DECRYPT;
+        if (r->key) {
+            header.key_len = r->len;
+        } else {
+            header.flags |= FRAME_KEY_REF;
+            header.key_len = KEY_TOKEN_LEN;
+            header.key_id = r->key_id;
+            header.key_offset = r->key_offset;
+        }
+    }
+    encode_frame_header(&header, p->header);
+
+    p->state = PENDING_SENT;
+    p->conn = index;
+    p->written = 0;
+    p->sent = c->sent++;
+    conn->in_flight++;
+    c->in_flight++;
+    list_push(c, &conn->send_head, &conn->send_tail, slot);
+}
+
+// Function to hand waiting requests to the least loaded connections, starting to reopen failed ones
+// when due, then write what the sockets take
+static void dispatch(struct otp_client *c) {
+    uint64_t now = now_ms();
+    int live = 0;
+    for (int i = 0; i < c->conn_count; i++) {
+        struct client_conn *conn = &c->conns[i];
+        if (conn->state == CONN_DOWN && c->wait_head >= 0 && now >= conn->reconnect_at) start_conn(c, conn);
+        if (conn->state != CONN_DOWN) live++;
+    }
+
+    // No server to send to: the waiting requests cannot be delivered. Connections still being
+    // opened count as live, and the requests wait for them.
+    if (live == 0) {
+        while (c->wait_head >= 0) {
+            int slot = c->wait_head;
+            c->wait_head = c->slots[slot].next;
+            if (c->wait_head < 0) c->wait_tail = -1;
+            finish(c, slot, OTP_CLIENT_LOST, 0, 0);
+        }
+        return;
+    }
+
+    // While backing off from a busy server, hold everything back
+    if (c->resume_at > now) return;
+    c->resume_at = 0;
+
+    while (c->wait_head >= 0 && c->in_flight < c->window) {
+        int best = -1;
+        for (int i = 0; i < c->conn_count; i++) {
+            struct client_conn *conn = &c->conns[i];
+            if (conn->state == CONN_READY && conn->in_flight < OTP_CLIENT_WINDOW &&
+                (best < 0 || conn->in_flight < c->conns[best].in_flight))
+                best = i;
+        }
+        if (best < 0) break; // Every window is full
+
+        int slot = c->wait_head;
+        c->wait_head = c->slots[slot].next;
+        if (c->wait_head < 0) c->wait_tail = -1;
+        start_request(c, best, slot);
+    }
+
+    for (int i = 0; i < c->conn_count; i++) flush_conn(c, i);
+}
+
+// Function to handle a response whose header and result are both in
+static void complete_response(struct otp_client *c, int index) {
+    struct client_conn *conn = &c->conns[index];
+    struct frame_header *response = &conn->response;
+    int slot = conn->receiving;
+    struct pending *p = &c->slots[slot];
+    conn->in_flight--;
+    c->in_flight--;
+    conn->header_done = 0;
+
+    if (response->status == STATUS_BUSY && ++p->attempts < RETRY_ATTEMPTS) {
+        // Send it again once the server has had time to catch up, and hold back every other request until then
+        // A busy answer halves the window, so fewer requests come back busy next time. Once it is down
+        // to one request, the client pauses instead, longer each time the server still refuses. The other
+        // requests already in flight when that happened may come back busy too; they only go round again.
+        wait_push_front(c, slot);
+        if (p->sent < c->backed_off) return;
+        c->backed_off = c->sent;
+        c->window_credit = 0;
+        if (c->window > 1) {
+            c->window /= 2;
+        } else {
+            c->resume_at = now_ms() + backoff_ms(c, c->busy_streak++, response->retry_after_ms);
+        }
+        return;
+    }
+    if (response->status == STATUS_OK) c->busy_streak = 0;
+    if (c->window < OTP_CLIENT_WINDOW * c->conn_count && ++c->window_credit >= c->window) {
+        c->window++;
+        c->window_credit = 0;
+    }
+    finish(c, slot, response->status, p->request.op == OTP_OP_UPLOAD_KEY ? 0 : response->payload_len,
+           response->key_id);
+}
+
+// Function to take a connection being opened as far as its socket allows: once the connect is done,
+// send the handshake and the mode, then read the server's handshake. A server at its connection
+// limit answers with the busy handshake and a retry-after hint instead; the connection is then
+// tried again after the same backoff busy responses get.
+static void advance_conn(struct otp_client *c, int index) {
+    struct client_conn *conn = &c->conns[index];
+
+    if (conn->state == CONN_CONNECTING) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+            fail_conn(c, index);
+            return;
+        }
+
+        // A new socket's buffer always takes the handshake and the mode, so they go in one call
+        char hello[HANDSHAKE_LEN + sizeof(int32_t)];
+        int32_t mode = MODE_FRAMED;
+        memcpy(hello, c->handshake, HANDSHAKE_LEN);
+        memcpy(hello + HANDSHAKE_LEN, &mode, sizeof(mode));
+        if (send(conn->fd, hello, sizeof(hello), MSG_NOSIGNAL) != (ssize_t)sizeof(hello)) {
+            fail_conn(c, index);
+            return;
+        }
+        conn->state = CONN_HANDSHAKE;
+    }
+
+    while (conn->state == CONN_HANDSHAKE) {
+        // The busy handshake is followed by the retry-after hint, in network byte order
+        int busy = conn->handshake_got >= HANDSHAKE_LEN && memcmp(conn->buffer, BUSY_HANDSHAKE, HANDSHAKE_LEN) == 0;
+        size_t want = HANDSHAKE_LEN + (busy ? sizeof(uint32_t) : 0);
+        if (conn->handshake_got < want) {
+            ssize_t got = read(conn->fd, conn->buffer + conn->handshake_got, want - conn->handshake_got);
+            if (got < 0 && errno == EINTR) continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (got <= 0) {
+                fail_conn(c, index);
+                return;
+            }
+            conn->handshake_got += got;
+            continue;
+        }
+        if (busy) {
+            uint32_t hint;
+            memcpy(&hint, conn->buffer + HANDSHAKE_LEN, sizeof(hint));
+            fail_conn(c, index);
+            conn->reconnect_at = now_ms() + backoff_ms(c, c->busy_streak++, ntohl(hint));
+            return;
+        }
+        if (memcmp(conn->buffer, c->server_handshake, HANDSHAKE_LEN) != 0) {
+            fail_conn(c, index);
+            return;
+        }
+        conn->state = CONN_READY;
+    }
+}
+
+// Function to wait until none of the connections is still being opened; returns -1 with errno set if waiting failed
+static int await_conns(struct otp_client *c) {
+    while (1) {
+        int count = 0;
+        for (int i = 0; i < c->conn_count; i++) {
+            struct client_conn *conn = &c->conns[i];
+            int opening = conn->state == CONN_CONNECTING || conn->state == CONN_HANDSHAKE;
+            c->fds[i].fd = opening ? conn->fd : -1;
+            c->fds[i].events = conn->state == CONN_CONNECTING ? POLLOUT : POLLIN;
+            c->fds[i].revents = 0;
+            count += opening;
+        }
+        if (count == 0) return 0;
+
+        if (poll(c->fds, c->conn_count, -1) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (int i = 0; i < c->conn_count; i++) {
+            if (c->fds[i].fd >= 0 && c->fds[i].revents) advance_conn(c, i);
+        }
+    }
+}
+
+// Function to read whatever has arrived on a connection and complete every full response
+static void receive_conn(struct otp_client *c, int index) {
+    struct client_conn *conn = &c->conns[index];
+
+    while (conn->fd >= 0) {
+        size_t avail = conn->buffer_end - conn->buffer_start;
+        char *data = conn->buffer + conn->buffer_start;
+
+        if (!conn->header_done && avail >= sizeof(struct frame_header)) {
+            // A response must answer a request in flight on this connection, and fit its output: the
+            // caller's buffer, or the result's token for an upload
+            decode_frame_header(data, &conn->response);
+            conn->buffer_start += sizeof(struct frame_header);
+            uint32_t id = conn->response.id;
+            struct pending *p = id < (uint32_t)c->slot_count ? &c->slots[id] : NULL;
+            if (!p || p->state != PENDING_SENT || p->conn != index ||
+                conn->response.payload_len > (p->request.op == OTP_OP_UPLOAD_KEY ? KEY_TOKEN_LEN : p->request.len)) {
+                fail_conn(c, index);
+                return;
+            }
+            conn->header_done = 1;
+            conn->receiving = id;
+            conn->result_got = 0;
+            continue;
+        }
+
+        if (conn->header_done) {
+            struct pending *p = &c->slots[conn->receiving];
+            char *output = p->request.op == OTP_OP_UPLOAD_KEY ? (char *)p->result.key_token : p->request.output;
+            size_t need = conn->response.payload_len - conn->result_got;
+            size_t n = avail < need ? avail : need;
+            if (n > 0) {
+                memcpy(output + conn->result_got, data, n);
+                conn->buffer_start += n;
+                conn->result_got += n;
+                need -= n;
+                p->written = 1;
+            }
+            if (need == 0) {
+                complete_response(c, index);
+                continue;
+            }
+
+            // A large result goes straight into the caller's output instead of through the buffer
+            if (need >= RECEIVE_BUFFER_SIZE) {
+                ssize_t got = read(conn->fd, p->request.output + conn->result_got, need);
+                if (got > 0) {
+                    conn->result_got += got;
+                    continue;
+                }
+                if (got == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                    fail_conn(c, index);
+                    return;
+                }
+                if (errno == EINTR) continue;
+                return;
+            }
+        }
+
+        // Move what is left to the front of the buffer and read more behind it
+        if (conn->buffer_start > 0) {
+            memmove(conn->buffer, conn->buffer + conn->buffer_start, conn->buffer_end - conn->buffer_start);
+            conn->buffer_end -= conn->buffer_start;
+            conn->buffer_start = 0;
+        }
+        if (conn->in_flight == 0 && conn->buffer_end == 0) return; // Nothing more to wait for
+        ssize_t got = read(conn->fd, conn->buffer + conn->buffer_end, RECEIVE_BUFFER_SIZE - conn->buffer_end);
+        if (got > 0) {
+            conn->buffer_end += got;
+            continue;
+        }
+        if (got < 0 && errno == EINTR) continue;
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        fail_conn(c, index); // Closed by the server, or broken
+        return;
+    }
+}
+
+// Function to open a client with a pool of framed connections to one server
+struct otp_client *otp_client_open(const char *address, const char *handshake, int connections) {
+    if (!address || !handshake || strlen(handshake) != HANDSHAKE_LEN || connections < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (connections == 0) connections = OTP_CLIENT_CONNECTIONS;
+
+    struct otp_client *c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->address = strdup(address);
+    c->conns = calloc(connections, sizeof(*c->conns));
+    c->fds = calloc(connections, sizeof(*c->fds));
+    if (!c->address || !c->conns || !c->fds) {
+        otp_client_close(c);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // The server answers XXX_CLIENT with XXX_SERVER
+    memcpy(c->handshake, handshake, HANDSHAKE_LEN);
+    memcpy(c->server_handshake, handshake, HANDSHAKE_LEN - 6);
+    memcpy(c->server_handshake + HANDSHAKE_LEN - 6, "SERVER", 6);
+    c->conn_count = connections;
+    c->window = OTP_CLIENT_WINDOW * connections;
+    c->free_head = c->wait_head = c->wait_tail = c->done_head = c->done_tail = -1;
+    c->seed = getpid() ^ (unsigned)now_ms();
+
+    // Open the whole pool now, so the first requests do not pay for connecting; this is the one call
+    // that waits for connections to open
+    int live = 0, err = 0;
+    for (int i = 0; i < connections; i++) c->conns[i].fd = -1;
+    for (int i = 0; i < connections; i++) {
+        struct client_conn *conn = &c->conns[i];
+        conn->buffer = malloc(RECEIVE_BUFFER_SIZE);
+        if (!conn->buffer) {
+            err = ENOMEM;
+            break;
+        }
+        if (start_conn(c, conn) < 0) err = errno;
+    }
+    if (err != ENOMEM && await_conns(c) < 0) err = errno;
+    for (int i = 0; i < connections; i++) live += c->conns[i].state == CONN_READY;
+    if (live == 0 && !err) err = ECONNREFUSED;
+    if (live == 0 || err == ENOMEM) {
+        otp_client_close(c);
+        errno = err;
+        return NULL;
+    }
+    return c;
+}
+
+// Function to close a client's connections and free it
+void otp_client_close(struct otp_client *client) {
+    if (!client) return;
+    for (int i = 0; client->conns && i < client->conn_count; i++) {
+        if (client->conns[i].fd >= 0) close(client->conns[i].fd);
+        free(client->conns[i].buffer);
+    }
+    free(client->conns);
+    free(client->fds);
+    free(client->slots);
+    free(client->address);
+    free(client);
+}
+
+// Function to check a request and queue it in the client without writing anything; returns its ticket or -1
+static int64_t enqueue(struct otp_client *c, const struct otp_request *request) {
+    if (request->len > FRAME_MAX_PAYLOAD) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    if ((unsigned)request->op > OTP_OP_UPLOAD_KEY || (request->len > 0 && !request->input) ||
+        (request->op != OTP_OP_UPLOAD_KEY && request->len > 0 && !request->output)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int slot = take_slot(c);
+    if (slot < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+    struct pending *p = &c->slots[slot];
+    p->request = *request;
+    p->ticket = c->next_ticket++;
+    p->attempts = 0;
+    p->state = PENDING_WAITING;
+    list_push(c, &c->wait_head, &c->wait_tail, slot);
+    c->outstanding++;
+    return p->ticket;
+}
+
+// Function to submit one request
+int64_t otp_client_submit(struct otp_client *client, const struct otp_request *request) {
+    int64_t ticket = enqueue(client, request);
+    if (ticket >= 0) dispatch(client);
+    return ticket;
+}
+
+// Function to submit many requests and write them out together
+int otp_client_submit_batch(struct otp_client *client, const struct otp_request *requests, int count,
+                            int64_t *tickets) {
+    int queued = 0;
+    while (queued < count) {
+        int64_t ticket = enqueue(client, &requests[queued]);
+        if (ticket < 0) break;
+        if (tickets) tickets[queued] = ticket;
+        queued++;
+    }
+    if (queued > 0) dispatch(client);
+    return queued;
+}
+
+// Function to move finished results to the caller's array
+static int collect(struct otp_client *c, struct otp_result *results, int max) {
+    int n = 0;
+    while (n < max && c->done_head >= 0) {
+        int slot = c->done_head;
+        c->done_head = c->slots[slot].next;
+        if (c->done_head < 0) c->done_tail = -1;
+        results[n++] = c->slots[slot].result;
+        free_slot(c, slot);
+        c->outstanding--;
+    }
+    return n;
+}
+
+// Function to drive the connections until something completes or the time is up
+int otp_client_complete(struct otp_client *client, struct otp_result *results, int max, int timeout_ms) {
+    struct otp_client *c = client;
+    uint64_t deadline = timeout_ms >= 0 ? now_ms() + timeout_ms : UINT64_MAX;
+    c->completed = 0;
+
+    while (1) {
+        dispatch(c);
+
+        // Results from earlier calls count too, so a caller collecting a few at a time is never kept waiting
+        if (c->completed > 0 || c->done_head >= 0 || c->outstanding == 0) break;
+
+        int count = 0;
+        for (int i = 0; i < c->conn_count; i++) {
+            struct client_conn *conn = &c->conns[i];
+            c->fds[i].fd = conn->fd;
+            if (conn->state == CONN_CONNECTING) {
+                c->fds[i].events = POLLOUT;
+            } else if (conn->state == CONN_HANDSHAKE) {
+                c->fds[i].events = POLLIN;
+            } else {
+                c->fds[i].events = (conn->send_head >= 0 ? POLLOUT : 0) | (conn->in_flight ? POLLIN : 0);
+            }
+            c->fds[i].revents = 0;
+            if (conn->fd >= 0 && c->fds[i].events) count++;
+        }
+
+        // Wake up in time for the end of a busy pause, a reconnect or the caller's timeout
+        uint64_t now = now_ms();
+        uint64_t wake = deadline;
+        if (c->resume_at && c->resume_at < wake) wake = c->resume_at;
+        for (int i = 0; c->wait_head >= 0 && i < c->conn_count; i++) {
+            if (c->conns[i].fd < 0 && c->conns[i].reconnect_at < wake) wake = c->conns[i].reconnect_at;
+        }
+        if (now >= deadline) break;
+        int wait = wake == UINT64_MAX ? -1 : wake > now ? (int)(wake - now) : 0;
+        if (count == 0 && wait < 0) break; // Nothing can make progress
+
+        if (poll(c->fds, c->conn_count, wait) < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        for (int i = 0; i < c->conn_count; i++) {
+            if (c->conns[i].fd < 0 || c->fds[i].fd != c->conns[i].fd || !c->fds[i].revents) continue;
+            if (c->conns[i].state != CONN_READY) {
+                advance_conn(c, i);
+                continue;
+            }
+            if (c->fds[i].revents & POLLOUT) flush_conn(c, i);
+            if (c->conns[i].fd >= 0 && (c->fds[i].revents & (POLLIN | POLLERR | POLLHUP))) receive_conn(c, i);
+        }
+    }
+    return collect(c, results, max);
+}
+
+// Function to count the requests not yet delivered
+size_t otp_client_pending(const struct otp_client *client) {
+    return client->outstanding;
+}
@@ -0,0 +1,102 @@
+// otp_client.h
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "protocol.h" // For the STATUS_* codes results carry
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Connections otp_client_open keeps open when asked for 0
+#define OTP_CLIENT_CONNECTIONS 4
+
+// Most requests written to one connection and not yet answered; further requests wait in the client.
+// Busy answers from the server shrink the client's total below this, and it grows back as requests succeed.
+#define OTP_CLIENT_WINDOW 256
+
+// Status of a request that could not be delivered: its connection failed and it could not be sent again
+#define OTP_CLIENT_LOST (-1)
+
+// What a request asks the server to do
+enum otp_op {
+    OTP_OP_DEFAULT,   // Whatever the handshake chose: encrypt for ENC_CLIENT, decrypt for DEC_CLIENT
+    OTP_OP_ENCRYPT,
+    OTP_OP_DECRYPT,
+    OTP_OP_UPLOAD_KEY // Store input as a key; the result carries its key_id and key_token
+};
+
+// Pool of pipelined framed connections to one server. A client is driven by the thread that uses it:
+// submitting only queues requests and writes what the sockets take at once, and otp_client_complete
+// does the rest of the I/O, including reopening failed connections, and delivers the results. A
+// client must not be shared between threads.
+struct otp_client;
+
+struct otp_result;
+
+// Called when a request with a callback finishes: from otp_client_complete, or from a submit call
+// when no connection to the server can be opened
+typedef void (*otp_callback)(void *arg, const struct otp_result *result);
+
+// One request. Every buffer it names must stay valid, and unchanged, until the request completes:
+// requests are sent from the caller's memory and results are read straight into it.
+struct otp_request {
+    enum otp_op op;
+    const char *input;   // len bytes to transform, or the key to upload
+    const char *key;     // len bytes of key, or NULL to use stored key key_id from key_offset
+    uint32_t key_id;
+    uint64_t key_offset;
+    unsigned char key_token[KEY_TOKEN_LEN]; // The stored key's token, from its upload's result
+    size_t len;          // At most FRAME_MAX_PAYLOAD
+    char *output;        // len bytes for the result; may be input. Unused by uploads.
+    otp_callback done;   // Called with the result, or NULL to collect it from otp_client_complete
+    void *arg;           // Passed back to done and in the result
+};
+
+// How a request finished
+struct otp_result {
+    uint64_t ticket;     // As returned when the request was submitted
+    int status;          // STATUS_* from the server, or OTP_CLIENT_LOST
+    size_t len;          // Result bytes written to output
+    uint32_t key_id;     // Handle of an uploaded key, which lasts as long as the connection it went up on
+    unsigned char key_token[KEY_TOKEN_LEN]; // Its token, to be sent with key_id
+    void *arg;
+};
+
+// Connect to a server, complete the handshake on each connection and switch them to framed mode.
+// The address is a port on localhost, or a Unix socket path if it contains a '/'; the handshake is
+// "ENC_CLIENT", "DEC_CLIENT" or "OTP_CLIENT". Waits for the connections to open, and returns NULL
+// with errno set if none could be. Connections that fail later are reopened without blocking: submit
+// may start the connect, and otp_client_complete finishes it and the handshake.
+struct otp_client *otp_client_open(const char *address, const char *handshake, int connections);
+
+// Close every connection and free the client; requests still outstanding are dropped without completing
+void otp_client_close(struct otp_client *client);
+
+// Queue a request and write it if a connection has room; never blocks, even while connections are
+// being reopened. Returns the request's ticket,
+// or -1 with errno EMSGSIZE (too large), EINVAL or ENOMEM.
+int64_t otp_client_submit(struct otp_client *client, const struct otp_request *request);
+
+// Queue count requests and write them together, in as few system calls as the sockets allow. Stores
+// each ticket in tickets unless it is NULL; returns how many were queued, stopping at the first
+// request submit would refuse.
+int otp_client_submit_batch(struct otp_client *client, const struct otp_request *requests, int count,
+                            int64_t *tickets);
+
+// Do the pending I/O, running callbacks and storing up to max other results, until at least one
+// request has completed, none are outstanding or timeout_ms passes (-1 waits as long as it takes).
+// Returns the number of results stored, or -1 with errno set if waiting failed.
+int otp_client_complete(struct otp_client *client, struct otp_result *results, int max, int timeout_ms);
+
+// Report how many submitted requests have not been delivered yet, including stored results not yet collected
+size_t otp_client_pending(const struct otp_client *client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
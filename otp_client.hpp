@@ -0,0 +1,184 @@
+// otp_client.hpp
+#ifndef OTP_CLIENT_HPP
+#define OTP_CLIENT_HPP
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "otp_client.h"
+
+namespace otp {
+
+using Request = otp_request;
+using Result = otp_result;
+
+// Thin C++ face of struct otp_client: the same pool and pipelining, with callbacks that can be any
+// callable and submit calls that return futures. Like the C client, one thread drives it: a future
+// becomes ready only while that thread is inside poll, wait or drain.
+class Client {
+public:
+    using Callback = std::function<void(const Result &)>;
+
+    Client(const std::string &address, const std::string &handshake, int connections = 0)
+        : client_(otp_client_open(address.c_str(), handshake.c_str(), connections)) {
+        if (!client_) throw std::system_error(errno, std::generic_category(), "otp_client_open");
+    }
+
+    // Outstanding requests are finished first, so no callback is left behind
+    ~Client() {
+        try {
+            drain();
+        } catch (...) {
+        }
+        otp_client_close(client_);
+    }
+
+    Client(const Client &) = delete;
+    Client &operator=(const Client &) = delete;
+
+    // Build a request to transform len bytes with a key sent along with them
+    static Request transform(otp_op op, const char *input, const char *key, char *output, size_t len) {
+        Request request = {};
+        request.op = op;
+        request.input = input;
+        request.key = key;
+        request.len = len;
+        request.output = output;
+        return request;
+    }
+
+    // Build a request to transform len bytes with the stored key an upload's result names, from key_offset
+    static Request transform(otp_op op, const char *input, const Result &upload, uint64_t key_offset, char *output,
+                             size_t len) {
+        Request request = transform(op, input, nullptr, output, len);
+        request.key_id = upload.key_id;
+        request.key_offset = key_offset;
+        std::memcpy(request.key_token, upload.key_token, sizeof(request.key_token));
+        return request;
+    }
+
+    // Build a request to store a key on the server; the result carries its key_id
+    static Request upload_key(const char *key, size_t len) {
+        Request request = {};
+        request.op = OTP_OP_UPLOAD_KEY;
+        request.input = key;
+        request.len = len;
+        return request;
+    }
+
+    // Submit a request whose result goes to callback; returns its ticket
+    uint64_t submit(const Request &request, Callback callback) {
+        Request r = bind(request, std::move(callback));
+        int64_t ticket = otp_client_submit(client_, &r);
+        if (ticket < 0) {
+            int err = errno;
+            delete static_cast<Context *>(r.arg);
+            throw std::system_error(err, std::generic_category(), "otp_client_submit");
+        }
+        return ticket;
+    }
+
+    // Submit a request and get its result as a future
+    std::future<Result> submit(const Request &request) {
+        auto promise = std::make_shared<std::promise<Result>>();
+        std::future<Result> future = promise->get_future();
+        submit(request, [promise](const Result &result) { promise->set_value(result); });
+        return future;
+    }
+
+    // Submit many requests in one go, written out together; returns a future for each
+    std::vector<std::future<Result>> submit_batch(const std::vector<Request> &requests) {
+        std::vector<Request> bound;
+        std::vector<std::future<Result>> futures;
+        bound.reserve(requests.size());
+        futures.reserve(requests.size());
+        for (const Request &request : requests) {
+            auto promise = std::make_shared<std::promise<Result>>();
+            futures.push_back(promise->get_future());
+            bound.push_back(bind(request, [promise](const Result &result) { promise->set_value(result); }));
+        }
+
+        int queued = otp_client_submit_batch(client_, bound.data(), static_cast<int>(bound.size()), nullptr);
+        if (queued < static_cast<int>(bound.size())) {
+            int err = errno;
+            for (size_t i = queued; i < bound.size(); i++) delete static_cast<Context *>(bound[i].arg);
+            futures.resize(queued);
+            throw std::system_error(err, std::generic_category(), "otp_client_submit_batch");
+        }
+        return futures;
+    }
+
+    // Do pending I/O and run callbacks until something completes or timeout_ms passes (-1: no limit)
+    void poll(int timeout_ms = -1) {
+        if (otp_client_complete(client_, nullptr, 0, timeout_ms) < 0)
+            throw std::system_error(errno, std::generic_category(), "otp_client_complete");
+        rethrow();
+    }
+
+    // Drive the client until a future from it is ready, and return its result
+    Result wait(std::future<Result> &future) {
+        while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready) poll();
+        return future.get();
+    }
+
+    // Drive the client until every submitted request has completed
+    void drain() {
+        while (pending() > 0) poll();
+    }
+
+    size_t pending() const {
+        return otp_client_pending(client_);
+    }
+
+    // The C client, for calls this wrapper does not cover
+    otp_client *get() const {
+        return client_;
+    }
+
+private:
+    // Handed to the C client as a request's arg; freed once its callback has run
+    struct Context {
+        Client *client;
+        Callback callback;
+    };
+
+    Request bind(const Request &request, Callback callback) {
+        Request r = request;
+        r.done = &Client::trampoline;
+        r.arg = new Context{this, std::move(callback)};
+        return r;
+    }
+
+    // Exceptions cannot unwind through the C client, so a throwing callback's is kept and rethrown from poll
+    static void trampoline(void *arg, const otp_result *result) {
+        std::unique_ptr<Context> context(static_cast<Context *>(arg));
+        try {
+            context->callback(*result);
+        } catch (...) {
+            if (!context->client->error_) context->client->error_ = std::current_exception();
+        }
+    }
+
+    void rethrow() {
+        if (!error_) return;
+        std::exception_ptr error = error_;
+        error_ = nullptr;
+        std::rethrow_exception(error);
+    }
+
+    otp_client *client_;
+    std::exception_ptr error_;
+};
+
+} // namespace otp
+
+#endif
@@ -0,0 +1,262 @@
+// otp_client_test.c
+#define _GNU_SOURCE // For rand_r
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "otp_client.h"
+#include "otp_kernel.h" // For checking results against the local transform
+
+// Requests each check sends, and the bytes in each
+#define REQUESTS 2000
+#define MESSAGE_LEN 1000
+
+// Requests the resubmitting callback keeps going at once
+#define CHAINS 8
+
+// Longest any check may take before the test gives up on it
+#define TIMEOUT_S 20
+
+// Server the test runs, the Unix socket it serves on, and its process
+static const char *server_binary = "./enc_server";
+static char socket_path[64];
+static pid_t server_pid;
+
+static char *inputs, *keys, *outputs;
+static int failures;
+
+// Function to read the monotonic clock in milliseconds
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to report one check
+static void check(const char *name, int ok) {
+    printf("%s %s\n", ok ? "ok  " : "FAIL", name);
+    if (!ok) failures++;
+}
+
+// Function to end the test when a check hangs, which is what a blocking client call would do
+static void on_alarm(int sig) {
+    (void)sig;
+    static const char msg[] = "FAIL a check did not finish in time\n";
+    if (write(STDOUT_FILENO, msg, sizeof(msg) - 1) < 0) _exit(2);
+    kill(server_pid, SIGKILL);
+    _exit(1);
+}
+
+// Function to start the server on the test's socket and wait until it takes connections
+static void start_server(void) {
+    server_pid = fork();
+    if (server_pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (server_pid == 0) {
+        freopen("/dev/null", "w", stderr);
+        execl(server_binary, server_binary, "-m", "epoll", socket_path, (char *)NULL);
+        _exit(127);
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, socket_path);
+    for (int i = 0; i < 500; i++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        int up = fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (fd >= 0) close(fd);
+        if (up) return;
+        usleep(10000);
+    }
+    fprintf(stderr, "Error: %s did not start\n", server_binary);
+    kill(server_pid, SIGKILL);
+    exit(1);
+}
+
+// Function to kill the server, dropping every connection to it
+static void stop_server(void) {
+    kill(server_pid, SIGKILL);
+    waitpid(server_pid, NULL, 0);
+}
+
+// Function to build request i of the shared test data, encrypting its input with its key
+static struct otp_request make_request(int i, otp_callback done, void *arg) {
+    struct otp_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = OTP_OP_ENCRYPT;
+    request.input = inputs + (size_t)i * MESSAGE_LEN;
+    request.key = keys + (size_t)i * MESSAGE_LEN;
+    request.len = MESSAGE_LEN;
+    request.output = outputs + (size_t)i * MESSAGE_LEN;
+    request.done = done;
+    request.arg = arg;
+    return request;
+}
+
+// Function to check outputs [first, first + count) against the local transform
+static int outputs_match(int first, int count) {
+    char expected[MESSAGE_LEN];
+    for (int i = first; i < first + count; i++) {
+        size_t at = (size_t)i * MESSAGE_LEN;
+        otp_encrypt(inputs + at, keys + at, expected, MESSAGE_LEN);
+        if (memcmp(expected, outputs + at, MESSAGE_LEN) != 0) return 0;
+    }
+    return 1;
+}
+
+// Function to collect results until no request is pending; returns how many came back other than
+// STATUS_OK, or -1 if completing failed
+static int drain(struct otp_client *client) {
+    struct otp_result results[64];
+    int bad = 0;
+    while (otp_client_pending(client) > 0) {
+        int n = otp_client_complete(client, results, 64, 1000);
+        if (n < 0) return -1;
+        for (int i = 0; i < n; i++) bad += results[i].status != STATUS_OK || results[i].len != MESSAGE_LEN;
+    }
+    return bad;
+}
+
+// Function to pipeline every request at once and collect the results in whatever order they come
+static void test_pipelined(struct otp_client *client) {
+    memset(outputs, 0, (size_t)REQUESTS * MESSAGE_LEN);
+    int submitted = 0;
+    for (int i = 0; i < REQUESTS; i++) {
+        struct otp_request request = make_request(i, NULL, NULL);
+        submitted += otp_client_submit(client, &request) >= 0;
+    }
+    int bad = drain(client);
+    check("pipelined submit and complete", submitted == REQUESTS && bad == 0 && outputs_match(0, REQUESTS));
+}
+
+// A line of requests, each submitted from the callback of the one before
+struct chain {
+    struct otp_client *client;
+    int next;  // Next request to submit
+    int done;  // Requests called back
+    int bad;   // Of those, the ones that failed
+};
+
+// Function to submit the chain's next request, if any are left
+static void chain_submit(struct chain *chain);
+
+// Function to count a chained request and submit the next from inside the callback
+static void chain_done(void *arg, const struct otp_result *result) {
+    struct chain *chain = arg;
+    chain->done++;
+    chain->bad += result->status != STATUS_OK || result->len != MESSAGE_LEN;
+    chain_submit(chain);
+}
+
+static void chain_submit(struct chain *chain) {
+    if (chain->next >= REQUESTS) return;
+    struct otp_request request = make_request(chain->next++, chain_done, chain);
+    if (otp_client_submit(chain->client, &request) < 0) chain->bad++;
+}
+
+// Function to run requests whose callbacks submit the next ones, several chains at a time
+static void test_resubmit(struct otp_client *client) {
+    memset(outputs, 0, (size_t)REQUESTS * MESSAGE_LEN);
+    struct chain chain = { client, 0, 0, 0 };
+    for (int i = 0; i < CHAINS; i++) chain_submit(&chain);
+    while (otp_client_pending(client) > 0) {
+        if (otp_client_complete(client, NULL, 0, 1000) < 0) break;
+    }
+    check("callbacks that submit more requests",
+          chain.done == REQUESTS && chain.bad == 0 && outputs_match(0, REQUESTS));
+}
+
+// Function to drop every connection while requests are in flight, then bring the server back
+// unable to answer yet: submitting must not wait for the connections to reopen, and every request
+// must still come back once the server answers
+static void test_dropped(struct otp_client *client) {
+    memset(outputs, 0, (size_t)REQUESTS * MESSAGE_LEN);
+    int half = REQUESTS / 2;
+
+    // These are written but never answered by the old server
+    kill(server_pid, SIGSTOP);
+    int submitted = 0;
+    for (int i = 0; i < half; i++) {
+        struct otp_request request = make_request(i, NULL, NULL);
+        submitted += otp_client_submit(client, &request) >= 0;
+    }
+    otp_client_complete(client, NULL, 0, 100);
+
+    // The new server takes connections into its backlog but does not handshake while stopped
+    stop_server();
+    start_server();
+    kill(server_pid, SIGSTOP);
+
+    // Completing keeps to its timeout too, with the handshakes unanswered
+    uint64_t start = now_ms();
+    for (int i = half; i < REQUESTS; i++) {
+        struct otp_request request = make_request(i, NULL, NULL);
+        submitted += otp_client_submit(client, &request) >= 0;
+    }
+    otp_client_complete(client, NULL, 0, 100);
+    check("submit and complete do not wait while connections reopen", now_ms() - start < 1000);
+
+    kill(server_pid, SIGCONT);
+    int bad = drain(client);
+    check("requests on dropped connections are resent", submitted == REQUESTS && bad == 0 &&
+                                                        outputs_match(0, REQUESTS));
+}
+
+// Function to run every check against a server started for the test; the first argument names
+// the server binary, ./enc_server by default. Exits 0 when every check passes.
+int main(int argc, char *argv[]) {
+    if (argc > 2) {
+        fprintf(stderr, "Usage: %s [server_binary]\n", argv[0]);
+        exit(1);
+    }
+    if (argc == 2) server_binary = argv[1];
+    snprintf(socket_path, sizeof(socket_path), "/tmp/otp_client_test-%d.sock", (int)getpid());
+
+    inputs = malloc((size_t)REQUESTS * MESSAGE_LEN);
+    keys = malloc((size_t)REQUESTS * MESSAGE_LEN);
+    outputs = malloc((size_t)REQUESTS * MESSAGE_LEN);
+    if (!inputs || !keys || !outputs) {
+        perror("malloc");
+        exit(1);
+    }
+    unsigned int seed = 1;
+    for (size_t i = 0; i < (size_t)REQUESTS * MESSAGE_LEN; i++) {
+        inputs[i] = otp_char_of[rand_r(&seed) % OTP_ALPHABET_SIZE];
+        keys[i] = otp_char_of[rand_r(&seed) % OTP_ALPHABET_SIZE];
+    }
+
+    signal(SIGALRM, on_alarm);
+    start_server();
+    struct otp_client *client = otp_client_open(socket_path, "ENC_CLIENT", 0);
+    if (!client) {
+        perror("otp_client_open");
+        stop_server();
+        exit(1);
+    }
+
+    alarm(TIMEOUT_S);
+    test_pipelined(client);
+    alarm(TIMEOUT_S);
+    test_resubmit(client);
+    alarm(TIMEOUT_S);
+    test_dropped(client);
+    alarm(0);
+
+    otp_client_close(client);
+    stop_server();
+    unlink(socket_path);
+    printf("%d failed\n", failures);
+    return failures ? 1 : 0;
+}
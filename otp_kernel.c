@@ -0,0 +1,698 @@
+// otp_kernel.c
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // For the SSE2, AVX2 and AVX-512BW intrinsics
+#define OTP_X86 1
+#endif
+
+#include "otp_kernel.h"
+
+// Distance from where the character after the range would be to the extra symbol, which replaces it
+#define EXTRA_FIXUP (OTP_ALPHABET_FIRST + OTP_ALPHABET_RANGE - OTP_ALPHABET_EXTRA)
+
+// Alphabet constants as byte lanes. A size of 256 wraps to 0, which byte arithmetic treats the same way.
+#define LANE(x) ((char)(x))
+
+// The byte values are the symbols themselves, so no mapping is needed in either direction
+#define IDENTITY_ALPHABET (OTP_ALPHABET_FIRST == 0 && OTP_ALPHABET_SIZE == 256)
+
+// Function to encrypt one byte at a time with the compile-time tables; also finishes the tails
+// of the vector kernels. otp_char_of wraps sums back into the alphabet, so nothing is divided.
+static void encrypt_scalar(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned sum = otp_index_of[(uint8_t)plaintext[i]] + otp_index_of[(uint8_t)key[i]];
+        ciphertext[i] = otp_char_of[sum];
+    }
+}
+
+// Function to decrypt one byte at a time; also finishes the tails of the vector kernels
+static void decrypt_scalar(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        // Add the alphabet size up front so the difference never goes negative
+        unsigned diff = otp_index_of[(uint8_t)ciphertext[i]] + OTP_ALPHABET_SIZE - otp_index_of[(uint8_t)key[i]];
+        plaintext[i] = otp_char_of[diff];
+    }
+}
+
+// Function to encrypt one byte at a time, stopping at the first plaintext byte outside the alphabet
+static size_t encrypt_checked_scalar(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!otp_valid[(uint8_t)plaintext[i]]) return i;
+        ciphertext[i] = otp_char_of[otp_index_of[(uint8_t)plaintext[i]] + otp_index_of[(uint8_t)key[i]]];
+    }
+    return len;
+}
+
+// Function to decrypt one byte at a time, stopping at the first ciphertext byte outside the alphabet
+static size_t decrypt_checked_scalar(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!otp_valid[(uint8_t)ciphertext[i]]) return i;
+        plaintext[i] = otp_char_of[otp_index_of[(uint8_t)ciphertext[i]] + OTP_ALPHABET_SIZE - otp_index_of[(uint8_t)key[i]]];
+    }
+    return len;
+}
+
+// Function to find the first byte outside the alphabet one byte at a time
+static size_t validate_scalar(const char *text, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!otp_valid[(uint8_t)text[i]]) return i;
+    }
+    return len;
+}
+
+// Packed symbols. The packed transforms work on whole 64-bit words: the fields are split into the
+// even and the odd ones, so that each has its neighbour's bits free above it to carry into, then
+// added all at once and reduced with a carry test per field. A field can hold values past the end
+// of the alphabet; they wrap around, as they do through otp_char_of.
+
+// Lowest bit of every even field of a word, and every bit of those fields
+#define EVEN_FIELDS 0x0004010040100401ULL
+#define EVEN_MASK (EVEN_FIELDS * 31)
+
+// The value v in every even field
+#define FIELDS(v) ((uint64_t)(v) * EVEN_FIELDS)
+
+// Low 40 bits of a word: the first 8 fields
+#define LOW_FIELDS 0xFFFFFFFFFFULL
+
+// Function to read the first n bytes (8 for a whole word) of a little-endian packed word
+static inline uint64_t load_word(const char *p, size_t n) {
+    uint64_t word = 0;
+    memcpy(&word, p, n);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Function to write the first n bytes of a packed word in little-endian order
+static inline void store_word(char *p, uint64_t word, size_t n) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    memcpy(p, &word, n);
+}
+
+// Function to squeeze 8 bytes, each below 32, into the low 40 bits of a word: pairs, then quads, then all 8
+static inline uint64_t squeeze_fields(uint64_t x) {
+    x = (x & 0x001F001F001F001FULL) | ((x & 0x1F001F001F001F00ULL) >> 3);
+    x = (x & 0x000003FF000003FFULL) | ((x & 0x03FF000003FF0000ULL) >> 6);
+    return (x & 0xFFFFFULL) | ((x & 0x000FFFFF00000000ULL) >> 12);
+}
+
+// Function to spread the low 8 fields of a word back out to one per byte
+static inline uint64_t spread_fields(uint64_t x) {
+    x = (x & 0xFFFFFULL) | ((x << 12) & 0x000FFFFF00000000ULL);
+    x = (x & 0x000003FF000003FFULL) | ((x << 6) & 0x03FF000003FF0000ULL);
+    return (x & 0x001F001F001F001FULL) | ((x << 3) & 0x1F001F001F001F00ULL);
+}
+
+// Function to subtract limit from the even fields holding at least that much, for fields below 128:
+// adding 128 - limit carries into bit 7 of exactly those fields, and widening that bit to a mask of
+// the field's 7 bits picks limit out of a word holding it in every field
+static inline uint64_t reduce_fields(uint64_t x, unsigned limit) {
+    uint64_t flags = ((x + FIELDS(128 - limit)) >> 7) & EVEN_FIELDS;
+    return x - (((flags << 7) - flags) & FIELDS(limit));
+}
+
+// Function to encrypt or decrypt the even fields of a word. Decrypting adds twice the alphabet size
+// so no field goes negative; either way the sums stay below 3 times the size, so two reductions do.
+static inline uint64_t transform_fields(uint64_t input, uint64_t key, int decrypt) {
+    uint64_t x = input & EVEN_MASK, k = key & EVEN_MASK;
+    uint64_t sum = decrypt ? x + FIELDS(2 * OTP_ALPHABET_SIZE) - k : x + k;
+    return reduce_fields(reduce_fields(sum, 2 * OTP_ALPHABET_SIZE), OTP_ALPHABET_SIZE);
+}
+
+// Function to encrypt or decrypt every field of a word: the odd fields are shifted down onto the even ones
+static inline uint64_t transform_word(uint64_t input, uint64_t key, int decrypt) {
+    return transform_fields(input, key, decrypt) |
+           transform_fields(input >> OTP_PACK_BITS, key >> OTP_PACK_BITS, decrypt) << OTP_PACK_BITS;
+}
+
+// Function to transform packed symbols a word at a time; the last word may be short, and the bits
+// past its last field are left zero
+__attribute__((always_inline))
+static inline void transform_packed_scalar(const char *input, const char *key, char *output, size_t len, int decrypt) {
+    size_t words = len / OTP_PACK_SYMBOLS;
+    for (size_t i = 0; i < 8 * words; i += 8)
+        store_word(output + i, transform_word(load_word(input + i, 8), load_word(key + i, 8), decrypt), 8);
+
+    size_t tail = len % OTP_PACK_SYMBOLS;
+    if (tail) {
+        size_t at = 8 * words, n = OTP_PACKED_SIZE(tail);
+        uint64_t word = transform_word(load_word(input + at, n), load_word(key + at, n), decrypt);
+        store_word(output + at, word & (((uint64_t)1 << (tail * OTP_PACK_BITS)) - 1), n);
+    }
+}
+
+static void encrypt_packed_scalar(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    transform_packed_scalar(plaintext, key, ciphertext, len, 0);
+}
+
+static void decrypt_packed_scalar(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    transform_packed_scalar(ciphertext, key, plaintext, len, 1);
+}
+
+// Function to pack one word of symbols at a time through the index table
+static void pack_scalar(const char *text, char *packed, size_t len) {
+    for (size_t i = 0; i < len; i += OTP_PACK_SYMBOLS) {
+        size_t n = len - i < OTP_PACK_SYMBOLS ? len - i : OTP_PACK_SYMBOLS;
+        char index[16] = { 0 };
+        for (size_t j = 0; j < n; j++) index[j] = otp_index_of[(uint8_t)text[i + j]];
+        uint64_t word = squeeze_fields(load_word(index, 8)) | squeeze_fields(load_word(index + 8, 8)) << 40;
+        if (n == OTP_PACK_SYMBOLS) store_word(packed + i / OTP_PACK_SYMBOLS * 8, word, 8);
+        else store_word(packed + i / OTP_PACK_SYMBOLS * 8, word, OTP_PACKED_SIZE(n));
+    }
+}
+
+// Function to unpack one word of symbols at a time through the character table, which also wraps
+// fields past the end of the alphabet
+static void unpack_scalar(const char *packed, char *text, size_t len) {
+    for (size_t i = 0; i < len; i += OTP_PACK_SYMBOLS) {
+        size_t n = len - i < OTP_PACK_SYMBOLS ? len - i : OTP_PACK_SYMBOLS;
+        const char *in = packed + i / OTP_PACK_SYMBOLS * 8;
+        uint64_t word = n == OTP_PACK_SYMBOLS ? load_word(in, 8) : load_word(in, OTP_PACKED_SIZE(n));
+        char index[16];
+        store_word(index, spread_fields(word & LOW_FIELDS), 8);
+        store_word(index + 8, spread_fields(word >> 40), 8);
+        for (size_t j = 0; j < n; j++) text[i + j] = otp_char_of[(uint8_t)index[j]];
+    }
+}
+
+#ifdef OTP_X86
+
+// The vector kernels compute the same mappings as the tables with arithmetic, which is cheaper than
+// a gather for alphabets made of one range of bytes. The conditions on the alphabet are constants,
+// so each build keeps only the branch for its own alphabet.
+
+// SSE2: 16 bytes per iteration
+
+// Function to map bytes to symbol indexes: subtracting the first symbol wraps every byte below
+// the range high, so one unsigned min sends all bytes outside the alphabet to the last index
+__attribute__((target("sse2")))
+static inline __m128i index_sse2(__m128i c) {
+    if (IDENTITY_ALPHABET) return c;
+    return _mm_min_epu8(_mm_sub_epi8(c, _mm_set1_epi8(LANE(OTP_ALPHABET_FIRST))),
+                        _mm_set1_epi8(LANE(OTP_ALPHABET_SIZE - 1)));
+}
+
+// Function to map symbol indexes back to characters
+__attribute__((target("sse2")))
+static inline __m128i char_sse2(__m128i i) {
+    if (IDENTITY_ALPHABET) return i;
+    __m128i c = _mm_add_epi8(i, _mm_set1_epi8(LANE(OTP_ALPHABET_FIRST)));
+    if (OTP_ALPHABET_EXTRA < 0) return c;
+    __m128i is_extra = _mm_cmpeq_epi8(i, _mm_set1_epi8(LANE(OTP_ALPHABET_RANGE)));
+    return _mm_sub_epi8(c, _mm_and_si128(is_extra, _mm_set1_epi8(LANE(EXTRA_FIXUP))));
+}
+
+// Function to reduce values below twice the alphabet size modulo the size. Power-of-two sizes
+// only need a mask, and 256 not even that; otherwise subtracting the size wraps values below it
+// high, so an unsigned min keeps whichever of v and v - size is in range.
+__attribute__((target("sse2")))
+static inline __m128i reduce_sse2(__m128i v) {
+    if (OTP_ALPHABET_SIZE == 256) return v;
+    if (OTP_ALPHABET_POW2) return _mm_and_si128(v, _mm_set1_epi8(LANE(OTP_ALPHABET_SIZE - 1)));
+    return _mm_min_epu8(v, _mm_sub_epi8(v, _mm_set1_epi8(LANE(OTP_ALPHABET_SIZE))));
+}
+
+// Function to find the bytes outside the alphabet: a bitmask with one bit per lane. The range test
+// reuses the wrapping subtraction of index_sse2 and checks that the min leaves the value alone.
+__attribute__((target("sse2")))
+static inline int invalid_sse2(__m128i c) {
+    if (OTP_ALPHABET_RANGE == 256) return 0;
+    __m128i x = _mm_sub_epi8(c, _mm_set1_epi8(LANE(OTP_ALPHABET_FIRST)));
+    __m128i valid = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(LANE(OTP_ALPHABET_RANGE - 1))), x);
+    if (OTP_ALPHABET_EXTRA >= 0) valid = _mm_or_si128(valid, _mm_cmpeq_epi8(c, _mm_set1_epi8(LANE(OTP_ALPHABET_EXTRA))));
+    return ~_mm_movemask_epi8(valid) & 0xFFFF;
+}
+
+// Function to encrypt whole vectors; with check set it also validates each plaintext vector as it
+// is loaded and stops before the first one holding a bad byte. Returns where it stopped. Inlined
+// into both callers, so the unchecked kernel carries no trace of the check.
+__attribute__((target("sse2"), always_inline))
+static inline size_t encrypt_vectors_sse2(const char *plaintext, const char *key, char *ciphertext, size_t len, int check) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i raw = _mm_loadu_si128((const __m128i *)(plaintext + i));
+        if (check && invalid_sse2(raw)) break;
+        __m128i p = index_sse2(raw);
+        __m128i k = index_sse2(_mm_loadu_si128((const __m128i *)(key + i)));
+        _mm_storeu_si128((__m128i *)(ciphertext + i), char_sse2(reduce_sse2(_mm_add_epi8(p, k))));
+    }
+    return i;
+}
+
+__attribute__((target("sse2"), always_inline))
+static inline size_t decrypt_vectors_sse2(const char *ciphertext, const char *key, char *plaintext, size_t len, int check) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i raw = _mm_loadu_si128((const __m128i *)(ciphertext + i));
+        if (check && invalid_sse2(raw)) break;
+        __m128i c = index_sse2(raw);
+        __m128i k = index_sse2(_mm_loadu_si128((const __m128i *)(key + i)));
+        __m128i d = _mm_sub_epi8(_mm_add_epi8(c, _mm_set1_epi8(LANE(OTP_ALPHABET_SIZE))), k);
+        _mm_storeu_si128((__m128i *)(plaintext + i), char_sse2(reduce_sse2(d)));
+    }
+    return i;
+}
+
+__attribute__((target("sse2")))
+static void encrypt_sse2(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    size_t i = encrypt_vectors_sse2(plaintext, key, ciphertext, len, 0);
+    encrypt_scalar(plaintext + i, key + i, ciphertext + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void decrypt_sse2(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    size_t i = decrypt_vectors_sse2(ciphertext, key, plaintext, len, 0);
+    decrypt_scalar(ciphertext + i, key + i, plaintext + i, len - i);
+}
+
+// The scalar tail finishes the vector holding a bad byte, so the output is written right up to it
+__attribute__((target("sse2")))
+static size_t encrypt_checked_sse2(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    size_t i = encrypt_vectors_sse2(plaintext, key, ciphertext, len, 1);
+    return i + encrypt_checked_scalar(plaintext + i, key + i, ciphertext + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t decrypt_checked_sse2(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    size_t i = decrypt_vectors_sse2(ciphertext, key, plaintext, len, 1);
+    return i + decrypt_checked_scalar(ciphertext + i, key + i, plaintext + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static size_t validate_sse2(const char *text, size_t len) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        int bad = invalid_sse2(_mm_loadu_si128((const __m128i *)(text + i)));
+        if (bad) return i + __builtin_ctz(bad);
+    }
+    return i + validate_scalar(text + i, len - i);
+}
+
+// AVX2: 32 bytes per iteration
+__attribute__((target("avx2")))
+static inline __m256i index_avx2(__m256i c) {
+    if (IDENTITY_ALPHABET) return c;
+    return _mm256_min_epu8(_mm256_sub_epi8(c, _mm256_set1_epi8(LANE(OTP_ALPHABET_FIRST))),
+                           _mm256_set1_epi8(LANE(OTP_ALPHABET_SIZE - 1)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i char_avx2(__m256i i) {
+    if (IDENTITY_ALPHABET) return i;
+    __m256i c = _mm256_add_epi8(i, _mm256_set1_epi8(LANE(OTP_ALPHABET_FIRST)));
+    if (OTP_ALPHABET_EXTRA < 0) return c;
+    __m256i is_extra = _mm256_cmpeq_epi8(i, _mm256_set1_epi8(LANE(OTP_ALPHABET_RANGE)));
+    return _mm256_sub_epi8(c, _mm256_and_si256(is_extra, _mm256_set1_epi8(LANE(EXTRA_FIXUP))));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i reduce_avx2(__m256i v) {
+    if (OTP_ALPHABET_SIZE == 256) return v;
+    if (OTP_ALPHABET_POW2) return _mm256_and_si256(v, _mm256_set1_epi8(LANE(OTP_ALPHABET_SIZE - 1)));
+    return _mm256_min_epu8(v, _mm256_sub_epi8(v, _mm256_set1_epi8(LANE(OTP_ALPHABET_SIZE))));
+}
+
+__attribute__((target("avx2")))
+static inline unsigned invalid_avx2(__m256i c) {
+    if (OTP_ALPHABET_RANGE == 256) return 0;
+    __m256i x = _mm256_sub_epi8(c, _mm256_set1_epi8(LANE(OTP_ALPHABET_FIRST)));
+    __m256i valid = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(LANE(OTP_ALPHABET_RANGE - 1))), x);
+    if (OTP_ALPHABET_EXTRA >= 0)
+        valid = _mm256_or_si256(valid, _mm256_cmpeq_epi8(c, _mm256_set1_epi8(LANE(OTP_ALPHABET_EXTRA))));
+    return ~(unsigned)_mm256_movemask_epi8(valid);
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline size_t encrypt_vectors_avx2(const char *plaintext, const char *key, char *ciphertext, size_t len, int check) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i raw = _mm256_loadu_si256((const __m256i *)(plaintext + i));
+        if (check && invalid_avx2(raw)) break;
+        __m256i p = index_avx2(raw);
+        __m256i k = index_avx2(_mm256_loadu_si256((const __m256i *)(key + i)));
+        _mm256_storeu_si256((__m256i *)(ciphertext + i), char_avx2(reduce_avx2(_mm256_add_epi8(p, k))));
+    }
+    return i;
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline size_t decrypt_vectors_avx2(const char *ciphertext, const char *key, char *plaintext, size_t len, int check) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i raw = _mm256_loadu_si256((const __m256i *)(ciphertext + i));
+        if (check && invalid_avx2(raw)) break;
+        __m256i c = index_avx2(raw);
+        __m256i k = index_avx2(_mm256_loadu_si256((const __m256i *)(key + i)));
+        __m256i d = _mm256_sub_epi8(_mm256_add_epi8(c, _mm256_set1_epi8(LANE(OTP_ALPHABET_SIZE))), k);
+        _mm256_storeu_si256((__m256i *)(plaintext + i), char_avx2(reduce_avx2(d)));
+    }
+    return i;
+}
+
+__attribute__((target("avx2")))
+static void encrypt_avx2(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    size_t i = encrypt_vectors_avx2(plaintext, key, ciphertext, len, 0);
+    encrypt_sse2(plaintext + i, key + i, ciphertext + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void decrypt_avx2(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    size_t i = decrypt_vectors_avx2(ciphertext, key, plaintext, len, 0);
+    decrypt_sse2(ciphertext + i, key + i, plaintext + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t encrypt_checked_avx2(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    size_t i = encrypt_vectors_avx2(plaintext, key, ciphertext, len, 1);
+    return i + encrypt_checked_sse2(plaintext + i, key + i, ciphertext + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t decrypt_checked_avx2(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    size_t i = decrypt_vectors_avx2(ciphertext, key, plaintext, len, 1);
+    return i + decrypt_checked_sse2(ciphertext + i, key + i, plaintext + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t validate_avx2(const char *text, size_t len) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        unsigned bad = invalid_avx2(_mm256_loadu_si256((const __m256i *)(text + i)));
+        if (bad) return i + __builtin_ctz(bad);
+    }
+    return i + validate_sse2(text + i, len - i);
+}
+
+// Packed symbols, four words at a time with the same steps as transform_word
+__attribute__((target("avx2"), always_inline))
+static inline __m256i reduce_fields_avx2(__m256i x, __m256i bias, __m256i limit) {
+    __m256i flags = _mm256_and_si256(_mm256_srli_epi64(_mm256_add_epi64(x, bias), 7), _mm256_set1_epi64x(EVEN_FIELDS));
+    return _mm256_sub_epi64(x, _mm256_and_si256(_mm256_sub_epi64(_mm256_slli_epi64(flags, 7), flags), limit));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline __m256i transform_fields_avx2(__m256i input, __m256i key, int decrypt) {
+    const __m256i mask = _mm256_set1_epi64x(EVEN_MASK);
+    const __m256i twice = _mm256_set1_epi64x(FIELDS(2 * OTP_ALPHABET_SIZE));
+    __m256i x = _mm256_and_si256(input, mask), k = _mm256_and_si256(key, mask);
+    __m256i sum = decrypt ? _mm256_sub_epi64(_mm256_add_epi64(x, twice), k) : _mm256_add_epi64(x, k);
+    sum = reduce_fields_avx2(sum, _mm256_set1_epi64x(FIELDS(128 - 2 * OTP_ALPHABET_SIZE)), twice);
+    return reduce_fields_avx2(sum, _mm256_set1_epi64x(FIELDS(128 - OTP_ALPHABET_SIZE)),
+                              _mm256_set1_epi64x(FIELDS(OTP_ALPHABET_SIZE)));
+}
+
+__attribute__((target("avx2"), always_inline))
+static inline void transform_packed_avx2(const char *input, const char *key, char *output, size_t len, int decrypt) {
+    size_t i = 0;
+    for (; i + 4 * OTP_PACK_SYMBOLS <= len; i += 4 * OTP_PACK_SYMBOLS) {
+        size_t at = i / OTP_PACK_SYMBOLS * 8;
+        __m256i in = _mm256_loadu_si256((const __m256i *)(input + at));
+        __m256i k = _mm256_loadu_si256((const __m256i *)(key + at));
+        __m256i even = transform_fields_avx2(in, k, decrypt);
+        __m256i odd = transform_fields_avx2(_mm256_srli_epi64(in, OTP_PACK_BITS), _mm256_srli_epi64(k, OTP_PACK_BITS), decrypt);
+        _mm256_storeu_si256((__m256i *)(output + at), _mm256_or_si256(even, _mm256_slli_epi64(odd, OTP_PACK_BITS)));
+    }
+    size_t at = i / OTP_PACK_SYMBOLS * 8;
+    transform_packed_scalar(input + at, key + at, output + at, len - i, decrypt);
+}
+
+__attribute__((target("avx2")))
+static void encrypt_packed_avx2(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    transform_packed_avx2(plaintext, key, ciphertext, len, 0);
+}
+
+__attribute__((target("avx2")))
+static void decrypt_packed_avx2(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    transform_packed_avx2(ciphertext, key, plaintext, len, 1);
+}
+
+// Function to pack two words per iteration: each 128-bit lane maps the 12 characters of one word to
+// indexes, and two multiply-adds merge them into 10-bit pairs and 20-bit quads, leaving only the
+// three quads of each word to join with shifts
+__attribute__((target("avx2")))
+static void pack_avx2(const char *text, char *packed, size_t len) {
+    // Bytes 12 to 15 of a lane are the next word's; their zero weights leave them out
+    const __m256i pairs = _mm256_setr_epi16(0x2001, 0x2001, 0x2001, 0x2001, 0x2001, 0x2001, 0, 0,
+                                            0x2001, 0x2001, 0x2001, 0x2001, 0x2001, 0x2001, 0, 0);
+    const __m256i quads = _mm256_set1_epi32(0x04000001);
+    size_t i = 0;
+    for (; i + 28 <= len; i += 2 * OTP_PACK_SYMBOLS) {
+        __m256i c = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(text + i))),
+                                            _mm_loadu_si128((const __m128i *)(text + i + OTP_PACK_SYMBOLS)), 1);
+        __m256i q = _mm256_madd_epi16(_mm256_maddubs_epi16(index_avx2(c), pairs), quads);
+        __m256i halves = _mm256_or_si256(_mm256_and_si256(q, _mm256_set1_epi64x(0xFFFFF)),
+                                         _mm256_slli_epi64(_mm256_srli_epi64(q, 32), 20));
+        __m256i words = _mm256_or_si256(halves, _mm256_slli_epi64(_mm256_srli_si256(halves, 8), 40));
+        char *out = packed + i / OTP_PACK_SYMBOLS * 8;
+        _mm_storel_epi64((__m128i *)out, _mm256_castsi256_si128(words));
+        _mm_storel_epi64((__m128i *)(out + 8), _mm256_extracti128_si256(words, 1));
+    }
+    pack_scalar(text + i, packed + i / OTP_PACK_SYMBOLS * 8, len - i);
+}
+
+// Function to spread the low 8 fields of each 64-bit lane out to one per byte, as spread_fields does
+__attribute__((target("avx2"), always_inline))
+static inline __m256i spread_fields_avx2(__m256i x) {
+    x = _mm256_or_si256(_mm256_and_si256(x, _mm256_set1_epi64x(0xFFFFF)),
+                        _mm256_and_si256(_mm256_slli_epi64(x, 12), _mm256_set1_epi64x(0x000FFFFF00000000LL)));
+    x = _mm256_or_si256(_mm256_and_si256(x, _mm256_set1_epi64x(0x000003FF000003FFLL)),
+                        _mm256_and_si256(_mm256_slli_epi64(x, 6), _mm256_set1_epi64x(0x03FF000003FF0000LL)));
+    return _mm256_or_si256(_mm256_and_si256(x, _mm256_set1_epi64x(0x001F001F001F001FLL)),
+                           _mm256_and_si256(_mm256_slli_epi64(x, 3), _mm256_set1_epi64x(0x1F001F001F001F00LL)));
+}
+
+// Function to unpack four words per iteration. Pairing each word's low 8 fields with its high 4 in
+// one 128-bit lane puts its 12 symbols in order at the start of the lane; each lane's store runs 4
+// bytes into the next word's symbols, which the next store then overwrites.
+__attribute__((target("avx2")))
+static void unpack_avx2(const char *packed, char *text, size_t len) {
+    size_t i = 0;
+    for (; i + 4 * OTP_PACK_SYMBOLS + 4 <= len; i += 4 * OTP_PACK_SYMBOLS) {
+        __m256i words = _mm256_loadu_si256((const __m256i *)(packed + i / OTP_PACK_SYMBOLS * 8));
+        __m256i low = _mm256_and_si256(words, _mm256_set1_epi64x(LOW_FIELDS));
+        __m256i high = _mm256_srli_epi64(words, 40);
+        __m256i even = char_avx2(reduce_avx2(spread_fields_avx2(_mm256_unpacklo_epi64(low, high))));
+        __m256i odd = char_avx2(reduce_avx2(spread_fields_avx2(_mm256_unpackhi_epi64(low, high))));
+        char *out = text + i;
+        _mm_storeu_si128((__m128i *)out, _mm256_castsi256_si128(even));
+        _mm_storeu_si128((__m128i *)(out + OTP_PACK_SYMBOLS), _mm256_castsi256_si128(odd));
+        _mm_storeu_si128((__m128i *)(out + 2 * OTP_PACK_SYMBOLS), _mm256_extracti128_si256(even, 1));
+        _mm_storeu_si128((__m128i *)(out + 3 * OTP_PACK_SYMBOLS), _mm256_extracti128_si256(odd, 1));
+    }
+    unpack_scalar(packed + i / OTP_PACK_SYMBOLS * 8, text + i, len - i);
+}
+
+// AVX-512BW: 64 bytes per iteration; mask registers replace the and-with-compare steps,
+// and masked loads and stores handle the tail without a scalar loop
+__attribute__((target("avx512bw")))
+static inline __m512i index_avx512(__m512i c) {
+    if (IDENTITY_ALPHABET) return c;
+    return _mm512_min_epu8(_mm512_sub_epi8(c, _mm512_set1_epi8(LANE(OTP_ALPHABET_FIRST))),
+                           _mm512_set1_epi8(LANE(OTP_ALPHABET_SIZE - 1)));
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i char_avx512(__m512i i) {
+    if (IDENTITY_ALPHABET) return i;
+    __m512i c = _mm512_add_epi8(i, _mm512_set1_epi8(LANE(OTP_ALPHABET_FIRST)));
+    if (OTP_ALPHABET_EXTRA < 0) return c;
+    __mmask64 is_extra = _mm512_cmpeq_epi8_mask(i, _mm512_set1_epi8(LANE(OTP_ALPHABET_RANGE)));
+    return _mm512_mask_sub_epi8(c, is_extra, c, _mm512_set1_epi8(LANE(EXTRA_FIXUP)));
+}
+
+__attribute__((target("avx512bw")))
+static inline __m512i reduce_avx512(__m512i v) {
+    if (OTP_ALPHABET_SIZE == 256) return v;
+    if (OTP_ALPHABET_POW2) return _mm512_and_si512(v, _mm512_set1_epi8(LANE(OTP_ALPHABET_SIZE - 1)));
+    return _mm512_min_epu8(v, _mm512_sub_epi8(v, _mm512_set1_epi8(LANE(OTP_ALPHABET_SIZE))));
+}
+
+// Function to find the bytes outside the alphabet among the lanes in m
+__attribute__((target("avx512bw")))
+static inline __mmask64 invalid_avx512(__m512i c, __mmask64 m) {
+    if (OTP_ALPHABET_RANGE == 256) return 0;
+    __m512i x = _mm512_sub_epi8(c, _mm512_set1_epi8(LANE(OTP_ALPHABET_FIRST)));
+    __mmask64 valid = _mm512_cmplt_epu8_mask(x, _mm512_set1_epi8(LANE(OTP_ALPHABET_RANGE)));
+    if (OTP_ALPHABET_EXTRA >= 0) valid |= _mm512_cmpeq_epi8_mask(c, _mm512_set1_epi8(LANE(OTP_ALPHABET_EXTRA)));
+    return ~valid & m;
+}
+
+// Function to encrypt with AVX-512; with check set, a vector holding a bad byte is stored only up
+// to that byte and its offset returned. Returns len otherwise.
+__attribute__((target("avx512bw"), always_inline))
+static inline size_t encrypt_vectors_avx512(const char *plaintext, const char *key, char *ciphertext, size_t len, int check) {
+    for (size_t i = 0; i < len; i += 64) {
+        __mmask64 m = (len - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (len - i)) - 1);
+        __m512i raw = _mm512_maskz_loadu_epi8(m, plaintext + i);
+        __mmask64 bad = check ? invalid_avx512(raw, m) : 0;
+        if (bad) m &= (bad & -bad) - 1; // Only the lanes below the first bad one
+        __m512i p = index_avx512(raw);
+        __m512i k = index_avx512(_mm512_maskz_loadu_epi8(m, key + i));
+        _mm512_mask_storeu_epi8(ciphertext + i, m, char_avx512(reduce_avx512(_mm512_add_epi8(p, k))));
+        if (bad) return i + __builtin_ctzll(bad);
+    }
+    return len;
+}
+
+__attribute__((target("avx512bw"), always_inline))
+static inline size_t decrypt_vectors_avx512(const char *ciphertext, const char *key, char *plaintext, size_t len, int check) {
+    for (size_t i = 0; i < len; i += 64) {
+        __mmask64 m = (len - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (len - i)) - 1);
+        __m512i raw = _mm512_maskz_loadu_epi8(m, ciphertext + i);
+        __mmask64 bad = check ? invalid_avx512(raw, m) : 0;
+        if (bad) m &= (bad & -bad) - 1;
+        __m512i c = index_avx512(raw);
+        __m512i k = index_avx512(_mm512_maskz_loadu_epi8(m, key + i));
+        __m512i d = _mm512_sub_epi8(_mm512_add_epi8(c, _mm512_set1_epi8(LANE(OTP_ALPHABET_SIZE))), k);
+        _mm512_mask_storeu_epi8(plaintext + i, m, char_avx512(reduce_avx512(d)));
+        if (bad) return i + __builtin_ctzll(bad);
+    }
+    return len;
+}
+
+__attribute__((target("avx512bw")))
+static void encrypt_avx512(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    encrypt_vectors_avx512(plaintext, key, ciphertext, len, 0);
+}
+
+__attribute__((target("avx512bw")))
+static void decrypt_avx512(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    decrypt_vectors_avx512(ciphertext, key, plaintext, len, 0);
+}
+
+__attribute__((target("avx512bw")))
+static size_t encrypt_checked_avx512(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    return encrypt_vectors_avx512(plaintext, key, ciphertext, len, 1);
+}
+
+__attribute__((target("avx512bw")))
+static size_t decrypt_checked_avx512(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    return decrypt_vectors_avx512(ciphertext, key, plaintext, len, 1);
+}
+
+__attribute__((target("avx512bw")))
+static size_t validate_avx512(const char *text, size_t len) {
+    for (size_t i = 0; i < len; i += 64) {
+        __mmask64 m = (len - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (len - i)) - 1);
+        __mmask64 bad = invalid_avx512(_mm512_maskz_loadu_epi8(m, text + i), m);
+        if (bad) return i + __builtin_ctzll(bad);
+    }
+    return len;
+}
+
+#endif
+
+// Every kernel, narrowest first. The SSE2 kernel packs with the scalar code, and the AVX-512 one
+// with the AVX2 code: a word of fields does not line up with a 64-byte vector.
+static const struct otp_kernel all_kernels[] = {
+    { "scalar", encrypt_scalar, decrypt_scalar, encrypt_checked_scalar, decrypt_checked_scalar, validate_scalar,
+      pack_scalar, unpack_scalar, encrypt_packed_scalar, decrypt_packed_scalar },
+#ifdef OTP_X86
+    { "sse2", encrypt_sse2, decrypt_sse2, encrypt_checked_sse2, decrypt_checked_sse2, validate_sse2,
+      pack_scalar, unpack_scalar, encrypt_packed_scalar, decrypt_packed_scalar },
+    { "avx2", encrypt_avx2, decrypt_avx2, encrypt_checked_avx2, decrypt_checked_avx2, validate_avx2,
+      pack_avx2, unpack_avx2, encrypt_packed_avx2, decrypt_packed_avx2 },
+    { "avx512bw", encrypt_avx512, decrypt_avx512, encrypt_checked_avx512, decrypt_checked_avx512, validate_avx512,
+      pack_avx2, unpack_avx2, encrypt_packed_avx2, decrypt_packed_avx2 },
+#endif
+};
+
+#define KERNEL_COUNT (int)(sizeof(all_kernels) / sizeof(all_kernels[0]))
+
+static const struct otp_kernel *active_kernel = &all_kernels[0];
+
+// Function to check whether this CPU can run a kernel
+static int kernel_supported(const struct otp_kernel *kernel) {
+#ifdef OTP_X86
+    if (strcmp(kernel->name, "sse2") == 0) return __builtin_cpu_supports("sse2");
+    if (strcmp(kernel->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+    if (strcmp(kernel->name, "avx512bw") == 0) return __builtin_cpu_supports("avx512bw");
+#endif
+    return strcmp(kernel->name, "scalar") == 0;
+}
+
+// Function to pick the kernel once at startup, before main runs
+__attribute__((constructor))
+static void select_kernel(void) {
+#ifdef OTP_X86
+    __builtin_cpu_init(); // CPUID must be queried explicitly this early
+#endif
+    const char *requested = getenv("OTP_KERNEL");
+
+    // Take the widest supported kernel, unless a supported one was asked for by name
+    for (int i = 0; i < KERNEL_COUNT; i++) {
+        if (kernel_supported(&all_kernels[i])) active_kernel = &all_kernels[i];
+    }
+    for (int i = 0; requested && i < KERNEL_COUNT; i++) {
+        if (strcmp(requested, all_kernels[i].name) == 0 && kernel_supported(&all_kernels[i])) {
+            active_kernel = &all_kernels[i];
+        }
+    }
+}
+
+// Function to return the kernel chosen at startup
+const struct otp_kernel *otp_active_kernel(void) {
+    return active_kernel;
+}
+
+// Function to list the kernels this CPU supports
+int otp_supported_kernels(const struct otp_kernel **kernels, int max) {
+    int count = 0;
+    for (int i = 0; i < KERNEL_COUNT && count < max; i++) {
+        if (kernel_supported(&all_kernels[i])) kernels[count++] = &all_kernels[i];
+    }
+    return count;
+}
+
+// Function to encrypt with the active kernel
+void otp_encrypt(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    active_kernel->encrypt(plaintext, key, ciphertext, len);
+}
+
+// Function to decrypt with the active kernel
+void otp_decrypt(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    active_kernel->decrypt(ciphertext, key, plaintext, len);
+}
+
+// Function to encrypt and check the plaintext with the active kernel
+size_t otp_encrypt_checked(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    return active_kernel->encrypt_checked(plaintext, key, ciphertext, len);
+}
+
+// Function to decrypt and check the ciphertext with the active kernel
+size_t otp_decrypt_checked(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    return active_kernel->decrypt_checked(ciphertext, key, plaintext, len);
+}
+
+// Function to check text against the alphabet with the active kernel
+size_t otp_validate(const char *text, size_t len) {
+    return active_kernel->validate(text, len);
+}
+
+// Function to pack symbols with the active kernel
+void otp_pack(const char *text, char *packed, size_t len) {
+    active_kernel->pack(text, packed, len);
+}
+
+// Function to unpack symbols with the active kernel
+void otp_unpack(const char *packed, char *text, size_t len) {
+    active_kernel->unpack(packed, text, len);
+}
+
+// Function to encrypt packed symbols with the active kernel
+void otp_encrypt_packed(const char *plaintext, const char *key, char *ciphertext, size_t len) {
+    active_kernel->encrypt_packed(plaintext, key, ciphertext, len);
+}
+
+// Function to decrypt packed symbols with the active kernel
+void otp_decrypt_packed(const char *ciphertext, const char *key, char *plaintext, size_t len) {
+    active_kernel->decrypt_packed(ciphertext, key, plaintext, len);
+}
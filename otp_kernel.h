@@ -0,0 +1,72 @@
+// otp_kernel.h
+#ifndef OTP_KERNEL_H
+#define OTP_KERNEL_H
+
+#include <stddef.h>
+
+#include "otp_alphabet.h" // For the alphabet chosen at compile time
+
+// Packed form of a message: symbol indexes in 5-bit fields, 12 to a little-endian 64-bit word
+// (symbol i of a word in bits 5i to 5i + 4, the top 4 bits zero), the last word cut down to the
+// bytes its symbols use. Only alphabets of 21 to 32 symbols can be packed: the
+// packed transforms reduce sums of two fields, up to 62, with two subtractions of the size.
+#define OTP_PACK_BITS 5
+#define OTP_PACK_SYMBOLS 12
+#define OTP_PACKABLE (3 * OTP_ALPHABET_SIZE > 2 * 31 && OTP_ALPHABET_SIZE <= (1 << OTP_PACK_BITS))
+
+// Bytes the packed form of len symbols takes: two thirds of a byte per symbol
+#define OTP_PACKED_SIZE(len) ((len) / OTP_PACK_SYMBOLS * 8 + ((len) % OTP_PACK_SYMBOLS * OTP_PACK_BITS + 7) / 8)
+
+// One implementation of the transforms modulo the alphabet size. Bytes outside the alphabet are
+// treated as its last symbol, so every kernel gives identical output for any input.
+struct otp_kernel {
+    const char *name;
+    void (*encrypt)(const char *plaintext, const char *key, char *ciphertext, size_t len);
+    void (*decrypt)(const char *ciphertext, const char *key, char *plaintext, size_t len);
+
+    // The same transforms, checking each input byte against the alphabet in the same pass. They
+    // return len, or the offset of the first bad byte with the output written only up to it.
+    size_t (*encrypt_checked)(const char *plaintext, const char *key, char *ciphertext, size_t len);
+    size_t (*decrypt_checked)(const char *ciphertext, const char *key, char *plaintext, size_t len);
+
+    // Offset of the first byte of text outside the alphabet, or len if there is none
+    size_t (*validate)(const char *text, size_t len);
+
+    // Convert len symbols to and from the packed form; the buffers must not overlap
+    void (*pack)(const char *text, char *packed, size_t len);
+    void (*unpack)(const char *packed, char *text, size_t len);
+
+    // The transforms on packed messages of len symbols, a whole word of fields at a time
+    void (*encrypt_packed)(const char *plaintext, const char *key, char *ciphertext, size_t len);
+    void (*decrypt_packed)(const char *ciphertext, const char *key, char *plaintext, size_t len);
+};
+
+// The kernel in use: the widest one this CPU supports, or the one named by $OTP_KERNEL
+const struct otp_kernel *otp_active_kernel(void);
+
+// Fill kernels with every kernel this CPU supports, narrowest first; returns how many
+int otp_supported_kernels(const struct otp_kernel **kernels, int max);
+
+// Encrypt or decrypt len bytes with the active kernel; output may alias the input
+void otp_encrypt(const char *plaintext, const char *key, char *ciphertext, size_t len);
+void otp_decrypt(const char *ciphertext, const char *key, char *plaintext, size_t len);
+
+// Encrypt or decrypt while validating the input in the same pass; returns len, or the offset of
+// the first input byte outside the alphabet, in which case output is written only up to it
+size_t otp_encrypt_checked(const char *plaintext, const char *key, char *ciphertext, size_t len);
+size_t otp_decrypt_checked(const char *ciphertext, const char *key, char *plaintext, size_t len);
+
+// Offset of the first byte of text outside the alphabet, or len if every byte is in it
+size_t otp_validate(const char *text, size_t len);
+
+// Pack len symbols into OTP_PACKED_SIZE(len) bytes, or unpack them; bytes outside the alphabet pack
+// as its last symbol; fields beyond it unpack modulo the alphabet size
+void otp_pack(const char *text, char *packed, size_t len);
+void otp_unpack(const char *packed, char *text, size_t len);
+
+// Encrypt or decrypt len packed symbols without unpacking them; output may alias the input. Fields
+// beyond the alphabet are reduced modulo its size, as unpacking them would.
+void otp_encrypt_packed(const char *plaintext, const char *key, char *ciphertext, size_t len);
+void otp_decrypt_packed(const char *ciphertext, const char *key, char *plaintext, size_t len);
+
+#endif
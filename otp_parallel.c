@@ -0,0 +1,233 @@
+// otp_parallel.c
+
+#define _GNU_SOURCE // For sysconf(_SC_NPROCESSORS_ONLN)
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "otp_parallel.h"
+
+typedef void (*tile_fn)(const char *input, const char *key, char *output, size_t len);
+typedef size_t (*checked_tile_fn)(const char *input, const char *key, char *output, size_t len);
+
+// Tiles one thread still has to do, [begin, end), packed into one word so that the owner taking
+// from the front and a thief taking the back half are each a single compare-and-swap
+struct tile_range {
+    uint64_t packed;
+} __attribute__((aligned(64)));
+
+// One thread per core, woken for each large message. Participant 0 is always the caller.
+struct otp_pool {
+    pid_t pid;            // Process whose threads these are; a forked child builds its own pool
+    int participants;     // Worker threads plus the caller
+    pthread_mutex_t busy; // Held by the caller whose message the pool is working on
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    uint64_t generation;  // Bumped for each message; workers sleep until it changes
+    int active;           // Workers not yet finished with the current message
+
+    // The message being worked on; exactly one of transform and checked is set
+    tile_fn transform;
+    checked_tile_fn checked;
+    size_t bad;           // Lowest offset of a bad input byte found so far, or len
+    const char *input;
+    const char *key;
+    char *output;
+    size_t len;
+
+    struct tile_range ranges[OTP_MAX_THREADS];
+};
+
+// Argument handed to each worker thread
+struct pool_worker {
+    struct otp_pool *pool;
+    int index;
+};
+
+static struct otp_pool *pool;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to pack and unpack a tile range
+static uint64_t pack(uint32_t begin, uint32_t end) {
+    return (uint64_t)begin << 32 | end;
+}
+
+// Function to take the first tile of a range; returns -1 when the range is empty
+static int64_t take_front(struct tile_range *range) {
+    uint64_t v = __atomic_load_n(&range->packed, __ATOMIC_ACQUIRE);
+    while (1) {
+        uint32_t begin = v >> 32, end = (uint32_t)v;
+        if (begin >= end) return -1;
+        if (__atomic_compare_exchange_n(&range->packed, &v, pack(begin + 1, end), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return begin;
+    }
+}
+
+// Function to steal the back half of another thread's tiles into our own, empty range; returns a tile to do now, or -1
+static int64_t steal(struct otp_pool *p, int thief) {
+    for (int k = 1; k < p->participants; k++) {
+        struct tile_range *victim = &p->ranges[(thief + k) % p->participants];
+        uint64_t v = __atomic_load_n(&victim->packed, __ATOMIC_ACQUIRE);
+        while (1) {
+            uint32_t begin = v >> 32, end = (uint32_t)v;
+            if (begin >= end) break;
+            uint32_t mid = begin + (end - begin) / 2;
+            if (__atomic_compare_exchange_n(&victim->packed, &v, pack(begin, mid), 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                // Keep the rest of the stolen half where other thieves can find it
+                __atomic_store_n(&p->ranges[thief].packed, pack(mid + 1, end), __ATOMIC_RELEASE);
+                return mid;
+            }
+        }
+    }
+    return -1;
+}
+
+// Function to work through our own tiles, then other threads' tiles, until none are left anywhere
+static void work(struct otp_pool *p, int index) {
+    while (1) {
+        int64_t tile = take_front(&p->ranges[index]);
+        if (tile < 0) tile = steal(p, index);
+        if (tile < 0) return;
+
+        // Each tile is written to its own place in the output, so the result needs no reassembly
+        size_t offset = (size_t)tile * OTP_TILE_SIZE;
+        size_t n = p->len - offset < OTP_TILE_SIZE ? p->len - offset : OTP_TILE_SIZE;
+        if (!p->checked) {
+            p->transform(p->input + offset, p->key + offset, p->output + offset, n);
+            continue;
+        }
+
+        // Tiles past a bad byte already found are not needed; otherwise lower the mark to any bad byte in this one
+        size_t bad = __atomic_load_n(&p->bad, __ATOMIC_RELAXED);
+        if (offset > bad) continue;
+        size_t valid = p->checked(p->input + offset, p->key + offset, p->output + offset, n);
+        if (valid == n) continue;
+        bad = __atomic_load_n(&p->bad, __ATOMIC_RELAXED);
+        while (offset + valid < bad &&
+               !__atomic_compare_exchange_n(&p->bad, &bad, offset + valid, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
+    }
+}
+
+// Function run by each pool thread: wait for a message, help with it, report back
+static void *pool_main(void *arg) {
+    struct pool_worker *worker = arg;
+    struct otp_pool *p = worker->pool;
+    uint64_t seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    while (1) {
+        while (p->generation == seen) pthread_cond_wait(&p->start, &p->lock);
+        seen = p->generation;
+        pthread_mutex_unlock(&p->lock);
+
+        work(p, worker->index);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->active == 0) pthread_cond_signal(&p->done);
+    }
+    return NULL;
+}
+
+// Function to return this process's pool, starting its threads on first use
+static struct otp_pool *get_pool(void) {
+    pthread_mutex_lock(&pool_lock);
+    if (!pool || pool->pid != getpid()) {
+        // Threads do not survive fork, so a child cannot use the pool it inherited
+        struct otp_pool *p = calloc(1, sizeof(*p));
+        if (!p) {
+            pthread_mutex_unlock(&pool_lock);
+            return NULL;
+        }
+        p->pid = getpid();
+        pthread_mutex_init(&p->busy, NULL);
+        pthread_mutex_init(&p->lock, NULL);
+        pthread_cond_init(&p->start, NULL);
+        pthread_cond_init(&p->done, NULL);
+
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cores > OTP_MAX_THREADS) cores = OTP_MAX_THREADS;
+        p->participants = 1;
+        for (int i = 1; i < cores; i++) {
+            struct pool_worker *worker = malloc(sizeof(*worker));
+            pthread_t thread;
+            if (!worker) break;
+            worker->pool = p;
+            worker->index = i;
+            if (pthread_create(&thread, NULL, pool_main, worker) != 0) {
+                free(worker);
+                break;
+            }
+            pthread_detach(thread);
+            p->participants++;
+        }
+        pool = p;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    return pool;
+}
+
+// Function to report how many threads share a large message
+int otp_parallel_threads(void) {
+    struct otp_pool *p = get_pool();
+    return p ? p->participants : 1;
+}
+
+// Function to transform a message with one of transform or checked, in parallel tiles when it is
+// large enough; returns the offset of the first bad input byte a checked transform found, or len
+static size_t run_parallel(tile_fn transform, checked_tile_fn checked, const char *input, const char *key,
+                           char *output, size_t len) {
+    struct otp_pool *p = len >= OTP_PARALLEL_THRESHOLD ? get_pool() : NULL;
+
+    // Small messages, single-core machines and a pool busy with someone else's message all run here
+    if (!p || p->participants == 1 || pthread_mutex_trylock(&p->busy) != 0) {
+        if (checked) return checked(input, key, output, len);
+        transform(input, key, output, len);
+        return len;
+    }
+
+    p->transform = transform;
+    p->checked = checked;
+    p->bad = len;
+    p->input = input;
+    p->key = key;
+    p->output = output;
+    p->len = len;
+
+    // Start every thread on an equal, contiguous share of the tiles; stealing evens out the rest
+    size_t tiles = (len + OTP_TILE_SIZE - 1) / OTP_TILE_SIZE;
+    for (int i = 0; i < p->participants; i++) {
+        uint32_t begin = tiles * i / p->participants;
+        uint32_t end = tiles * (i + 1) / p->participants;
+        __atomic_store_n(&p->ranges[i].packed, pack(begin, end), __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->active = p->participants - 1;
+    p->generation++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    // The caller works too, then waits until every worker has let go of the message
+    work(p, 0);
+    pthread_mutex_lock(&p->lock);
+    while (p->active > 0) pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+
+    size_t bad = p->bad;
+    pthread_mutex_unlock(&p->busy);
+    return bad;
+}
+
+// Function to transform a message, in parallel tiles when it is large enough
+void otp_parallel(tile_fn transform, const char *input, const char *key, char *output, size_t len) {
+    run_parallel(transform, NULL, input, key, output, len);
+}
+
+// Function to transform and validate a message, in parallel tiles when it is large enough
+size_t otp_parallel_checked(checked_tile_fn transform, const char *input, const char *key, char *output, size_t len) {
+    return run_parallel(NULL, transform, input, key, output, len);
+}
@@ -0,0 +1,32 @@
+// otp_parallel.h
+#ifndef OTP_PARALLEL_H
+#define OTP_PARALLEL_H
+
+#include <stddef.h>
+
+// Large messages are cut into tiles this big: a tile of input, key and output fits in L2
+#define OTP_TILE_SIZE (256 * 1024)
+
+// Messages shorter than this are not worth waking other threads for
+#define OTP_PARALLEL_THRESHOLD (4 * OTP_TILE_SIZE)
+
+// Most threads, the caller included, that work on one message
+#define OTP_MAX_THREADS 64
+
+// Run transform over len bytes. Large messages are split into tiles shared out to a pool of one
+// thread per core, which steal tiles from each other as they finish; each tile is written straight
+// to its place in output, so nothing is copied afterwards. Output may alias the input. If another
+// caller is using the pool, or the message is small, the calling thread does all the work itself.
+void otp_parallel(void (*transform)(const char *input, const char *key, char *output, size_t len),
+                  const char *input, const char *key, char *output, size_t len);
+
+// Run a checked transform (otp_encrypt_checked or otp_decrypt_checked) the same way, validating
+// the input as it goes. Returns len, or the offset of the first input byte outside the alphabet;
+// output before that offset is complete.
+size_t otp_parallel_checked(size_t (*transform)(const char *input, const char *key, char *output, size_t len),
+                            const char *input, const char *key, char *output, size_t len);
+
+// Number of threads, the caller included, that a large message is spread over
+int otp_parallel_threads(void);
+
+#endif
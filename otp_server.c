@@ -0,0 +1,25 @@
+// otp_server.c
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "server_core.h" // For the shared accept/dispatch loop and protocol handling
+#include "otp_kernel.h"  // For the vectorized encrypt and decrypt kernels
+
+// Main function to set up and run the combined encryption and decryption server
+int main(int argc, char *argv[]) {
+    struct server_options options;
+    parse_server_options(argc, argv, &options);
+
+    // One port and one worker pool for both directions. ENC_CLIENT and DEC_CLIENT sessions keep
+    // their fixed direction by default; OTP_CLIENT sessions pick it per framed job with FRAME_OP_*.
+    static const struct server_role roles[] = {
+        { "ENC_CLIENT", "ENC_SERVER", 0 },
+        { "DEC_CLIENT", "DEC_SERVER", 1 },
+        { "OTP_CLIENT", "OTP_SERVER", 0 },
+    };
+    struct server_config config = { roles, 3, otp_encrypt, otp_decrypt };
+    run_server(&options, &config);
+    return 0;
+}
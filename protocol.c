@@ -0,0 +1,282 @@
+// protocol.c
+
+#define _GNU_SOURCE // For htobe64 and be64toh
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/sendfile.h> // For sending file contents without copying them through user space
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>  // For TCP_NODELAY and TCP_CORK
+#include <poll.h>      // For waiting on non-blocking sockets
+#include <pthread.h>   // For sending a stream while its results come back
+#include <arpa/inet.h> // For htonl/ntohl on frame headers
+#include <endian.h>    // For htobe64/be64toh on 64-bit header fields
+
+#include "protocol.h"
+
+// Function to read exactly len bytes, retrying on short reads and signals
+ssize_t read_full(int fd, void *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = read(fd, (char *)buf + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Non-blocking socket with nothing buffered yet: wait for more data
+                struct pollfd pfd = { fd, POLLIN, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) break; // Peer closed the connection
+        total += n;
+    }
+    return total;
+}
+
+// Function to write all len bytes, retrying on short writes and signals
+int write_full(int fd, const void *buf, size_t len) {
+    size_t total = 0;
+    while (total < len) {
+        ssize_t n = write(fd, (const char *)buf + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Non-blocking socket with a full send buffer: wait until it drains
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+// Function to write a list of buffers with writev, retrying on short writes and signals
+int writev_full(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        // Step past empty pieces, so a finished write never looks like a short one
+        if (iov->iov_len == 0) {
+            iov++;
+            count--;
+            continue;
+        }
+
+        ssize_t n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { fd, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+
+        // Step past the fully written pieces and trim the partly written one
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Function to turn off Nagle's algorithm; Unix sockets refuse the option, which is harmless
+void socket_nodelay(int fd) {
+    int yes = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+
+// Function to cork or uncork a TCP socket; uncorking sends whatever is held back
+void socket_cork(int fd, int on) {
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+// Function to send len bytes of a file from *offset straight from the page cache, advancing *offset
+int sendfile_full(int sockfd, int fd, off_t *offset, size_t len) {
+    while (len > 0) {
+        ssize_t n = sendfile(sockfd, fd, offset, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd = { sockfd, POLLOUT, 0 };
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) return -1; // The file is shorter than expected
+        len -= n;
+    }
+    return 0;
+}
+
+// The sending half of a stream, run on its own thread
+struct stream_sender {
+    int sockfd;
+    int input_fd;
+    int key_fd;
+    size_t len;
+    int failed;
+};
+
+// Function to send every chunk of a stream and the empty chunk that ends it, running ahead of the
+// results as far as the socket buffers allow
+static void *send_chunks(void *arg) {
+    struct stream_sender *sender = arg;
+    off_t input_offset = 0;
+    off_t key_offset = 0;
+
+    for (size_t len = sender->len; len > 0;) {
+        size_t chunk_len = len < STREAM_CHUNK_SIZE ? len : STREAM_CHUNK_SIZE;
+
+        // Send the chunk header, then the payload and key chunks directly from their files. The socket
+        // is corked meanwhile, so the 4-byte header leaves in a full segment with the payload instead
+        // of alone, and uncorking sends the tail without waiting.
+        uint32_t header = htonl((uint32_t)chunk_len);
+        socket_cork(sender->sockfd, 1);
+        int sent = write_full(sender->sockfd, &header, sizeof(header)) == 0 &&
+                   sendfile_full(sender->sockfd, sender->input_fd, &input_offset, chunk_len) == 0 &&
+                   sendfile_full(sender->sockfd, sender->key_fd, &key_offset, chunk_len) == 0;
+        socket_cork(sender->sockfd, 0);
+        if (!sent) {
+            perror("Error sending stream chunk");
+            sender->failed = 1;
+
+            // The server would wait forever for the rest of the chunk, and the receiver with it
+            shutdown(sender->sockfd, SHUT_RDWR);
+            return NULL;
+        }
+        len -= chunk_len;
+    }
+
+    // An empty chunk tells the server the stream is complete
+    uint32_t end = 0;
+    if (write_full(sender->sockfd, &end, sizeof(end)) < 0) {
+        perror("Error sending end of stream");
+        sender->failed = 1;
+    }
+    return NULL;
+}
+
+// Function to stream a message and its key to the server chunk by chunk, passing on results as they return
+int send_stream(int sockfd, int input_fd, int key_fd, size_t len, stream_receiver receive, void *arg) {
+    // Tell the server to expect stream frames instead of a single message
+    int32_t mode = MODE_STREAM;
+    if (write_full(sockfd, &mode, sizeof(mode)) < 0) {
+        perror("Error sending stream mode");
+        return -1;
+    }
+
+    // Chunks go out from a thread of their own while this one takes the results, so several chunks
+    // are in flight at once instead of one per round trip. Input goes out with sendfile and results
+    // are taken by the receiver, so nothing is buffered here.
+    struct stream_sender sender = { sockfd, input_fd, key_fd, len, 0 };
+    pthread_t thread;
+    int err = pthread_create(&thread, NULL, send_chunks, &sender);
+    if (err != 0) {
+        errno = err;
+        perror("Error starting stream sender");
+        return -1;
+    }
+
+    // The server answers every chunk with exactly chunk_len transformed bytes
+    int status = 0;
+    while (len > 0) {
+        size_t chunk_len = len < STREAM_CHUNK_SIZE ? len : STREAM_CHUNK_SIZE;
+        if (receive(arg, sockfd, chunk_len) < 0) {
+            if (!sender.failed) fprintf(stderr, "Error: could not take stream response\n");
+            status = -1;
+
+            // Stop the sender too, which may be waiting for the server to take more input
+            shutdown(sockfd, SHUT_RDWR);
+            break;
+        }
+        len -= chunk_len;
+    }
+
+    pthread_join(thread, NULL);
+    return sender.failed ? -1 : status;
+}
+
+// Function to convert a frame header to its network byte order wire form
+void encode_frame_header(const struct frame_header *header, void *wire) {
+    struct frame_header out;
+    out.id = htonl(header->id);
+    out.flags = htons(header->flags);
+    out.status = htons(header->status);
+    out.payload_len = htonl(header->payload_len);
+    out.key_len = htonl(header->key_len);
+    out.key_offset = htobe64(header->key_offset);
+    out.key_id = htonl(header->key_id);
+    out.retry_after_ms = htonl(header->retry_after_ms);
+    memcpy(wire, &out, sizeof(out));
+}
+
+// Function to convert a frame header from its wire form, which may sit unaligned in a receive buffer
+void decode_frame_header(const void *wire, struct frame_header *header) {
+    struct frame_header in;
+    memcpy(&in, wire, sizeof(in));
+    header->id = ntohl(in.id);
+    header->flags = ntohs(in.flags);
+    header->status = ntohs(in.status);
+    header->payload_len = ntohl(in.payload_len);
+    header->key_len = ntohl(in.key_len);
+    header->key_offset = be64toh(in.key_offset);
+    header->key_id = ntohl(in.key_id);
+    header->retry_after_ms = ntohl(in.retry_after_ms);
+}
+
+// Function to send a frame header and its bodies in one writev; payload and key may be NULL when their length is zero
+int send_frame(int fd, const struct frame_header *header, const void *payload, const void *key) {
+    struct frame_header wire;
+    encode_frame_header(header, &wire);
+
+    struct iovec iov[3] = {
+        { &wire, sizeof(wire) },
+        { (void *)payload, header->payload_len },
+        { (void *)key, header->key_len },
+    };
+    return writev_full(fd, iov, 3);
+}
+
+// Function to receive a frame header; a close before any header byte is a clean end of session
+int recv_frame_header(int fd, struct frame_header *header) {
+    struct frame_header wire;
+    ssize_t n = read_full(fd, &wire, sizeof(wire));
+    if (n == 0) return 0;
+    if (n != sizeof(wire)) return -1;
+
+    decode_frame_header(&wire, header);
+    return 1;
+}
+
+// Function to upload a key and wait for its handle; the response is the only one outstanding
+int upload_key(int sockfd, const char *key, size_t len, uint32_t *key_id, unsigned char *token) {
+    struct frame_header request;
+    memset(&request, 0, sizeof(request));
+    request.flags = FRAME_KEY_UPLOAD;
+    request.payload_len = len;
+    if (send_frame(sockfd, &request, key, NULL) < 0) return -1;
+
+    struct frame_header response;
+    if (recv_frame_header(sockfd, &response) != 1) return -1;
+    if (response.status != STATUS_OK) return response.status;
+    if (response.payload_len != KEY_TOKEN_LEN || read_full(sockfd, token, KEY_TOKEN_LEN) != KEY_TOKEN_LEN) return -1;
+    *key_id = response.key_id;
+    return STATUS_OK;
+}
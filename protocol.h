@@ -0,0 +1,142 @@
+// protocol.h
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h> // For struct iovec
+
+// Every handshake string ("ENC_CLIENT", "DEC_SERVER", "OTP_CLIENT", ...) is exactly this long
+#define HANDSHAKE_LEN 10
+
+// Sent in place of the server's handshake by a server at its connection limit, followed by a
+// uint32_t retry-after hint in milliseconds in network byte order; the server then closes
+#define BUSY_HANDSHAKE "BUSY_RETRY"
+
+// Sent by the client in place of the legacy message length to select stream mode
+#define MODE_STREAM -1
+
+// Sent in place of the legacy length to select framed mode: many jobs over one connection
+#define MODE_FRAMED -2
+
+// Sent in place of the legacy length to select shared-memory mode: payloads stay in a mapping
+// both ends share, and only small job descriptors cross the socket. Unix sockets only.
+#define MODE_SHARED -3
+
+// Sent in place of the legacy length to select framed mode with packed symbols (see otp_kernel.h).
+// The server answers with an int32_t STATUS_* code in native byte order, STATUS_OK if it can pack
+// its alphabet; older servers close the connection instead. Every payload, key and result is then
+// sent packed, while payload_len and key_len still count symbols, not bytes.
+#define MODE_PACKED -4
+
+// Largest chunk of payload (and of key) carried by a single stream frame
+#define STREAM_CHUNK_SIZE 65536
+
+// Largest payload a single framed job may carry; bigger messages belong in stream mode
+#define FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+
+// Status codes carried in framed responses
+#define STATUS_OK 0
+#define STATUS_KEY_TOO_SHORT 1
+#define STATUS_TOO_LARGE 2
+#define STATUS_UNKNOWN_KEY 3
+#define STATUS_KEY_STORE_FULL 4
+#define STATUS_BAD_OPCODE 5
+#define STATUS_BAD_REGION 6 // Shared memory could not be mapped, or a job lies outside it
+#define STATUS_BUSY 7       // The server's job queue is full; retry after retry_after_ms
+
+// Request flags
+#define FRAME_KEY_UPLOAD 0x1 // The payload is a key to keep; the response carries its key_id and token
+#define FRAME_KEY_REF 0x2    // Use payload_len bytes of stored key key_id from key_offset; the token is the key
+#define FRAME_OP_ENCRYPT 0x4 // Encrypt this job, whatever the handshake chose
+#define FRAME_OP_DECRYPT 0x8 // Decrypt this job, whatever the handshake chose
+
+// Secret the server draws at random for every stored key. An upload's response carries it as its
+// payload (payload_len is KEY_TOKEN_LEN), and FRAME_KEY_REF requests send it in place of the key
+// (key_len is KEY_TOKEN_LEN), so a key id alone is not enough to use someone else's key. Tokens
+// are sent as they are, never packed. Uploads of fewer than KEY_TOKEN_LEN payload bytes are refused
+// with STATUS_KEY_TOO_SHORT, and a stored key is freed when the connection that uploaded it closes.
+#define KEY_TOKEN_LEN 16
+
+// Header in front of every framed request and response, sent in network byte order.
+// A request is followed by payload_len payload bytes and key_len key bytes; a response
+// echoes the request id and is followed by payload_len result bytes (key_len is zero).
+struct frame_header {
+    uint32_t id;          // Job id chosen by the client
+    uint16_t flags;       // FRAME_* bits
+    uint16_t status;      // STATUS_* in responses, zero in requests
+    uint32_t payload_len;
+    uint32_t key_len;
+    uint64_t key_offset;  // Where in a stored key to start, with FRAME_KEY_REF
+    uint32_t key_id;      // Stored key handle, with FRAME_KEY_REF or in an upload response
+    uint32_t retry_after_ms; // Zero in requests; with STATUS_BUSY, how long to wait before retrying
+};
+
+// First message of a shared-memory session, sent over a Unix socket with the region's file
+// descriptor attached (SCM_RIGHTS). The region must be a memfd sealed against shrinking
+// (F_SEAL_SHRINK) and at least size bytes long; the server maps it read-write. Shared-memory
+// messages are in native byte order, since both ends are on the same machine. The server answers
+// with an int32_t STATUS_* code.
+struct shm_attach {
+    uint64_t size;
+};
+
+// Descriptor for one shared-memory job, echoed back with a status once the job is done. The server
+// transforms len bytes at offset in place, with the key at key_offset in the same region.
+struct shm_job {
+    uint32_t id;          // Job id chosen by the client
+    uint16_t flags;       // FRAME_OP_* bits
+    uint16_t status;      // STATUS_* in the reply, zero in requests
+    uint64_t offset;
+    uint64_t key_offset;
+    uint64_t len;
+};
+
+// Signature shared by the encrypt and decrypt transforms: output[i] = f(input[i], key[i])
+typedef void (*transform_fn)(const char *input, const char *key, char *output, size_t len);
+
+// Read exactly len bytes unless the peer closes first; returns bytes read or -1 on error.
+// Works on blocking and non-blocking sockets alike.
+ssize_t read_full(int fd, void *buf, size_t len);
+
+// Write all len bytes; returns 0 on success or -1 on error
+int write_full(int fd, const void *buf, size_t len);
+
+// Write every byte described by count iovecs, in one system call when the socket takes them all;
+// iov is advanced in place past what has been written. Returns 0 on success or -1 on error.
+int writev_full(int fd, struct iovec *iov, int count);
+
+// Send small writes at once instead of holding them back for Nagle's algorithm; a no-op on non-TCP sockets
+void socket_nodelay(int fd);
+
+// Hold back partial segments while on, and flush them when turned off; a no-op on non-TCP sockets
+void socket_cork(int fd, int on);
+
+// Send len bytes of a file starting at *offset with sendfile, advancing *offset; 0 or -1
+int sendfile_full(int sockfd, int fd, off_t *offset, size_t len);
+
+// Called by send_stream to take the len result bytes of one chunk from the socket; 0 or -1
+typedef int (*stream_receiver)(void *arg, int sockfd, size_t len);
+
+// Client side of stream mode: send len bytes of the input and key files, handing each chunk's
+// result to receive, which reads it from the socket wherever it is to go. Chunks are sent from a
+// second thread meanwhile, so the stream is not held to one chunk per round trip.
+int send_stream(int sockfd, int input_fd, int key_fd, size_t len, stream_receiver receive, void *arg);
+
+// Convert a frame header to and from its sizeof(struct frame_header) byte wire form
+void encode_frame_header(const struct frame_header *header, void *wire);
+void decode_frame_header(const void *wire, struct frame_header *header);
+
+// Write a frame header (converted to network order) followed by up to two bodies
+int send_frame(int fd, const struct frame_header *header, const void *payload, const void *key);
+
+// Read a frame header and convert it to host order; returns 1, 0 on clean close, or -1
+int recv_frame_header(int fd, struct frame_header *header);
+
+// Upload a key to the server's key store over a framed connection, taking its id and token;
+// returns the STATUS_* code
+int upload_key(int sockfd, const char *key, size_t len, uint32_t *key_id, unsigned char *token);
+
+#endif
@@ -0,0 +1,292 @@
+// respcache.c
+
+#define _GNU_SOURCE // For MAP_ANONYMOUS and MAP_NORESERVE
+
+#include <string.h>
+#include <pthread.h>  // For the process-shared shard locks
+#include <sys/mman.h> // For the shared mapping
+
+#include "respcache.h"
+
+// End of a chunk chain, list or bucket
+#define NONE UINT32_MAX
+
+// Multipliers of the hash, from xxHash64
+#define PRIME1 0x9E3779B185EBCA87ULL
+#define PRIME2 0xC2B2AE3D27D4EB4FULL
+#define PRIME3 0x165667B19E3779F9ULL
+
+// One cached result. Its slot is the one of its first chunk, which holds the start of the request
+// payload; the inline key (if any) and then the result follow it along the chain.
+struct cache_entry {
+    uint64_t hash;
+    uint64_t len;
+    uint64_t key_offset;
+    uint64_t key_serial;
+    uint32_t decrypt;
+    uint32_t packed;
+    uint32_t key_inline;  // Key bytes are stored after the payload
+    uint32_t chunks;
+    uint32_t newer;       // Neighbours in the shard's least-recently-used list
+    uint32_t older;
+    uint32_t bucket_next; // Next entry in the same hash bucket
+};
+
+// A shard owns chunks, entry slots and buckets [base, base + count)
+struct cache_shard {
+    pthread_mutex_t lock;
+    uint32_t base;
+    uint32_t count;
+    uint32_t newest;
+    uint32_t oldest;
+    uint32_t free_list;  // Free chunks, linked through next_chunk
+    uint32_t free_count;
+} __attribute__((aligned(64)));
+
+// Start of the mapping; the arrays and chunk data follow it
+struct response_cache {
+    struct cache_shard shards[CACHE_SHARDS];
+    struct cache_entry *entries;
+    uint32_t *next_chunk;
+    uint32_t *buckets;
+    char *data;
+};
+
+// What chain_access does with the bytes it walks over
+enum chain_op {
+    CHAIN_READ,
+    CHAIN_WRITE,
+    CHAIN_COMPARE
+};
+
+// Function to rotate a word left
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Function to hash bytes 32 at a time with four independent lanes, so the multiplies overlap
+static uint64_t hash_bytes(uint64_t seed, const char *p, size_t len) {
+    uint64_t acc[4] = { seed + PRIME1 + PRIME2, seed + PRIME2, seed, seed - PRIME1 };
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t w;
+            memcpy(&w, p + i + 8 * lane, sizeof(w));
+            acc[lane] = rotl(acc[lane] + w * PRIME2, 31) * PRIME1;
+        }
+    }
+
+    uint64_t h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18) + len;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, sizeof(w));
+        h = rotl(h ^ (rotl(w * PRIME2, 31) * PRIME1), 27) * PRIME1 + PRIME3;
+    }
+    for (; i < len; i++) h = rotl(h ^ ((uint8_t)p[i] * PRIME3), 11) * PRIME1;
+
+    // Mix the last bits into every bit
+    h ^= h >> 33;
+    h *= PRIME2;
+    h ^= h >> 29;
+    h *= PRIME3;
+    return h ^ (h >> 32);
+}
+
+// Function to hash everything a result depends on
+static uint64_t request_hash(const struct cache_request *request) {
+    uint64_t seed = request->decrypt | request->packed << 1;
+    if (request->key) seed = hash_bytes(seed, request->key, request->len);
+    else seed ^= request->key_serial * PRIME3 ^ request->key_offset * PRIME2;
+    return hash_bytes(seed, request->payload, request->len);
+}
+
+// Function to read, write or compare len bytes at offset pos along a chunk chain; returns 0 when a
+// compare finds a difference, 1 otherwise
+static int chain_access(struct response_cache *cache, uint32_t chunk, size_t pos, char *buf, size_t len, enum chain_op op) {
+    while (pos >= CACHE_CHUNK_SIZE) {
+        chunk = cache->next_chunk[chunk];
+        pos -= CACHE_CHUNK_SIZE;
+    }
+    while (len > 0) {
+        char *stored = cache->data + (size_t)chunk * CACHE_CHUNK_SIZE + pos;
+        size_t n = CACHE_CHUNK_SIZE - pos < len ? CACHE_CHUNK_SIZE - pos : len;
+        if (op == CHAIN_READ) memcpy(buf, stored, n);
+        else if (op == CHAIN_WRITE) memcpy(stored, buf, n);
+        else if (memcmp(stored, buf, n) != 0) return 0;
+        buf += n;
+        len -= n;
+        pos = 0;
+        chunk = cache->next_chunk[chunk];
+    }
+    return 1;
+}
+
+// Function to find the bucket a hash falls in
+static uint32_t *bucket_of(struct response_cache *cache, struct cache_shard *shard, uint64_t hash) {
+    return &cache->buckets[shard->base + (hash / CACHE_SHARDS) % shard->count];
+}
+
+// Function to put an entry at the most recently used end of its shard's list
+static void lru_push(struct response_cache *cache, struct cache_shard *shard, uint32_t e) {
+    struct cache_entry *entry = &cache->entries[e];
+    entry->newer = NONE;
+    entry->older = shard->newest;
+    if (shard->newest != NONE) cache->entries[shard->newest].newer = e;
+    shard->newest = e;
+    if (shard->oldest == NONE) shard->oldest = e;
+}
+
+// Function to take an entry out of its shard's list
+static void lru_unlink(struct response_cache *cache, struct cache_shard *shard, uint32_t e) {
+    struct cache_entry *entry = &cache->entries[e];
+    if (entry->newer != NONE) cache->entries[entry->newer].older = entry->older;
+    else shard->newest = entry->older;
+    if (entry->older != NONE) cache->entries[entry->older].newer = entry->newer;
+    else shard->oldest = entry->newer;
+}
+
+// Function to drop the least recently used entry of a shard and free its chunks
+static void evict_oldest(struct response_cache *cache, struct cache_shard *shard) {
+    uint32_t e = shard->oldest;
+    struct cache_entry *entry = &cache->entries[e];
+    lru_unlink(cache, shard, e);
+
+    uint32_t *link = bucket_of(cache, shard, entry->hash);
+    while (*link != e) link = &cache->entries[*link].bucket_next;
+    *link = entry->bucket_next;
+
+    // Hand the chain back whole: its last chunk points at the old free list
+    uint32_t last = e;
+    for (uint32_t i = 1; i < entry->chunks; i++) last = cache->next_chunk[last];
+    cache->next_chunk[last] = shard->free_list;
+    shard->free_list = e;
+    shard->free_count += entry->chunks;
+}
+
+// Function to check whether an entry holds the result for a request
+static int entry_matches(struct response_cache *cache, uint32_t e, const struct cache_request *request) {
+    struct cache_entry *entry = &cache->entries[e];
+    if (entry->hash != request->hash || entry->len != request->len || entry->decrypt != (uint32_t)request->decrypt ||
+        entry->packed != (uint32_t)request->packed)
+        return 0;
+    if (entry->key_inline != (request->key != NULL)) return 0;
+    if (!request->key && (entry->key_serial != request->key_serial || entry->key_offset != request->key_offset)) return 0;
+
+    // Equal hashes only make a match likely; the bytes decide
+    if (!chain_access(cache, e, 0, (char *)request->payload, request->len, CHAIN_COMPARE)) return 0;
+    return !request->key || chain_access(cache, e, request->len, (char *)request->key, request->len, CHAIN_COMPARE);
+}
+
+// Function to map a new, empty cache shared with every process forked after this call
+struct response_cache *response_cache_create(size_t capacity) {
+    size_t chunks = capacity / CACHE_CHUNK_SIZE;
+    if (chunks < CACHE_SHARDS) return NULL;
+    if (chunks >= NONE) chunks = NONE - 1;
+
+    // Header, then entry slots, chunk links and buckets (one of each per chunk), then the chunks
+    size_t arrays = sizeof(struct response_cache) + chunks * (sizeof(struct cache_entry) + 2 * sizeof(uint32_t));
+    size_t data_offset = (arrays + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE * CACHE_CHUNK_SIZE;
+
+    // MAP_NORESERVE keeps a large cache cheap until it fills up
+    char *base = mmap(NULL, data_offset + chunks * CACHE_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED) return NULL;
+
+    struct response_cache *cache = (struct response_cache *)base;
+    cache->entries = (struct cache_entry *)(base + sizeof(*cache));
+    cache->next_chunk = (uint32_t *)(cache->entries + chunks);
+    cache->buckets = cache->next_chunk + chunks;
+    cache->data = base + data_offset;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    for (int s = 0; s < CACHE_SHARDS; s++) {
+        struct cache_shard *shard = &cache->shards[s];
+        pthread_mutex_init(&shard->lock, &attr);
+        shard->base = chunks * s / CACHE_SHARDS;
+        shard->count = chunks * (s + 1) / CACHE_SHARDS - shard->base;
+        shard->newest = shard->oldest = NONE;
+
+        // Every chunk starts out free, and every bucket empty
+        for (uint32_t i = 0; i < shard->count; i++) {
+            cache->next_chunk[shard->base + i] = i + 1 < shard->count ? shard->base + i + 1 : NONE;
+            cache->buckets[shard->base + i] = NONE;
+        }
+        shard->free_list = shard->base;
+        shard->free_count = shard->count;
+    }
+    pthread_mutexattr_destroy(&attr);
+    return cache;
+}
+
+// Function to look a request up, reserving room for its result on a miss
+int response_cache_lookup(struct response_cache *cache, struct cache_request *request, char *out, int64_t *ticket) {
+    *ticket = -1;
+    request->hash = request_hash(request);
+    struct cache_shard *shard = &cache->shards[request->hash % CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    for (uint32_t e = *bucket_of(cache, shard, request->hash); e != NONE; e = cache->entries[e].bucket_next) {
+        if (!entry_matches(cache, e, request)) continue;
+
+        // Copy the result out while the lock keeps the entry from being evicted
+        lru_unlink(cache, shard, e);
+        lru_push(cache, shard, e);
+        size_t key_len = request->key ? request->len : 0;
+        chain_access(cache, e, request->len + key_len, out, request->len, CHAIN_READ);
+        pthread_mutex_unlock(&shard->lock);
+        return 1;
+    }
+
+    // Make room by dropping the least recently used entries. Entries still waiting for their
+    // result are on no list and cannot be dropped; if they hold the room, this request goes uncached.
+    size_t stored = (request->key ? 3 : 2) * request->len;
+    size_t need = (stored + CACHE_CHUNK_SIZE - 1) / CACHE_CHUNK_SIZE;
+    if (need <= shard->count) {
+        while (shard->free_count < need && shard->oldest != NONE) evict_oldest(cache, shard);
+    }
+    if (need > 0 && need <= shard->free_count) {
+        // Take the chain from the front of the free list
+        uint32_t e = shard->free_list, last = e;
+        for (size_t i = 1; i < need; i++) last = cache->next_chunk[last];
+        shard->free_list = cache->next_chunk[last];
+        shard->free_count -= need;
+        cache->next_chunk[last] = NONE;
+
+        struct cache_entry *entry = &cache->entries[e];
+        entry->hash = request->hash;
+        entry->len = request->len;
+        entry->decrypt = request->decrypt;
+        entry->packed = request->packed;
+        entry->key_inline = request->key != NULL;
+        entry->key_serial = request->key_serial;
+        entry->key_offset = request->key_offset;
+        entry->chunks = need;
+
+        // Keep a copy of the request: the caller is about to transform the payload in place
+        chain_access(cache, e, 0, (char *)request->payload, request->len, CHAIN_WRITE);
+        if (request->key) chain_access(cache, e, request->len, (char *)request->key, request->len, CHAIN_WRITE);
+        *ticket = e;
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+// Function to store a result in its reserved entry and publish the entry
+void response_cache_fill(struct response_cache *cache, const struct cache_request *request, int64_t ticket,
+                         const char *result) {
+    if (ticket < 0) return;
+    uint32_t e = (uint32_t)ticket;
+    struct cache_shard *shard = &cache->shards[request->hash % CACHE_SHARDS];
+
+    pthread_mutex_lock(&shard->lock);
+    size_t key_len = request->key ? request->len : 0;
+    chain_access(cache, e, request->len + key_len, (char *)result, request->len, CHAIN_WRITE);
+
+    uint32_t *bucket = bucket_of(cache, shard, request->hash);
+    cache->entries[e].bucket_next = *bucket;
+    *bucket = e;
+    lru_push(cache, shard, e);
+    pthread_mutex_unlock(&shard->lock);
+}
@@ -0,0 +1,44 @@
+// respcache.h
+#ifndef RESPCACHE_H
+#define RESPCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Independently locked parts of the cache; a request's hash picks its shard
+#define CACHE_SHARDS 16
+
+// Entries are stored as chains of chunks this big, so the cache never fragments
+#define CACHE_CHUNK_SIZE 4096
+
+// Bounded cache of transform results, keyed by the operation, the key and the payload. It lives
+// in one shared memory mapping created before the server forks or starts threads, so every child
+// process and worker shares it. Each shard has its own lock and its own least-recently-used list.
+struct response_cache;
+
+// What a result depends on. The caller fills in everything but hash.
+struct cache_request {
+    int decrypt;
+    int packed;          // Payload, key and result are packed symbols; len counts their bytes
+    const char *payload;
+    size_t len;
+    const char *key;     // Key bytes sent with the request, or NULL for a stored key
+    uint64_t key_serial; // Stored key's serial and the offset into it, when key is NULL
+    uint64_t key_offset;
+    uint64_t hash;       // Set by response_cache_lookup
+};
+
+// Map a cache holding at most capacity bytes of entries; returns NULL on failure
+struct response_cache *response_cache_create(size_t capacity);
+
+// Look a request up. On a hit the result is copied to out and 1 is returned. On a miss 0 is
+// returned and *ticket holds space reserved for the result (a copy of the request is already in
+// it), or -1 if the request cannot be cached; out may be the payload itself.
+int response_cache_lookup(struct response_cache *cache, struct cache_request *request, char *out, int64_t *ticket);
+
+// Store the result for a ticket from a miss, making it visible to later lookups. Every ticket
+// other than -1 must be filled exactly once.
+void response_cache_fill(struct response_cache *cache, const struct cache_request *request, int64_t ticket,
+                         const char *result);
+
+#endif
@@ -0,0 +1,1969 @@
+// server_core.c
+
+#define _GNU_SOURCE // For accept4
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>    // For listening on a Unix socket
+#include <sys/mman.h>  // For mapping a client's shared-memory region
+#include <sys/stat.h>  // For checking the size of that region
+#include <netinet/in.h>
+#include <arpa/inet.h> // For inet_ntoa and ntohl
+#include <signal.h>    // For signal handling
+#include <errno.h>     // For errno during error handling
+#include <sys/wait.h>  // For handling child process cleanup
+#include <fcntl.h>     // For making the listening socket non-blocking and checking a region's seals
+#include <pthread.h>   // For the worker thread pool
+#include <sys/epoll.h> // For the event loop
+#include <sys/uio.h>   // For the iovecs that register io_uring buffers
+#include <sys/prctl.h> // For stopping pre-forked workers along with the master
+#include <time.h>      // For timing how long a pre-forked worker lived
+
+#include "server_core.h"
+#include "keystore.h"
+#include "metrics.h"
+#include "uring.h"
+#include "otp_parallel.h"
+#include "otp_kernel.h" // For the packed wire form
+#include "respcache.h"
+#include "trace.h"
+
+// Number of epoll events handled per wakeup of the reactor
+#define MAX_EVENTS 64
+
+// A connection turned away as busy is closed once the client closes its end, or after LINGER_MS at
+// the latest; the thread that closes them looks for expired ones every LINGER_TICK_MS
+#define LINGER_MS 1000
+#define LINGER_TICK_MS 100
+
+// Submission queue size of each io_uring, connections one ring serves at once (also the size of
+// its fixed file table), and how many of those connections get a registered buffer as their arena
+#define URING_ENTRIES 256
+#define URING_SESSIONS 1024
+#define URING_FIXED_BUFFERS 32
+
+// What an io_uring completion is for: the low two bits of user_data, above which sits the slot
+#define URING_OP_RECV 0
+#define URING_OP_SEND 1
+#define URING_OP_OTHER 2
+#define URING_ACCEPT UINT64_MAX
+
+// Arena allocated with each session: enough for a full stream chunk and its key, so only
+// framed jobs larger than that ever make it grow
+#define ARENA_SIZE (sizeof(struct frame_header) + 2 * STREAM_CHUNK_SIZE)
+
+// Ancillary data with room for the one descriptor a shared-memory client passes
+union passed_control {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+};
+
+// Phases a session moves through, in order
+enum session_phase {
+    PHASE_HANDSHAKE, // Waiting for the client handshake string
+    PHASE_MODE,      // Waiting for the legacy length or a MODE_* selector
+    PHASE_SINGLE,    // One message of a known length, then close
+    PHASE_STREAM,    // Length-prefixed chunks until an empty chunk
+    PHASE_FRAMED,    // Framed jobs until the client closes
+    PHASE_ATTACH,    // Waiting for the shared-memory region to map
+    PHASE_SHARED     // Shared-memory job descriptors until the client closes
+};
+
+// Outcome of looking at the bytes a session has received so far
+enum parse_result {
+    PARSE_NEED_MORE, // Not enough bytes yet; session->need says how many
+    PARSE_JOB,       // session->job is ready to run
+    PARSE_CLOSE      // Session is finished or broken
+};
+
+// One complete unit of work found at the front of a session's arena
+struct job {
+    transform_fn transform;       // Encrypt or decrypt
+    int decrypt;                  // Set when transform is the decrypt one
+    char *payload;                // Transformed in place
+    const char *key;
+    uint32_t key_id;              // Stored key the key points into, held until the job is done, or 0
+    uint64_t key_serial;          // Tells that stored key apart from any other ever kept in its slot
+    uint64_t key_offset;
+    size_t len;                   // Bytes to transform, or to store for an upload
+    int upload;                   // Store the payload as a key instead of transforming it
+    int packed;                   // Payload, key and result are packed; len counts symbols
+    char *reply;                  // Start of the bytes to send back: the payload, or a header just before it
+    size_t reply_len;
+    size_t consumed;              // Bytes to drop from the arena once answered
+    int close_after;              // End the session once the reply is out
+    struct frame_header response; // Written over the request header in framed mode
+};
+
+// Per-connection state, shared by the fork and epoll modes
+struct session {
+    int fd;
+    struct sockaddr_in addr;
+    enum session_phase phase;
+    const struct server_role *role; // Chosen by the handshake
+    int single_len;        // Message length announced in single-message mode
+    char *arena;           // The connection's only buffer: bytes are received, transformed and sent from here
+    size_t start;          // Received bytes not yet consumed are arena[start, end)
+    size_t end;
+    size_t cap;
+    size_t need;           // Bytes that must be buffered before parsing can progress
+    int fixed_buffer;      // Registered io_uring buffer holding the arena, or -1 when it is on the heap
+    char *shared;          // Client's shared-memory region in shared mode, where jobs are transformed
+    size_t shared_len;
+    int passed_fd;         // Region the client passed over a Unix socket, until the attach maps it, or -1
+    struct msghdr msg;     // Where reads that may carry that descriptor are received
+    struct iovec iov;
+    union passed_control control;
+    int packed;            // Framed jobs carry packed symbols
+    char *scratch;         // Packed copy of a stored key, or an unpacked key to store, in packed mode
+    size_t scratch_cap;
+    uint64_t key_owner;    // Owner of the keys this session uploaded, or 0 if it has uploaded none
+    struct job job;
+    size_t sent;           // Reply bytes written so far, where replies are written without blocking
+    int writing;           // Waiting for the socket to take the rest of the reply (epoll mode)
+    uint64_t mark;         // When the current stage began, for the latency histograms
+    struct trace_record trace; // The current request's trace, when tracing
+    int trace_stage;       // Stages of it whose end is recorded
+    uint64_t cpu_mark;     // Thread CPU clock when this thread took the session up
+    int cpu_running;       // Set while a thread is working on the session and counting its CPU time
+    struct session *next;  // Link in the worker queue
+};
+
+// Event loop state shared by the reactor thread and the workers
+struct reactor {
+    int epoll_fd;
+    int listen_socket;
+    const struct server_config *config;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct session *head; // Sessions with a job ready, oldest first
+    struct session *tail;
+    int queued;           // Sessions in the queue, checked against the queue limit
+};
+
+// One connection served by an io_uring thread
+struct uring_conn {
+    struct session *s; // NULL while the slot is free
+    int file;          // Socket being put in the fixed file table; read by the kernel asynchronously
+    int deferred;      // Operation still to queue when the ring had no free entry, or -1
+    int next_deferred; // Next slot waiting to queue an operation, or -1
+};
+
+// State of one io_uring thread: its ring, its connections and their registered resources
+struct uring_server {
+    struct uring ring;
+    int listen_socket;
+    const struct server_config *config;
+    int multishot;     // One accept keeps producing connections (Linux 5.19+)
+    int fixed_files;   // Sockets are used through the fixed file table
+    int fixed_buffers; // Slots below this have a registered arena in pool
+    char *pool;
+    struct uring_conn conns[URING_SESSIONS];
+    int free_slots[URING_SESSIONS];
+    int free_count;
+    int deferred_head; // Slots waiting for a free submission entry, oldest first, or -1
+    int deferred_tail;
+    int accept_deferred; // The accept is waiting for a free submission entry too
+};
+
+// Keys uploaded by clients, shared by every worker thread and child process
+static struct key_store *key_store;
+
+// Results of recent jobs, shared the same way; NULL when caching is off
+static struct response_cache *response_cache;
+
+// Admission control: the connection and queue limits (0 for none), and the sessions open now in
+// this process, or the children serving connections in fork mode
+static int max_sessions;
+static int queue_limit;
+static int active_sessions;
+
+// Set when the server listens on a Unix socket, whose clients alone can pass a shared-memory region
+static int local_sockets;
+
+// A busy connection whose reply is out, waiting for the client to close before its socket is closed
+struct lingering {
+    int fd;
+    uint64_t deadline;       // Closed by then even if the client never closes (ms)
+    struct lingering *prev;
+    struct lingering *next;
+};
+
+// Busy connections still open, and the epoll instance and thread that drain and close them
+static pthread_mutex_t linger_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t linger_once = PTHREAD_ONCE_INIT;
+static struct lingering *lingering;
+static int linger_epoll = -1;
+
+// One share of the server: a listening socket and the accept loop that serves it
+struct shard {
+    int listen_socket;
+    const struct server_config *config;
+    enum server_mode mode;
+    int threads;
+};
+
+// Utility function to print an error message and exit the program
+void error(const char *msg) {
+    perror(msg);
+    exit(1);
+}
+
+// Function to print the usage message and exit
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-m fork|prefork|epoll|uring] [-t threads] [-k key_store_mb] [-M metrics_port]\n"
+                    "       [-l error|warn|info|debug] [-c max_connections] [-q queue_limit] [-b backlog]\n"
+                    "       [-r listeners] [-C cache_mb] [-T slow_us] port|socket_path\n", program);
+    exit(1);
+}
+
+// Function to parse the server command line
+void parse_server_options(int argc, char *argv[], struct server_options *options) {
+    options->mode = SERVER_FORK;
+    options->threads = 0;
+    options->key_store_mb = 256;
+    options->metrics_port = 0;
+    options->log_level = LOG_INFO;
+    options->max_connections = 0;
+    options->queue_limit = 0;
+    options->backlog = DEFAULT_BACKLOG;
+    options->listeners = 1;
+    options->cache_mb = 0;
+    options->trace_slow_us = -1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "m:t:k:M:l:c:q:b:r:C:T:")) != -1) {
+        if (opt == 'm') {
+            if (strcmp(optarg, "fork") == 0) {
+                options->mode = SERVER_FORK;
+            } else if (strcmp(optarg, "prefork") == 0) {
+                options->mode = SERVER_PREFORK;
+            } else if (strcmp(optarg, "epoll") == 0) {
+                options->mode = SERVER_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                options->mode = SERVER_URING;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (opt == 't') {
+            options->threads = atoi(optarg);
+            if (options->threads <= 0) usage(argv[0]);
+        } else if (opt == 'k') {
+            options->key_store_mb = atoi(optarg);
+            if (options->key_store_mb < 0) usage(argv[0]);
+        } else if (opt == 'M') {
+            options->metrics_port = atoi(optarg);
+            if (options->metrics_port <= 0) usage(argv[0]);
+        } else if (opt == 'l') {
+            int level = log_parse_level(optarg);
+            if (level < 0) usage(argv[0]);
+            options->log_level = level;
+        } else if (opt == 'c') {
+            options->max_connections = atoi(optarg);
+            if (options->max_connections < 0) usage(argv[0]);
+        } else if (opt == 'q') {
+            options->queue_limit = atoi(optarg);
+            if (options->queue_limit < 0) usage(argv[0]);
+        } else if (opt == 'b') {
+            options->backlog = atoi(optarg);
+            if (options->backlog <= 0) usage(argv[0]);
+        } else if (opt == 'r') {
+            options->listeners = atoi(optarg);
+            if (options->listeners <= 0) usage(argv[0]);
+        } else if (opt == 'C') {
+            options->cache_mb = atoi(optarg);
+            if (options->cache_mb < 0) usage(argv[0]);
+        } else if (opt == 'T') {
+            options->trace_slow_us = atol(optarg);
+            if (options->trace_slow_us < 0) usage(argv[0]);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if (argc - optind != 1) usage(argv[0]);
+
+    // A path names a Unix socket for clients on the same machine; anything else is a TCP port
+    options->socket_path = strchr(argv[optind], '/') ? argv[optind] : NULL;
+    options->port = options->socket_path ? 0 : atoi(argv[optind]);
+}
+
+// Function to describe a client for the logs; Unix socket peers have no address worth printing
+static const char *peer_name(const struct sockaddr_in *addr) {
+    return addr->sin_family == AF_INET ? inet_ntoa(addr->sin_addr) : "a local socket";
+}
+
+// Function to read the clock stages are timed with; tracing needs it even when metrics are off
+static uint64_t stage_clock(void) {
+    return trace_enabled() ? trace_now() : metrics_now();
+}
+
+// Function to end the current request's stage: the histogram gets the time since mark and, when
+// tracing, the request's record gets the boundary. Stages the request skipped end where they began.
+static void end_stage(struct session *s, enum metric_stage stage) {
+    if (!trace_enabled()) {
+        s->mark = metrics_observe(stage, s->mark);
+        return;
+    }
+    uint64_t now = trace_now();
+    metrics_record(stage, now - s->mark);
+    for (int k = s->trace_stage; k < (int)stage; k++) s->trace.at[k + 1] = s->trace.at[k];
+    s->trace.at[stage + 1] = now;
+    s->trace_stage = stage + 1;
+    s->mark = now;
+}
+
+// Function to start counting the calling thread's CPU time towards the session's request
+static void trace_resume(struct session *s) {
+    if (!trace_enabled() || s->cpu_running) return;
+    s->cpu_mark = trace_thread_cpu();
+    s->cpu_running = 1;
+}
+
+// Function to stop counting it, before the session is handed on or left waiting for I/O
+static void trace_pause(struct session *s) {
+    if (!s->cpu_running) return;
+    s->trace.cpu_ns += trace_thread_cpu() - s->cpu_mark;
+    s->cpu_running = 0;
+}
+
+// Function to put a finished request's trace in the ring if it was slow, and start the next request's
+static void trace_job(struct session *s) {
+    struct job *job = &s->job;
+    struct trace_record *t = &s->trace;
+    int running = s->cpu_running;
+    trace_pause(s);
+
+    t->bytes_in = job->consumed;
+    t->bytes_out = job->reply_len;
+    t->len = job->len;
+    t->status = job->response.status;
+    const char *mode = s->phase == PHASE_SINGLE   ? "single"
+                       : s->phase == PHASE_STREAM ? "stream"
+                       : s->phase == PHASE_SHARED ? "shared"
+                       : s->packed                ? "packed"
+                                                  : "framed";
+    strncpy(t->mode, mode, sizeof(t->mode));
+    trace_submit(t);
+
+    t->at[0] = s->mark;
+    t->cpu_ns = 0;
+    s->trace_stage = 0;
+    if (running) trace_resume(s);
+}
+
+// Function to create the state for a newly accepted connection; the arena is allocated unless one is given
+static struct session *new_session(int fd, struct sockaddr_in addr, char *arena) {
+    struct session *s = calloc(1, sizeof(*s));
+    if (!s) return NULL;
+    s->arena = arena ? arena : malloc(ARENA_SIZE);
+    if (!s->arena) {
+        free(s);
+        return NULL;
+    }
+    s->fixed_buffer = -1;
+    s->passed_fd = -1;
+    s->cap = ARENA_SIZE;
+    s->fd = fd;
+
+    // Every reply is written whole, so there is nothing for Nagle's algorithm to coalesce; it would
+    // only hold back replies to pipelined jobs until the previous one is acknowledged
+    socket_nodelay(fd);
+    s->addr = addr;
+    s->phase = PHASE_HANDSHAKE;
+    s->mark = s->trace.at[0] = stage_clock();
+    metrics_gauge_add(GAUGE_ACTIVE_CONNECTIONS, 1);
+
+    // The peer is formatted once per connection, and only for the traces
+    if (trace_enabled()) {
+        char host[INET_ADDRSTRLEN];
+        if (addr.sin_family == AF_INET && inet_ntop(AF_INET, &addr.sin_addr, host, sizeof(host))) {
+            snprintf(s->trace.peer, sizeof(s->trace.peer), "%s:%u", host, ntohs(addr.sin_port));
+        } else {
+            strcpy(s->trace.peer, "local");
+        }
+    }
+    __atomic_add_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+    return s;
+}
+
+// Function to close a connection and release its state
+static void close_session(struct session *s) {
+    metrics_gauge_add(GAUGE_ACTIVE_CONNECTIONS, -1);
+    __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+    if (s->key_owner) key_store_release(key_store, s->key_owner);
+    close(s->fd);
+    if (s->passed_fd >= 0) close(s->passed_fd);
+    if (s->shared) munmap(s->shared, s->shared_len);
+    if (s->fixed_buffer < 0) free(s->arena);
+    free(s->scratch);
+    free(s);
+}
+
+// Function to check whether the server is serving as many connections as it is allowed
+static int at_capacity(void) {
+    return max_sessions > 0 && __atomic_load_n(&active_sessions, __ATOMIC_RELAXED) >= max_sessions;
+}
+
+// Function to read the monotonic clock in milliseconds, for lingering connections
+static uint64_t linger_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Function to close a lingering connection and forget it; called with linger_lock held
+static void linger_drop(struct lingering *l) {
+    if (l->prev) l->prev->next = l->next;
+    else lingering = l->next;
+    if (l->next) l->next->prev = l->prev;
+    epoll_ctl(linger_epoll, EPOLL_CTL_DEL, l->fd, NULL);
+    close(l->fd);
+    free(l);
+}
+
+// Function run by the linger thread: throw away what busy clients send, and close each connection
+// once its client has closed its end or its time is up
+static void *linger_main(void *arg) {
+    (void)arg;
+    struct epoll_event events[MAX_EVENTS];
+    char discard[256];
+    while (1) {
+        int n = epoll_wait(linger_epoll, events, MAX_EVENTS, LINGER_TICK_MS);
+        pthread_mutex_lock(&linger_lock);
+        for (int i = 0; i < n; i++) {
+            struct lingering *l = events[i].data.ptr;
+            ssize_t got;
+            while ((got = recv(l->fd, discard, sizeof(discard), MSG_DONTWAIT)) > 0) continue;
+            if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) linger_drop(l);
+        }
+        uint64_t now = linger_clock();
+        for (struct lingering *l = lingering, *next; l; l = next) {
+            next = l->next;
+            if (now >= l->deadline) linger_drop(l);
+        }
+        pthread_mutex_unlock(&linger_lock);
+    }
+    return NULL;
+}
+
+// Functions to keep the lingering list consistent across fork. A child has no linger thread, so it
+// closes its copies of the sockets rather than hold them open after the parent has closed them.
+static void linger_prepare(void) {
+    pthread_mutex_lock(&linger_lock);
+}
+
+static void linger_parent(void) {
+    pthread_mutex_unlock(&linger_lock);
+}
+
+static void linger_child(void) {
+    while (lingering) {
+        struct lingering *l = lingering;
+        lingering = l->next;
+        close(l->fd);
+        free(l);
+    }
+    if (linger_epoll >= 0) close(linger_epoll);
+    linger_epoll = -1;
+    pthread_mutex_unlock(&linger_lock);
+}
+
+// Function to start the linger thread the first time a connection is turned away
+static void linger_start(void) {
+    pthread_atfork(linger_prepare, linger_parent, linger_child);
+    linger_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (linger_epoll < 0) return;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, linger_main, NULL) != 0) {
+        close(linger_epoll);
+        linger_epoll = -1;
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// Function to hand a busy connection to the linger thread, which closes it once the client is done with it
+static void linger_close(int fd) {
+    pthread_once(&linger_once, linger_start);
+    struct lingering *l = malloc(sizeof(*l));
+    pthread_mutex_lock(&linger_lock);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = l;
+    if (!l || linger_epoll < 0 || epoll_ctl(linger_epoll, EPOLL_CTL_ADD, fd, &event) < 0) {
+        // Without the thread the socket is closed now, at the risk of resetting the connection
+        pthread_mutex_unlock(&linger_lock);
+        free(l);
+        close(fd);
+        return;
+    }
+    l->fd = fd;
+    l->deadline = linger_clock() + LINGER_MS;
+    l->prev = NULL;
+    l->next = lingering;
+    if (lingering) lingering->prev = l;
+    lingering = l;
+    pthread_mutex_unlock(&linger_lock);
+}
+
+// Function to turn a connection away while the server is at its limit: the busy reply takes the
+// place of the server handshake and tells the client how long to wait before trying again
+static void reject_busy(int fd) {
+    char reply[HANDSHAKE_LEN + sizeof(uint32_t)];
+    uint32_t retry_after = htonl(BUSY_RETRY_MS);
+
+    memcpy(reply, BUSY_HANDSHAKE, HANDSHAKE_LEN);
+    memcpy(reply + HANDSHAKE_LEN, &retry_after, sizeof(retry_after));
+    send(fd, reply, sizeof(reply), MSG_DONTWAIT | MSG_NOSIGNAL);
+
+    // The client's handshake is usually still on its way, and closing with it unread, or before it
+    // arrives, would reset the connection and could throw the reply away before the client reads
+    // it. So only the sending side is shut now; the socket is closed once the client has finished.
+    shutdown(fd, SHUT_WR);
+    linger_close(fd);
+    metrics_add(METRIC_BUSY_REJECTIONS, 1);
+}
+
+// Function to drop answered bytes from the front of the arena; pipelined bytes after them stay where they are
+static void consume(struct session *s, size_t len) {
+    s->start += len;
+    if (s->start == s->end) s->start = s->end = 0;
+}
+
+// Function to make room for the unit being parsed: slide the unconsumed bytes down, and grow only if they still do not fit
+static int make_room(struct session *s) {
+    size_t pending = s->end - s->start;
+    size_t want = s->need > pending ? s->need : pending + 1;
+
+    if (s->start + want > s->cap && s->start > 0) {
+        memmove(s->arena, s->arena + s->start, pending);
+        s->start = 0;
+        s->end = pending;
+    }
+    if (want > s->cap) {
+        char *grown;
+        if (s->fixed_buffer >= 0) {
+            // A registered io_uring buffer cannot grow, so the session moves to the heap
+            grown = malloc(want);
+            if (!grown) return -1;
+            memcpy(grown, s->arena, s->end);
+            s->fixed_buffer = -1;
+        } else {
+            grown = realloc(s->arena, want);
+            if (!grown) return -1;
+        }
+        s->arena = grown;
+        s->cap = want;
+    }
+    return 0;
+}
+
+// Function to tell whether a session's next read may bring the client's shared-memory region. Only
+// recvmsg keeps a passed descriptor; a plain read would close it.
+static int expects_region(const struct session *s) {
+    return local_sockets && (s->phase == PHASE_HANDSHAKE || s->phase == PHASE_MODE || s->phase == PHASE_ATTACH);
+}
+
+// Function to point the session's message header at the free end of its arena, with room for a descriptor
+static void prepare_recvmsg(struct session *s) {
+    memset(&s->msg, 0, sizeof(s->msg));
+    memset(&s->control, 0, sizeof(s->control));
+    s->iov.iov_base = s->arena + s->end;
+    s->iov.iov_len = s->cap - s->end;
+    s->msg.msg_iov = &s->iov;
+    s->msg.msg_iovlen = 1;
+    s->msg.msg_control = s->control.buf;
+    s->msg.msg_controllen = sizeof(s->control.buf);
+}
+
+// Function to keep the descriptor a received message carried, if any; a later one replaces it
+static void take_passed_fd(struct session *s) {
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&s->msg); c; c = CMSG_NXTHDR(&s->msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS || c->cmsg_len < CMSG_LEN(sizeof(int)))
+            continue;
+        if (s->passed_fd >= 0) close(s->passed_fd);
+        memcpy(&s->passed_fd, CMSG_DATA(c), sizeof(int));
+    }
+}
+
+// Function to read whatever is available into the arena; returns read()'s result
+static ssize_t fill_session(struct session *s) {
+    if (make_room(s) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    ssize_t n;
+    do {
+        if (expects_region(s)) {
+            prepare_recvmsg(s);
+            n = recvmsg(s->fd, &s->msg, MSG_CMSG_CLOEXEC);
+            if (n > 0) take_passed_fd(s);
+        } else {
+            n = read(s->fd, s->arena + s->end, s->cap - s->end);
+        }
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        s->end += n;
+        metrics_add(METRIC_BYTES_IN, n);
+    }
+    return n;
+}
+
+// Function to send the server handshake or a mode status. Nothing else has been sent on the connection
+// yet, so a few bytes always fit in its buffer: if they do not go at once the client is treated as
+// broken rather than waited for, since this runs on the reactor and ring threads. Returns 0 or -1.
+static int send_greeting(struct session *s, const void *data, size_t len) {
+    ssize_t n;
+    do {
+        n = send(s->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    if (n != (ssize_t)len) {
+        if (n >= 0) errno = EAGAIN;
+        return -1;
+    }
+    metrics_add(METRIC_BYTES_OUT, len);
+    return 0;
+}
+
+// Function to advance a session through the buffered bytes until a job is ready or more input is needed
+static enum parse_result parse_session(struct session *s, const struct server_config *config) {
+    struct job *job = &s->job;
+    job->close_after = 0;
+
+    while (1) {
+        char *data = s->arena + s->start;
+        size_t avail = s->end - s->start;
+
+        switch (s->phase) {
+        case PHASE_HANDSHAKE:
+            s->need = HANDSHAKE_LEN;
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            // Find the role whose handshake the client sent; it sets the session's default operation
+            s->role = NULL;
+            for (int i = 0; i < config->role_count; i++) {
+                if (memcmp(data, config->roles[i].client_handshake, HANDSHAKE_LEN) == 0) s->role = &config->roles[i];
+            }
+            if (!s->role) {
+                log_message(LOG_ERROR, "Invalid client handshake: '%.*s'", HANDSHAKE_LEN, data);
+                metrics_add(METRIC_HANDSHAKE_FAILURES, 1);
+                return PARSE_CLOSE;
+            }
+
+            // Send handshake acknowledgment to the client
+            if (send_greeting(s, s->role->server_handshake, HANDSHAKE_LEN) < 0) {
+                log_message(LOG_ERROR, "writing handshake response to socket: %s", strerror(errno));
+                return PARSE_CLOSE;
+            }
+            end_stage(s, STAGE_HANDSHAKE);
+            consume(s, HANDSHAKE_LEN);
+            s->phase = PHASE_MODE;
+            break;
+
+        case PHASE_MODE: {
+            s->need = sizeof(int32_t);
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            // Legacy clients send the message length here; newer ones send a MODE_* selector
+            int32_t mode;
+            memcpy(&mode, data, sizeof(mode));
+            consume(s, sizeof(mode));
+
+            if (mode == MODE_STREAM) {
+                s->phase = PHASE_STREAM;
+            } else if (mode == MODE_FRAMED) {
+                s->phase = PHASE_FRAMED;
+            } else if (mode == MODE_SHARED) {
+                // The region comes as a descriptor passed over the socket, which only a Unix socket can carry
+                if (!local_sockets) {
+                    log_message(LOG_ERROR, "Shared-memory mode needs a Unix socket");
+                    return PARSE_CLOSE;
+                }
+                s->phase = PHASE_ATTACH;
+            } else if (mode == MODE_PACKED) {
+                // Framed mode with packed symbols, which needs an alphabet that fits in the fields
+                int32_t status = OTP_PACKABLE ? STATUS_OK : STATUS_BAD_OPCODE;
+                if (send_greeting(s, &status, sizeof(status)) < 0 || status != STATUS_OK) return PARSE_CLOSE;
+                s->packed = 1;
+                s->phase = PHASE_FRAMED;
+            } else if (mode >= 0 && mode < BUFFER_SIZE) {
+                s->phase = PHASE_SINGLE;
+                s->single_len = mode;
+            } else {
+                // Single messages must fit in one buffer; larger ones have to use stream mode
+                log_message(LOG_ERROR, "Message length %d needs stream mode", mode);
+                return PARSE_CLOSE;
+            }
+            break;
+        }
+
+        case PHASE_SINGLE:
+            // The message is followed by a key of the same length
+            s->need = 2 * (size_t)s->single_len;
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            job->transform = s->role->decrypt ? config->decrypt : config->encrypt;
+
+            job->decrypt = s->role->decrypt;
+            job->packed = 0;
+            job->payload = data;
+            job->key = data + s->single_len;
+            job->key_id = 0;
+            job->len = s->single_len;
+            job->reply = job->payload;
+            job->reply_len = job->len;
+            job->consumed = s->need;
+            return PARSE_JOB;
+
+        case PHASE_STREAM: {
+            s->need = sizeof(uint32_t);
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            // Each chunk is its length followed by that many payload and key bytes
+            uint32_t chunk_len;
+            memcpy(&chunk_len, data, sizeof(chunk_len));
+            chunk_len = ntohl(chunk_len);
+            if (chunk_len == 0) return PARSE_CLOSE; // End of the stream
+
+            if (chunk_len > STREAM_CHUNK_SIZE) {
+                log_message(LOG_ERROR, "stream chunk of %u bytes is too large", chunk_len);
+                return PARSE_CLOSE;
+            }
+
+            s->need = sizeof(uint32_t) + 2 * (size_t)chunk_len;
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            job->transform = s->role->decrypt ? config->decrypt : config->encrypt;
+
+            job->decrypt = s->role->decrypt;
+            job->packed = 0;
+            job->payload = data + sizeof(uint32_t);
+            job->key = job->payload + chunk_len;
+            job->key_id = 0;
+            job->len = chunk_len;
+            job->reply = job->payload;
+            job->reply_len = job->len;
+            job->consumed = s->need;
+            return PARSE_JOB;
+        }
+
+        case PHASE_FRAMED: {
+            s->need = sizeof(struct frame_header);
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            struct frame_header request;
+            decode_frame_header(data, &request);
+            memset(&job->response, 0, sizeof(job->response));
+            job->response.id = request.id;
+
+            // Oversized jobs cannot be drained safely, so report them and drop the connection. The
+            // report goes out like any reply, so replies the client has not read yet cannot stall the
+            // thread parsing this one.
+            if (request.payload_len > FRAME_MAX_PAYLOAD || request.key_len > FRAME_MAX_PAYLOAD) {
+                job->response.status = STATUS_TOO_LARGE;
+                job->upload = 0;
+                job->packed = 0;
+                job->len = 0;
+                job->key_id = 0;
+                job->reply = data;
+                job->reply_len = sizeof(struct frame_header);
+                job->consumed = 0;
+                job->close_after = 1;
+                return PARSE_JOB;
+            }
+
+            // Packed jobs count symbols; on the wire each takes two thirds of a byte. A stored key's
+            // token is never packed.
+            size_t payload_bytes = s->packed ? OTP_PACKED_SIZE((size_t)request.payload_len) : request.payload_len;
+            size_t key_bytes = s->packed && !(request.flags & FRAME_KEY_REF) ? OTP_PACKED_SIZE((size_t)request.key_len)
+                                                                             : request.key_len;
+            s->need = sizeof(struct frame_header) + payload_bytes + key_bytes;
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            job->payload = data + sizeof(struct frame_header);
+            job->key = job->payload + payload_bytes;
+            job->key_id = 0;
+            job->consumed = s->need;
+            job->upload = (request.flags & FRAME_KEY_UPLOAD) != 0;
+            job->packed = s->packed;
+            job->len = 0;
+
+            // The response header replaces the request header, so header and result go out in one write
+            job->reply = data;
+            job->reply_len = sizeof(struct frame_header);
+
+            if (job->upload) {
+                // The payload is a key to store; the answer carries its handle and, over the payload, its token
+                job->len = request.payload_len;
+                if (payload_bytes < KEY_TOKEN_LEN) job->response.status = STATUS_KEY_TOO_SHORT;
+                return PARSE_JOB;
+            }
+
+            // The request's opcode picks the operation; without one the handshake's applies
+            int decrypt = s->role->decrypt;
+            int opcode = request.flags & (FRAME_OP_ENCRYPT | FRAME_OP_DECRYPT);
+            if (opcode == (FRAME_OP_ENCRYPT | FRAME_OP_DECRYPT)) {
+                job->response.status = STATUS_BAD_OPCODE;
+                return PARSE_JOB;
+            }
+            if (opcode) decrypt = opcode == FRAME_OP_DECRYPT;
+            job->transform = decrypt ? config->decrypt : config->encrypt;
+            if (s->packed) job->transform = decrypt ? otp_decrypt_packed : otp_encrypt_packed;
+            job->decrypt = decrypt;
+
+            if (request.flags & FRAME_KEY_REF) {
+                // Use a slice of a stored key instead of one sent with the request, if the token matches
+                size_t stored_len;
+                uint64_t serial;
+                const char *stored = key_store && request.key_len == KEY_TOKEN_LEN
+                                         ? key_store_get(key_store, request.key_id, (const unsigned char *)job->key,
+                                                         &stored_len, &serial)
+                                         : NULL;
+                if (!stored) {
+                    job->response.status = STATUS_UNKNOWN_KEY;
+                    return PARSE_JOB;
+                }
+                if (request.key_offset > stored_len || stored_len - request.key_offset < request.payload_len) {
+                    key_store_put(key_store, request.key_id);
+                    job->response.status = STATUS_KEY_TOO_SHORT;
+                    return PARSE_JOB;
+                }
+                job->key = stored + request.key_offset;
+                job->key_id = request.key_id;
+                job->key_serial = serial;
+                job->key_offset = request.key_offset;
+            } else if (request.key_len < request.payload_len) {
+                // A short key fails only this job; the connection stays usable
+                job->response.status = STATUS_KEY_TOO_SHORT;
+                return PARSE_JOB;
+            }
+
+            job->response.payload_len = request.payload_len;
+            job->len = request.payload_len;
+            job->reply_len += payload_bytes;
+            return PARSE_JOB;
+        }
+
+        case PHASE_ATTACH: {
+            s->need = sizeof(struct shm_attach);
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            // Map the region the client passed; from here on only descriptors come through the socket
+            struct shm_attach attach;
+            memcpy(&attach, data, sizeof(attach));
+            consume(s, sizeof(attach));
+
+            // A region the client could shrink would fault the server when it touched the lost pages,
+            // so only a memfd sealed against that is taken
+            int32_t status = STATUS_BAD_REGION;
+            struct stat st;
+            int fd = s->passed_fd;
+            s->passed_fd = -1;
+            int seals = fd >= 0 ? fcntl(fd, F_GET_SEALS) : -1;
+            if (seals >= 0 && (seals & F_SEAL_SHRINK) && fstat(fd, &st) == 0 && attach.size > 0 &&
+                (uint64_t)st.st_size >= attach.size) {
+                void *region = mmap(NULL, attach.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                if (region != MAP_FAILED) {
+                    s->shared = region;
+                    s->shared_len = attach.size;
+                    status = STATUS_OK;
+                }
+            }
+            if (fd >= 0) close(fd);
+            if (status != STATUS_OK) log_message(LOG_ERROR, "could not map the shared memory the client passed");
+
+            if (send_greeting(s, &status, sizeof(status)) < 0 || status != STATUS_OK) return PARSE_CLOSE;
+            s->phase = PHASE_SHARED;
+            break;
+        }
+
+        case PHASE_SHARED: {
+            s->need = sizeof(struct shm_job);
+            if (avail < s->need) return PARSE_NEED_MORE;
+
+            struct shm_job request;
+            memcpy(&request, data, sizeof(request));
+            memset(&job->response, 0, sizeof(job->response));
+            job->upload = 0;
+            job->packed = 0;
+            job->len = 0;
+            job->consumed = s->need;
+
+            // The descriptor goes back as the reply, with its status filled in by prepare_reply
+            job->reply = data;
+            job->reply_len = sizeof(request);
+
+            int decrypt = s->role->decrypt;
+            int opcode = request.flags & (FRAME_OP_ENCRYPT | FRAME_OP_DECRYPT);
+            if (opcode == (FRAME_OP_ENCRYPT | FRAME_OP_DECRYPT)) {
+                job->response.status = STATUS_BAD_OPCODE;
+                return PARSE_JOB;
+            }
+            if (opcode) decrypt = opcode == FRAME_OP_DECRYPT;
+            job->transform = decrypt ? config->decrypt : config->encrypt;
+            job->decrypt = decrypt;
+
+            // Both the payload and its key must lie inside the region
+            if (request.len > s->shared_len || request.offset > s->shared_len - request.len ||
+                request.key_offset > s->shared_len - request.len) {
+                job->response.status = STATUS_BAD_REGION;
+                return PARSE_JOB;
+            }
+
+            job->payload = s->shared + request.offset;
+            job->key = s->shared + request.key_offset;
+            job->key_id = 0;
+            job->len = request.len;
+            return PARSE_JOB;
+        }
+        }
+    }
+}
+
+// Function to make the session's scratch buffer at least len bytes; returns it, or NULL if it cannot grow
+static char *session_scratch(struct session *s, size_t len) {
+    if (len > s->scratch_cap) {
+        char *grown = realloc(s->scratch, len);
+        if (!grown) return NULL;
+        s->scratch = grown;
+        s->scratch_cap = len;
+    }
+    return s->scratch;
+}
+
+// Function to transform a job's payload in place, or copy the result of an identical earlier job over it
+static void transform_job(struct session *s) {
+    struct job *job = &s->job;
+    size_t bytes = job->packed ? OTP_PACKED_SIZE(job->len) : job->len;
+    const char *key = job->key;
+    if (job->packed && job->key_id) {
+        // Stored keys are kept as characters, so the slice this job uses is packed to match the payload
+        char *packed_key = session_scratch(s, bytes);
+        if (!packed_key) {
+            job->response.status = STATUS_TOO_LARGE;
+            job->response.payload_len = 0;
+            job->reply_len = sizeof(struct frame_header);
+            return;
+        }
+        otp_pack(job->key, packed_key, job->len);
+        key = packed_key;
+    }
+
+    struct cache_request request;
+    int64_t ticket = -1;
+    if (response_cache) {
+        request.decrypt = job->decrypt;
+        request.packed = job->packed;
+        request.payload = job->payload;
+        request.len = bytes;
+        request.key = job->key_id ? NULL : job->key;
+        request.key_serial = job->key_serial;
+        request.key_offset = job->key_offset;
+        if (response_cache_lookup(response_cache, &request, job->payload, &ticket)) {
+            metrics_add(METRIC_CACHE_HITS, 1);
+            return;
+        }
+        metrics_add(METRIC_CACHE_MISSES, 1);
+    }
+
+    // Transform in place, so the received bytes are read once and the result is sent from the same memory.
+    // Large framed jobs are split into tiles across the parallel pool; packed ones are transformed a
+    // word of symbols at a time, where tiles of bytes would cut words apart.
+    if (job->packed) {
+        job->transform(job->payload, key, job->payload, job->len);
+    } else {
+        otp_parallel(job->transform, job->payload, key, job->payload, job->len);
+    }
+    response_cache_fill(response_cache, &request, ticket, job->payload);
+}
+
+// Function to let go of the stored key a job used, once the job is done with it
+static void release_job_key(struct session *s) {
+    if (!s->job.key_id) return;
+    key_store_put(key_store, s->job.key_id);
+    s->job.key_id = 0;
+}
+
+// Function to transform the job at the front of the arena and build its reply in place
+static void prepare_reply(struct session *s) {
+    struct job *job = &s->job;
+
+    if (job->upload) {
+        // Keep the payload as a key and answer with its handle; packed keys are stored unpacked,
+        // so jobs in every mode can refer to them
+        const char *key = job->payload;
+        unsigned char token[KEY_TOKEN_LEN];
+        if (job->packed && (key = session_scratch(s, job->len)) != NULL) otp_unpack(job->payload, s->scratch, job->len);
+        if (key_store && key && !s->key_owner) s->key_owner = key_store_owner(key_store);
+        if (!key_store || !key ||
+            key_store_add(key_store, key, job->len, s->key_owner, &job->response.key_id, token) < 0) {
+            job->response.status = STATUS_KEY_STORE_FULL;
+        } else {
+            memcpy(job->payload, token, KEY_TOKEN_LEN);
+            job->response.payload_len = KEY_TOKEN_LEN;
+            job->reply_len += KEY_TOKEN_LEN;
+        }
+    } else if (job->len > 0) {
+        transform_job(s);
+    }
+    release_job_key(s);
+
+    end_stage(s, STAGE_TRANSFORM);
+
+    // Framed responses carry a header and shared-memory responses a descriptor; single and stream
+    // responses are the raw result
+    if (s->phase == PHASE_FRAMED) {
+        encode_frame_header(&job->response, job->reply);
+        if (job->response.status != STATUS_OK) metrics_add(METRIC_JOB_FAILURES, 1);
+    } else if (s->phase == PHASE_SHARED) {
+        struct shm_job reply;
+        memcpy(&reply, job->reply, sizeof(reply));
+        reply.status = job->response.status;
+        memcpy(job->reply, &reply, sizeof(reply));
+        if (reply.status != STATUS_OK) metrics_add(METRIC_JOB_FAILURES, 1);
+    }
+}
+
+// Function to retire a job once its reply is written; returns 1 while the session stays open
+static int finish_job(struct session *s) {
+    struct job *job = &s->job;
+    end_stage(s, STAGE_WRITE);
+    metrics_add(METRIC_BYTES_OUT, job->reply_len);
+    metrics_add(METRIC_JOBS, 1);
+    if (trace_enabled()) trace_job(s);
+
+    consume(s, job->consumed);
+
+    // A single-message session ends after its one job
+    return s->phase != PHASE_SINGLE && !job->close_after;
+}
+
+// Function to make a framed job's reply STATUS_BUSY instead of running it
+static void refuse_job(struct session *s) {
+    struct job *job = &s->job;
+    job->response.status = STATUS_BUSY;
+    job->response.payload_len = 0;
+    job->response.retry_after_ms = BUSY_RETRY_MS;
+    job->reply_len = sizeof(struct frame_header);
+    encode_frame_header(&job->response, job->reply);
+    metrics_add(METRIC_BUSY_REJECTIONS, 1);
+    metrics_add(METRIC_JOB_FAILURES, 1);
+    release_job_key(s);
+}
+
+// Function to transform and answer the job at the front of the arena; returns 1 while the session stays open
+static int run_job(struct session *s) {
+    prepare_reply(s);
+    if (write_full(s->fd, s->job.reply, s->job.reply_len) < 0) {
+        log_message(LOG_ERROR, "writing result to socket: %s", strerror(errno));
+        return 0;
+    }
+    return finish_job(s);
+}
+
+// Function to handle communication with a client until the session ends
+static void handle_client(int connection_socket, struct sockaddr_in client_addr, uint64_t accepted_at,
+                          const struct server_config *config) {
+    // Log the client's IP address for debugging
+    log_message(LOG_DEBUG, "Client connected from %s", peer_name(&client_addr));
+
+    struct session *s = new_session(connection_socket, client_addr, NULL);
+    if (!s) {
+        close(connection_socket);
+        return;
+    }
+    s->mark = s->trace.at[0] = accepted_at; // The handshake stage includes the fork
+
+    // This thread serves the session alone, so all the CPU time it uses from here on is the session's
+    trace_resume(s);
+
+    while (1) {
+        enum parse_result result = parse_session(s, config);
+        if (result == PARSE_CLOSE) break;
+        if (result == PARSE_JOB) {
+            end_stage(s, STAGE_READ);
+            if (!run_job(s)) break;
+            continue;
+        }
+
+        // Block until the rest of the unit arrives
+        if (fill_session(s) <= 0) break;
+    }
+
+    // Close the client connection
+    close_session(s);
+}
+
+// Function to clean up zombie processes from child processes, each of which served one connection
+void cleanup_zombies() {
+    while (waitpid(-1, NULL, WNOHANG) > 0) __atomic_sub_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+}
+
+// Function to accept clients forever, forking a child for each one
+static void run_fork_server(int listen_socket, const struct server_config *config) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+
+    // Set up signal handler to clean up zombie processes
+    signal(SIGCHLD, cleanup_zombies);
+
+    // Main server loop to accept and handle client connections
+    while (1) {
+        // Accept a new client connection
+        int connection_socket = accept(listen_socket, (struct sockaddr *)&client_addr, &client_len);
+        if (connection_socket < 0) {
+            if (errno == EINTR) {
+                // Retry if interrupted by a signal
+                continue;
+            } else {
+                error("ERROR on accept");
+            }
+        }
+        metrics_add(METRIC_CONNECTIONS, 1);
+        uint64_t accepted_at = stage_clock();
+
+        // At the limit, answer busy from here rather than fork yet another child
+        if (at_capacity()) {
+            reject_busy(connection_socket);
+            continue;
+        }
+
+        // Fork a new process to handle the client
+        pid_t pid = fork();
+        if (pid < 0) {
+            error("ERROR on fork");
+        } else if (pid == 0) {
+            // In child process: close the listening socket and handle the client
+            close(listen_socket);
+            metrics_reset_thread();
+            handle_client(connection_socket, client_addr, accepted_at, config);
+            exit(0); // Exit child process after handling the client
+        } else {
+            // In parent process: count the child and close the client socket
+            __atomic_add_fetch(&active_sessions, 1, __ATOMIC_RELAXED);
+            close(connection_socket);
+        }
+    }
+}
+
+// Function run by each pre-forked worker: accept on its socket and serve one connection after another
+static void prefork_worker(int listen_socket, const struct server_config *config) {
+    // A client that hangs up must cost a failed write, not the worker
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int connection_socket = accept(listen_socket, (struct sockaddr *)&client_addr, &client_len);
+        if (connection_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            error("ERROR on accept");
+        }
+        metrics_add(METRIC_CONNECTIONS, 1);
+        handle_client(connection_socket, client_addr, stage_clock(), config);
+    }
+}
+
+// Function to start pre-forked worker i on its listening socket; returns its pid
+static pid_t spawn_prefork_worker(int i, const int *listen_sockets, int listeners, const struct server_config *config) {
+    pid_t master = getpid();
+    pid_t pid = fork();
+    if (pid < 0) error("ERROR on fork");
+    if (pid > 0) return pid;
+
+    // Workers go when the master does, rather than serving on without anyone to respawn them
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != master) exit(0);
+    metrics_reset_thread();
+
+    // Keep only this worker's socket; the master holds every one of them open, so connections
+    // queued on it are not lost while a worker is replaced
+    int listen_socket = listen_sockets[i % listeners];
+    for (int j = 0; j < listeners; j++) {
+        if (listen_sockets[j] != listen_socket) close(listen_sockets[j]);
+    }
+    prefork_worker(listen_socket, config);
+    exit(0);
+}
+
+// Function to run the pre-fork master: spawn the workers, then only wait for them and replace any that die
+static void run_prefork_server(const int *listen_sockets, int listeners, const struct server_config *config,
+                               int workers) {
+    pid_t *pids = calloc(workers, sizeof(*pids));
+    time_t *started = calloc(workers, sizeof(*started));
+    if (!pids || !started) error("ERROR allocating worker table");
+    for (int i = 0; i < workers; i++) {
+        pids[i] = spawn_prefork_worker(i, listen_sockets, listeners, config);
+        started[i] = time(NULL);
+    }
+    log_message(LOG_INFO, "pre-forked %d workers on %d listening sockets", workers, listeners);
+
+    while (1) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR on waitpid");
+        }
+
+        int i = 0;
+        while (i < workers && pids[i] != pid) i++;
+        if (i == workers) continue;
+        if (WIFSIGNALED(status)) {
+            log_message(LOG_WARN, "worker %d (pid %d) killed by signal %d; respawning", i, (int)pid, WTERMSIG(status));
+        } else {
+            log_message(LOG_WARN, "worker %d (pid %d) exited with status %d; respawning", i, (int)pid,
+                        WEXITSTATUS(status));
+        }
+
+        // A worker that dies straight away is given a second before the next try, so a broken setup
+        // cannot spin the master
+        if (time(NULL) - started[i] < 1) sleep(1);
+        pids[i] = spawn_prefork_worker(i, listen_sockets, listeners, config);
+        started[i] = time(NULL);
+    }
+}
+
+// Function to wait for read readiness again; EPOLLONESHOT keeps a session owned by one thread at a time
+static void rearm_session(struct reactor *r, struct session *s) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.ptr = s;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, s->fd, &event) < 0) {
+        log_message(LOG_ERROR, "re-arming connection: %s", strerror(errno));
+        close_session(s);
+    }
+}
+
+// Function to hand a session with a ready job to the worker pool
+static void enqueue_session(struct reactor *r, struct session *s) {
+    pthread_mutex_lock(&r->lock);
+    s->next = NULL;
+    if (r->tail) {
+        r->tail->next = s;
+    } else {
+        r->head = s;
+    }
+    r->tail = s;
+    __atomic_add_fetch(&r->queued, 1, __ATOMIC_RELAXED);
+    metrics_gauge_add(GAUGE_QUEUE_DEPTH, 1);
+    pthread_cond_signal(&r->ready);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Function to wait for the socket to drain before writing the rest of a reply
+static void await_writable(struct reactor *r, struct session *s) {
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLONESHOT;
+    event.data.ptr = s;
+    s->writing = 1;
+    trace_pause(s);
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_MOD, s->fd, &event) < 0) {
+        log_message(LOG_ERROR, "waiting to write: %s", strerror(errno));
+        close_session(s);
+    }
+}
+
+// Function to write as much of a session's reply as the socket takes without blocking, retiring the job
+// once it is all written. Returns 1 when the session can go on to its next job; otherwise the session
+// is waiting for EPOLLOUT or has been closed, so a client that stops reading never holds up a thread.
+static int send_reply(struct reactor *r, struct session *s) {
+    struct job *job = &s->job;
+    trace_resume(s);
+    while (s->sent < job->reply_len) {
+        ssize_t n = write(s->fd, job->reply + s->sent, job->reply_len - s->sent);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            await_writable(r, s);
+            return 0;
+        }
+        if (n < 0) {
+            log_message(LOG_ERROR, "writing result to socket: %s", strerror(errno));
+            close_session(s);
+            return 0;
+        }
+        s->sent += n;
+    }
+
+    s->sent = 0;
+    s->writing = 0;
+    if (!finish_job(s)) {
+        close_session(s);
+        return 0;
+    }
+    return 1;
+}
+
+// Function to read what a session has pending without blocking, queueing it once a job is complete
+static void pump_session(struct reactor *r, struct session *s) {
+    trace_resume(s);
+    while (1) {
+        enum parse_result result = parse_session(s, r->config);
+        if (result == PARSE_JOB) {
+            end_stage(s, STAGE_READ);
+
+            // With the queue full, framed jobs are told to come back later instead of waiting in line;
+            // single and stream jobs cannot be refused halfway, and one session queues at most one job
+            if (queue_limit > 0 && s->phase == PHASE_FRAMED && !s->job.upload && s->job.response.status == STATUS_OK &&
+                __atomic_load_n(&r->queued, __ATOMIC_RELAXED) >= queue_limit) {
+                // Sent like any reply, so a client that stops reading cannot stall the reactor
+                refuse_job(s);
+                if (!send_reply(r, s)) return;
+                continue;
+            }
+            trace_pause(s);
+            enqueue_session(r, s);
+            return;
+        }
+        if (result == PARSE_CLOSE) {
+            close_session(s);
+            return;
+        }
+
+        ssize_t n = fill_session(s);
+        if (n > 0) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // Drained the socket without completing a job; wait for the next event
+            trace_pause(s);
+            rearm_session(r, s);
+            return;
+        }
+        close_session(s);
+        return;
+    }
+}
+
+// Function run by each worker thread: take a ready session, answer its job, then look for the next one
+static void *worker_main(void *arg) {
+    struct reactor *r = arg;
+
+    while (1) {
+        pthread_mutex_lock(&r->lock);
+        while (!r->head) pthread_cond_wait(&r->ready, &r->lock);
+        struct session *s = r->head;
+        r->head = s->next;
+        if (!r->head) r->tail = NULL;
+        __atomic_sub_fetch(&r->queued, 1, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&r->lock);
+        metrics_gauge_add(GAUGE_QUEUE_DEPTH, -1);
+        end_stage(s, STAGE_QUEUE);
+        trace_resume(s);
+        prepare_reply(s);
+
+        // Pipelined jobs may already be buffered once the reply is out; otherwise this re-arms the connection
+        if (send_reply(r, s)) pump_session(r, s);
+    }
+    return NULL;
+}
+
+// Function to accept every pending connection and register it with the event loop
+static void accept_connections(struct reactor *r) {
+    while (1) {
+        struct sockaddr_in client_addr;
+        socklen_t client_len = sizeof(client_addr);
+        int connection_socket = accept4(r->listen_socket, (struct sockaddr *)&client_addr, &client_len, SOCK_NONBLOCK);
+        if (connection_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_message(LOG_ERROR, "accept: %s", strerror(errno));
+            return;
+        }
+        metrics_add(METRIC_CONNECTIONS, 1);
+        if (at_capacity()) {
+            reject_busy(connection_socket);
+            continue;
+        }
+
+        // Log the client's IP address for debugging
+        log_message(LOG_DEBUG, "Client connected from %s", peer_name(&client_addr));
+
+        struct session *s = new_session(connection_socket, client_addr, NULL);
+        if (!s) {
+            close(connection_socket);
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = s;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, connection_socket, &event) < 0) {
+            log_message(LOG_ERROR, "registering connection: %s", strerror(errno));
+            close_session(s);
+        }
+    }
+}
+
+// Function to run the epoll reactor on this thread with a fixed pool of worker threads
+static void run_epoll_server(int listen_socket, const struct server_config *config, int threads) {
+    struct reactor r;
+    memset(&r, 0, sizeof(r));
+    r.listen_socket = listen_socket;
+    r.config = config;
+    pthread_mutex_init(&r.lock, NULL);
+    pthread_cond_init(&r.ready, NULL);
+
+    // A write to a client that hung up must fail with EPIPE, not kill every connection in the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // The listening socket is drained in a loop, so it must never block
+    int flags = fcntl(listen_socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(listen_socket, F_SETFL, flags | O_NONBLOCK) < 0)
+        error("ERROR making listening socket non-blocking");
+
+    r.epoll_fd = epoll_create1(0);
+    if (r.epoll_fd < 0) error("ERROR creating epoll instance");
+
+    // The listening socket is registered with a NULL pointer to tell it apart from sessions
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(r.epoll_fd, EPOLL_CTL_ADD, listen_socket, &event) < 0)
+        error("ERROR registering listening socket");
+
+    // Size the pool to the machine unless told otherwise
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) threads = 1;
+    for (int i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_main, &r) != 0) error("ERROR creating worker thread");
+        pthread_detach(thread);
+    }
+
+    // Main event loop: accept new clients, read from ready ones and finish replies the sockets could not take at once
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int n = epoll_wait(r.epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            error("ERROR on epoll_wait");
+        }
+
+        for (int i = 0; i < n; i++) {
+            struct session *s = events[i].data.ptr;
+            if (s == NULL) {
+                accept_connections(&r);
+            } else if (!s->writing || send_reply(&r, s)) {
+                // A session that was waiting to finish its reply goes on to the next job once it is out
+                pump_session(&r, s);
+            }
+        }
+    }
+}
+
+static void uring_close(struct uring_server *u, int slot);
+static void uring_start(struct uring_server *u, int slot);
+
+// Function to tag a ring operation with the connection slot it belongs to
+static uint64_t uring_tag(int slot, int op) {
+    return ((uint64_t)slot << 2) | op;
+}
+
+// Function to put off queueing a slot's operation until completions have been reaped. The ring has
+// no free entry only while the kernel refuses more work for a moment (EAGAIN or EBUSY from
+// io_uring_enter), so the slot waits rather than losing its session; the ring thread tries again.
+static void uring_defer(struct uring_server *u, int slot, int op) {
+    struct uring_conn *conn = &u->conns[slot];
+    conn->deferred = op;
+    conn->next_deferred = -1;
+    if (u->deferred_tail >= 0) u->conns[u->deferred_tail].next_deferred = slot;
+    else u->deferred_head = slot;
+    u->deferred_tail = slot;
+}
+
+// Function to queue the next read for a session: into its registered buffer when it has one
+static void uring_queue_recv(struct uring_server *u, int slot) {
+    struct session *s = u->conns[slot].s;
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    if (!sqe) {
+        uring_defer(u, slot, URING_OP_RECV);
+        return;
+    }
+
+    sqe->fd = u->fixed_files ? slot : s->fd;
+    if (u->fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->user_data = uring_tag(slot, URING_OP_RECV);
+    if (expects_region(s)) {
+        // The session's message header must stay put until the read completes
+        prepare_recvmsg(s);
+        sqe->opcode = IORING_OP_RECVMSG;
+        sqe->addr = (uintptr_t)&s->msg;
+        sqe->len = 1;
+        sqe->msg_flags = MSG_CMSG_CLOEXEC;
+        return;
+    }
+    if (s->fixed_buffer >= 0) {
+        sqe->opcode = IORING_OP_READ_FIXED;
+        sqe->buf_index = s->fixed_buffer;
+    } else {
+        sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->addr = (uintptr_t)(s->arena + s->end);
+    sqe->len = s->cap - s->end;
+}
+
+// Function to queue the rest of a session's reply
+static void uring_queue_send(struct uring_server *u, int slot) {
+    struct uring_conn *conn = &u->conns[slot];
+    struct session *s = conn->s;
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    if (!sqe) {
+        uring_defer(u, slot, URING_OP_SEND);
+        return;
+    }
+
+    if (s->fixed_buffer >= 0) {
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+        sqe->buf_index = s->fixed_buffer;
+    } else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->fd = u->fixed_files ? slot : s->fd;
+    if (u->fixed_files) sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t)(s->job.reply + s->sent);
+    sqe->len = s->job.reply_len - s->sent;
+    sqe->user_data = uring_tag(slot, URING_OP_SEND);
+}
+
+// Function to queue a fixed file table update; the kernel reads *fd when the entry runs, so it must stay put
+static struct io_uring_sqe *uring_queue_file_update(struct uring_server *u, int slot, const int *fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    if (!sqe) return NULL;
+    sqe->opcode = IORING_OP_FILES_UPDATE;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)fd;
+    sqe->len = 1;
+    sqe->off = slot;
+    sqe->user_data = uring_tag(slot, URING_OP_OTHER);
+    return sqe;
+}
+
+// Function to free a closed session's slot. The ring's reference to the socket is dropped first, or
+// the socket would stay open after close(); the slot is reused only once that update is queued.
+static void uring_release(struct uring_server *u, int slot) {
+    static const int no_file = -1;
+    if (u->fixed_files && !uring_queue_file_update(u, slot, &no_file)) {
+        uring_defer(u, slot, URING_OP_OTHER);
+        return;
+    }
+    u->free_slots[u->free_count++] = slot;
+}
+
+// Function to end a session and free its slot
+static void uring_close(struct uring_server *u, int slot) {
+    struct uring_conn *conn = &u->conns[slot];
+    close_session(conn->s);
+    conn->s = NULL;
+    uring_release(u, slot);
+}
+
+// Function to queue the operations put off while the ring was full, oldest first; once one has to
+// wait again, so do the rest
+static void uring_queue_deferred(struct uring_server *u) {
+    int slot = u->deferred_head;
+    u->deferred_head = u->deferred_tail = -1;
+    while (slot >= 0) {
+        struct uring_conn *conn = &u->conns[slot];
+        int next = conn->next_deferred;
+        int op = conn->deferred;
+        conn->deferred = -1;
+        // A file table update puts a new session's socket in, or takes a closed one's out
+        if (op == URING_OP_RECV) uring_queue_recv(u, slot);
+        else if (op == URING_OP_SEND) uring_queue_send(u, slot);
+        else if (conn->s) uring_start(u, slot);
+        else uring_release(u, slot);
+        slot = next;
+        if (conn->deferred >= 0) break;
+    }
+    while (slot >= 0) {
+        int next = u->conns[slot].next_deferred;
+        uring_defer(u, slot, u->conns[slot].deferred);
+        slot = next;
+    }
+}
+
+// Function to parse what a session has buffered and queue its next operation: a reply or a read
+static void uring_drive(struct uring_server *u, int slot) {
+    struct uring_conn *conn = &u->conns[slot];
+    struct session *s = conn->s;
+
+    trace_resume(s);
+    enum parse_result result = parse_session(s, u->config);
+    if (result == PARSE_CLOSE) {
+        uring_close(u, slot);
+    } else if (result == PARSE_JOB) {
+        end_stage(s, STAGE_READ);
+        prepare_reply(s);
+        s->sent = 0;
+        trace_pause(s);
+        uring_queue_send(u, slot);
+    } else if (make_room(s) < 0) {
+        uring_close(u, slot);
+    } else {
+        trace_pause(s);
+        uring_queue_recv(u, slot);
+    }
+}
+
+// Function to queue an accept on the shared listening socket; a multishot accept keeps producing connections
+static void uring_queue_accept(struct uring_server *u) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&u->ring);
+    u->accept_deferred = !sqe;
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = u->listen_socket;
+    if (u->multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = URING_ACCEPT;
+}
+
+// Function to start a new session in its slot
+static void uring_start(struct uring_server *u, int slot) {
+    struct uring_conn *conn = &u->conns[slot];
+    if (!u->fixed_files) {
+        uring_drive(u, slot);
+        return;
+    }
+
+    // Put the socket in the fixed file table, linked so the first read runs only after it is there
+    struct io_uring_sqe *sqe = uring_queue_file_update(u, slot, &conn->file);
+    if (!sqe) {
+        uring_defer(u, slot, URING_OP_OTHER);
+        return;
+    }
+    sqe->flags |= IOSQE_IO_LINK;
+    uring_drive(u, slot);
+
+    // A read put off for want of an entry must not leave the update linked to another session's operation
+    if (conn->deferred >= 0) sqe->flags &= ~IOSQE_IO_LINK;
+}
+
+// Function to start serving a connection the ring accepted
+static void uring_accepted(struct uring_server *u, int fd) {
+    metrics_add(METRIC_CONNECTIONS, 1);
+    if (u->free_count == 0) {
+        log_message(LOG_WARN, "io_uring connection table full; turning a connection away");
+        reject_busy(fd);
+        return;
+    }
+    if (at_capacity()) {
+        reject_busy(fd);
+        return;
+    }
+
+    // Multishot accepts share no address buffer, so the peer is only looked up when it will be logged
+    struct sockaddr_in client_addr;
+    memset(&client_addr, 0, sizeof(client_addr));
+    if (log_enabled(LOG_DEBUG) || trace_enabled()) {
+        socklen_t client_len = sizeof(client_addr);
+        getpeername(fd, (struct sockaddr *)&client_addr, &client_len);
+        log_message(LOG_DEBUG, "Client connected from %s", peer_name(&client_addr));
+    }
+
+    // The lowest slots own the registered buffers, and free slots are reused lowest first
+    int slot = u->free_slots[--u->free_count];
+    char *arena = slot < u->fixed_buffers ? u->pool + (size_t)slot * ARENA_SIZE : NULL;
+    struct session *s = new_session(fd, client_addr, arena);
+    if (!s) {
+        close(fd);
+        u->free_slots[u->free_count++] = slot;
+        return;
+    }
+    if (arena) s->fixed_buffer = slot;
+
+    u->conns[slot].s = s;
+    u->conns[slot].file = fd;
+    uring_start(u, slot);
+}
+
+// Function to act on one completion
+static void uring_complete(struct uring_server *u, struct io_uring_cqe *cqe) {
+    if (cqe->user_data == URING_ACCEPT) {
+        if (cqe->res >= 0) {
+            uring_accepted(u, cqe->res);
+        } else if (cqe->res == -EINVAL && u->multishot) {
+            // Kernels before 5.19 have no multishot accept: fall back to one accept per completion
+            u->multishot = 0;
+        } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED && cqe->res != -EAGAIN) {
+            log_message(LOG_ERROR, "io_uring accept: %s", strerror(-cqe->res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) uring_queue_accept(u);
+        return;
+    }
+
+    int slot = cqe->user_data >> 2;
+    int op = cqe->user_data & 3;
+    struct uring_conn *conn = &u->conns[slot];
+    if (op == URING_OP_OTHER) {
+        // File table updates only matter when they fail, and then the linked read reports it
+        return;
+    }
+
+    struct session *s = conn->s;
+    if (cqe->res <= 0) {
+        if (cqe->res < 0 && cqe->res != -ECONNRESET && cqe->res != -EPIPE && cqe->res != -ECANCELED)
+            log_message(LOG_ERROR, "io_uring %s: %s", op == URING_OP_RECV ? "read" : "write", strerror(-cqe->res));
+        uring_close(u, slot);
+        return;
+    }
+
+    if (op == URING_OP_RECV) {
+        if (expects_region(s)) take_passed_fd(s);
+        s->end += cqe->res;
+        metrics_add(METRIC_BYTES_IN, cqe->res);
+        uring_drive(u, slot);
+        return;
+    }
+
+    // A socket may take only part of a reply; send the rest before retiring the job
+    s->sent += cqe->res;
+    if (s->sent < s->job.reply_len) {
+        uring_queue_send(u, slot);
+    } else if (!finish_job(s)) {
+        uring_close(u, slot);
+    } else {
+        uring_drive(u, slot);
+    }
+}
+
+// Function to register the connection table and the arena pool; either may be refused, leaving the plain path
+static void uring_register_resources(struct uring_server *u) {
+    struct io_uring_rsrc_register files;
+    memset(&files, 0, sizeof(files));
+    files.nr = URING_SESSIONS;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    u->fixed_files = uring_register(&u->ring, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0;
+
+    // Registered buffers are pinned, so only the first URING_FIXED_BUFFERS sessions get one
+    u->pool = malloc((size_t)URING_FIXED_BUFFERS * ARENA_SIZE);
+    if (!u->pool) return;
+    struct iovec buffers[URING_FIXED_BUFFERS];
+    for (int i = 0; i < URING_FIXED_BUFFERS; i++) {
+        buffers[i].iov_base = u->pool + (size_t)i * ARENA_SIZE;
+        buffers[i].iov_len = ARENA_SIZE;
+    }
+    if (uring_register(&u->ring, IORING_REGISTER_BUFFERS, buffers, URING_FIXED_BUFFERS) == 0) {
+        u->fixed_buffers = URING_FIXED_BUFFERS;
+    } else {
+        free(u->pool);
+        u->pool = NULL;
+    }
+}
+
+// Function run by each ring thread: one submit-and-wait call sends every queued operation and collects the results
+static void *uring_main(void *arg) {
+    struct uring_server *u = arg;
+
+    uring_register_resources(u);
+    for (int i = 0; i < URING_SESSIONS; i++) {
+        u->free_slots[i] = URING_SESSIONS - 1 - i;
+        u->conns[i].deferred = -1;
+    }
+    u->free_count = URING_SESSIONS;
+    u->deferred_head = u->deferred_tail = -1;
+    u->multishot = 1;
+    uring_queue_accept(u);
+    log_message(LOG_INFO, "io_uring ready: fixed files %s, %d registered buffers",
+                u->fixed_files ? "on" : "off", u->fixed_buffers);
+
+    while (1) {
+        // Operations still waiting for an entry are retried after this round, so it must not block
+        int err = uring_submit_and_wait(&u->ring, u->deferred_head < 0 && !u->accept_deferred);
+        if (err < 0 && err != -EBUSY && err != -EAGAIN) {
+            log_message(LOG_ERROR, "io_uring_enter: %s", strerror(-err));
+            error("ERROR running io_uring");
+        }
+
+        // Handle every completion that is ready; the operations they queue go out together on the next call
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_peek_cqe(&u->ring)) != NULL) {
+            struct io_uring_cqe done = *cqe;
+            uring_cqe_seen(&u->ring);
+            uring_complete(u, &done);
+        }
+        if (u->accept_deferred) uring_queue_accept(u);
+        uring_queue_deferred(u);
+    }
+    return NULL;
+}
+
+// Function to serve clients with one io_uring per thread, the rings spread over the listening sockets;
+// returns a negative errno if io_uring is unavailable
+static int run_uring_server(const int *listen_sockets, int listeners, const struct server_config *config, int threads) {
+    if (threads <= 0) threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < listeners) threads = listeners; // Every listening socket needs a ring accepting on it
+
+    // Set up every ring first, so a kernel without io_uring is caught before anything starts
+    struct uring_server *servers = calloc(threads, sizeof(*servers));
+    if (!servers) error("ERROR allocating io_uring servers");
+    for (int i = 0; i < threads; i++) {
+        int err = uring_init(&servers[i].ring, URING_ENTRIES);
+        if (err < 0) {
+            for (int j = 0; j < i; j++) uring_exit(&servers[j].ring);
+            free(servers);
+            return err;
+        }
+        servers[i].listen_socket = listen_sockets[i % listeners];
+        servers[i].config = config;
+    }
+
+    // A write to a client that hung up must fail with EPIPE, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    // The rings sharing a listening socket all accept on it; the kernel hands each connection to one of them
+    for (int i = 1; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, uring_main, &servers[i]) != 0) error("ERROR creating io_uring thread");
+        pthread_detach(thread);
+    }
+    uring_main(&servers[0]);
+    return 0;
+}
+
+// Function to create a listening socket at a Unix socket path, replacing any left by an earlier run
+static int open_unix_listen_socket(const char *path, int backlog) {
+    struct sockaddr_un server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(server_addr.sun_path)) {
+        fprintf(stderr, "Error: socket path %s is too long\n", path);
+        exit(1);
+    }
+    strcpy(server_addr.sun_path, path);
+
+    int listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_socket < 0) error("ERROR opening socket");
+
+    // A socket file outlives the server that bound it, so a restart has to remove it first
+    unlink(path);
+    if (bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        error("ERROR on binding");
+
+    if (listen(listen_socket, backlog) < 0) error("ERROR on listen");
+    return listen_socket;
+}
+
+// Function to create a listening socket for the given port; with reuse_port, several can share it
+static int open_listen_socket(int port_number, int backlog, int reuse_port) {
+    struct sockaddr_in server_addr;
+
+    // Create a socket for the server
+    int listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_socket < 0) error("ERROR opening socket");
+
+    // Allow socket reuse to avoid address binding issues
+    int yes = 1;
+    if (setsockopt(listen_socket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int)) == -1) {
+        error("ERROR on setsockopt");
+    }
+
+    // Sockets sharing a port with SO_REUSEPORT each get their own accept queue, and the kernel spreads
+    // incoming connections across them
+    if (reuse_port && setsockopt(listen_socket, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1)
+        error("ERROR on setsockopt");
+
+    // Configure server address structure
+    memset((char *)&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = INADDR_ANY; // Bind to all available interfaces
+    server_addr.sin_port = htons(port_number); // Set the port number
+
+    // Bind the socket to the specified port
+    if (bind(listen_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+        error("ERROR on binding");
+
+    // Start listening for incoming connections
+    if (listen(listen_socket, backlog) < 0) error("ERROR on listen");
+    return listen_socket;
+}
+
+// Function to run one shard's accept loop in the shard's mode; it never returns
+static void *shard_main(void *arg) {
+    struct shard *shard = arg;
+    if (shard->mode == SERVER_EPOLL) {
+        run_epoll_server(shard->listen_socket, shard->config, shard->threads);
+    } else {
+        run_fork_server(shard->listen_socket, shard->config);
+    }
+    return NULL;
+}
+
+// Function to set up the listening sockets and serve clients in the selected mode
+void run_server(const struct server_options *options, const struct server_config *config) {
+    // A Unix socket path can be bound only once, so only TCP ports are sharded
+    int listeners = options->socket_path ? 1 : options->listeners;
+    int *listen_sockets = malloc(listeners * sizeof(*listen_sockets));
+    if (!listen_sockets) error("ERROR allocating listening sockets");
+    for (int i = 0; i < listeners; i++) {
+        listen_sockets[i] = options->socket_path ? open_unix_listen_socket(options->socket_path, options->backlog)
+                                                 : open_listen_socket(options->port, options->backlog, listeners > 1);
+    }
+    max_sessions = options->max_connections;
+    queue_limit = options->queue_limit;
+    local_sockets = options->socket_path != NULL;
+
+    // Start the log ring and the metrics exporter before any child or worker exists, so they all share them
+    if (log_ring_start(options->log_level) < 0) error("ERROR starting log ring");
+    if (options->metrics_port > 0 && metrics_start(options->metrics_port) < 0)
+        error("ERROR starting metrics exporter");
+
+    // Map the key store before any child or worker exists, so they all share it
+    if (options->key_store_mb > 0) {
+        key_store = key_store_create((size_t)options->key_store_mb * 1024 * 1024);
+        if (!key_store) error("ERROR mapping key store");
+    }
+    if (options->cache_mb > 0) {
+        response_cache = response_cache_create((size_t)options->cache_mb * 1024 * 1024);
+        if (!response_cache) error("ERROR mapping response cache");
+    }
+
+    // The trace ring is named after the address, so a reader can find it without asking the server
+    if (options->trace_slow_us >= 0) {
+        char port[16];
+        snprintf(port, sizeof(port), "%d", options->port);
+        const char *address = options->socket_path ? options->socket_path : port;
+        if (trace_start(address, options->trace_slow_us) < 0) error("ERROR mapping trace ring");
+        log_message(LOG_INFO, "tracing requests of %ld us or more; read them with ./tracedump %s",
+                    options->trace_slow_us, address);
+    }
+
+    enum server_mode mode = options->mode;
+    if (mode == SERVER_PREFORK) {
+        // Workers sharing a socket cover for each other: the kernel hands a connection to one that is waiting
+        // in accept, where a socket of its own would queue it behind whatever its worker is serving
+        int workers = options->threads > 0 ? options->threads : sysconf(_SC_NPROCESSORS_ONLN);
+        run_prefork_server(listen_sockets, listeners, config, workers > listeners ? workers : listeners);
+    }
+    if (mode == SERVER_URING) {
+        // Kernels without io_uring, or with it disabled, get the epoll engine instead
+        int err = run_uring_server(listen_sockets, listeners, config, options->threads);
+        log_message(LOG_WARN, "io_uring unavailable (%s); using epoll", strerror(-err));
+        mode = SERVER_EPOLL;
+    }
+
+    // Each listening socket gets its own accept loop, and in epoll mode its share of the worker threads
+    int threads = options->threads > 0 ? options->threads : sysconf(_SC_NPROCESSORS_ONLN);
+    threads = threads / listeners > 0 ? threads / listeners : 1;
+    struct shard *shards = calloc(listeners, sizeof(*shards));
+    if (!shards) error("ERROR allocating shards");
+    for (int i = 0; i < listeners; i++) {
+        shards[i].listen_socket = listen_sockets[i];
+        shards[i].config = config;
+        shards[i].mode = mode;
+        shards[i].threads = threads;
+    }
+    for (int i = 1; i < listeners; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, shard_main, &shards[i]) != 0) error("ERROR creating listener thread");
+        pthread_detach(thread);
+    }
+    shard_main(&shards[0]);
+
+    // Close the listening sockets (unreachable in this design)
+    for (int i = 0; i < listeners; i++) close(listen_sockets[i]);
+}
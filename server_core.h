@@ -0,0 +1,67 @@
+// server_core.h
+#ifndef SERVER_CORE_H
+#define SERVER_CORE_H
+
+#include "protocol.h"
+#include "logring.h" // For the log levels
+
+// Define constants for the single-message buffer size and the default listen backlog (the kernel
+// caps the backlog at net.core.somaxconn)
+#define BUFFER_SIZE 1024
+#define DEFAULT_BACKLOG 1024
+
+// Retry-after hint, in milliseconds, sent with busy replies
+#define BUSY_RETRY_MS 50
+
+// A handshake the server accepts, and the operation it picks for the session's jobs
+struct server_role {
+    const char *client_handshake; // Expected from the client, e.g. "ENC_CLIENT"
+    const char *server_handshake; // Sent back on success, e.g. "ENC_SERVER"
+    int decrypt;                  // Jobs decrypt unless a framed request's opcode says otherwise
+};
+
+// What distinguishes one server from another: the handshakes it answers and its transforms
+struct server_config {
+    const struct server_role *roles;
+    int role_count;
+    transform_fn encrypt;
+    transform_fn decrypt;
+};
+
+// How accepted connections are dispatched
+enum server_mode {
+    SERVER_FORK,    // One child process per connection
+    SERVER_PREFORK, // Long-lived worker processes accepting on the listening sockets, one connection at a time
+    SERVER_EPOLL,   // One epoll reactor thread feeding a fixed pool of worker threads
+    SERVER_URING    // One io_uring per thread, each accepting, reading and writing through its ring
+};
+
+// Settings taken from the command line
+struct server_options {
+    int port;
+    const char *socket_path; // Unix socket to listen on instead of the TCP port, or NULL
+    enum server_mode mode;
+    int threads;      // Worker threads, rings or pre-forked processes; 0 means one per online core
+    int key_store_mb; // Capacity of the shared key store; 0 disables key uploads
+    int metrics_port; // Loopback port serving Prometheus metrics; 0 disables metrics
+    enum log_level log_level;
+    int max_connections; // Connections (children in fork mode) served at once; more are told to retry. 0 means no limit
+    int queue_limit;     // Jobs waiting for an epoll worker; more framed jobs are told to retry. 0 means no limit
+    int backlog;         // Listen backlog
+    int listeners;       // Listening sockets sharing the port through SO_REUSEPORT, each with its own accept loop
+    int cache_mb;        // Capacity of the shared response cache; 0 disables it
+    long trace_slow_us;  // Requests taking at least this long are traced into shared memory; -1 disables tracing
+};
+
+// Utility function to print an error message and exit the program
+void error(const char *msg);
+
+// Parse "[-m fork|prefork|epoll|uring] [-t threads] [-k key_store_mb] [-M metrics_port] [-l level] [-c max_connections]
+// [-q queue_limit] [-b backlog] [-r listeners] [-C cache_mb] port|socket_path", exiting with a usage message on bad input.
+// An argument containing a '/' is a Unix socket path.
+void parse_server_options(int argc, char *argv[], struct server_options *options);
+
+// Listen on the configured port or Unix socket and serve clients forever in the configured mode
+void run_server(const struct server_options *options, const struct server_config *config);
+
+#endif
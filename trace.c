@@ -0,0 +1,166 @@
+// trace.c
+
+#define _GNU_SOURCE // For ftruncate and clock_gettime
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>     // For the monotonic and thread CPU clocks
+#include <unistd.h>
+#include <fcntl.h>    // For the shm_open flags
+#include <sys/mman.h> // For the shared mapping
+#include <sys/stat.h> // For checking the size of a mapped ring
+
+#include "trace.h"
+
+// Written last when a ring is set up, so a reader never maps one half made
+#define TRACE_MAGIC 0x4f545054 // "OTPT"
+
+// One record and its sequence number: 2 * position + 1 while the record for that position is being
+// written, 2 * position + 2 once it is complete. A reader copies the record between two loads of seq
+// and keeps the copy only if both show it complete for the position it wants.
+struct trace_slot {
+    uint64_t seq;
+    struct trace_record record;
+};
+
+// Layout of the shared mapping
+struct trace_ring {
+    uint32_t magic;
+    uint32_t record_size; // sizeof(struct trace_record), so a reader built differently is refused
+    uint64_t slow_ns;
+    uint64_t head __attribute__((aligned(64))); // Next position a writer claims, on a cache line of its own
+    struct trace_slot slots[TRACE_SLOTS];
+};
+
+static struct trace_ring *ring;
+
+// Function to name a server's ring after its address; a socket path's slashes become underscores
+void trace_ring_name(const char *address, char *name, size_t size) {
+    snprintf(name, size, "/otp-trace-%s", address);
+    for (char *c = name + 1; *c; c++) {
+        if (*c == '/') *c = '_';
+    }
+}
+
+// Function to create and map the ring
+int trace_start(const char *address, long slow_us) {
+    char name[256];
+    trace_ring_name(address, name, sizeof(name));
+
+    // A ring left by an earlier server on the same address is stale; readers that still have it mapped keep it
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) return -1;
+    struct trace_ring *created = MAP_FAILED;
+    if (ftruncate(fd, sizeof(struct trace_ring)) == 0)
+        created = mmap(NULL, sizeof(struct trace_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (created == MAP_FAILED) {
+        shm_unlink(name);
+        return -1;
+    }
+
+    created->record_size = sizeof(struct trace_record);
+    created->slow_ns = (uint64_t)slow_us * 1000;
+    __atomic_store_n(&created->magic, TRACE_MAGIC, __ATOMIC_RELEASE);
+    ring = created;
+    return 0;
+}
+
+// Function to check whether tracing is on
+int trace_enabled(void) {
+    return ring != NULL;
+}
+
+// Function to read the monotonic clock
+uint64_t trace_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Function to read the CPU time the calling thread has used
+uint64_t trace_thread_cpu(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Function to add a slow request to the ring, overwriting the oldest record
+void trace_submit(struct trace_record *record) {
+    if (!ring || record->at[STAGE_COUNT] - record->at[0] < ring->slow_ns) return;
+    record->pid = getpid();
+
+    uint64_t pos = __atomic_fetch_add(&ring->head, 1, __ATOMIC_RELAXED);
+    struct trace_slot *slot = &ring->slots[pos % TRACE_SLOTS];
+    __atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(&slot->record, record, sizeof(*record));
+    __atomic_store_n(&slot->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+}
+
+// Function to map a server's ring for reading
+const struct trace_ring *trace_open(const char *address) {
+    char name[256];
+    trace_ring_name(address, name, sizeof(name));
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    const struct trace_ring *mapped = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct trace_ring))
+        mapped = mmap(NULL, sizeof(struct trace_ring), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (__atomic_load_n(&mapped->magic, __ATOMIC_ACQUIRE) != TRACE_MAGIC ||
+        mapped->record_size != sizeof(struct trace_record)) {
+        munmap((void *)mapped, sizeof(struct trace_ring));
+        errno = EINVAL;
+        return NULL;
+    }
+    return mapped;
+}
+
+// Function to find where the records still in the ring begin
+uint64_t trace_oldest(const struct trace_ring *ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return head > TRACE_SLOTS ? head - TRACE_SLOTS : 0;
+}
+
+// Function to copy the next complete record
+int trace_next(const struct trace_ring *ring, uint64_t *cursor, struct trace_record *record, uint64_t *missed) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    // A reader a whole lap behind has lost the records in between
+    if (head > TRACE_SLOTS && *cursor < head - TRACE_SLOTS) {
+        *missed += head - TRACE_SLOTS - *cursor;
+        *cursor = head - TRACE_SLOTS;
+    }
+
+    while (*cursor < head) {
+        const struct trace_slot *slot = &ring->slots[*cursor % TRACE_SLOTS];
+        uint64_t want = 2 * *cursor + 2;
+        uint64_t before = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+        // Claimed but not finished yet: come back for it rather than skip it
+        if (before < want) return 0;
+        if (before == want) {
+            memcpy(record, &slot->record, sizeof(*record));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == want) {
+                (*cursor)++;
+                return 1;
+            }
+        }
+
+        // A later lap's writer has the slot now
+        (*missed)++;
+        (*cursor)++;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+// trace.h
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "metrics.h" // For the stages a request is timed in
+
+// Records the ring holds; each new one overwrites the oldest
+#define TRACE_SLOTS 4096
+
+#define TRACE_MODE_LEN 8
+#define TRACE_PEER_LEN 48
+
+// One traced request. Its stages are those of enum metric_stage, in order: at[0] is when the first
+// began and at[k + 1] when stage k ended, on the monotonic clock in nanoseconds. A stage the request
+// skipped, such as the handshake of any but a connection's first request, ends where it began.
+struct trace_record {
+    uint64_t at[STAGE_COUNT + 1];
+    uint64_t cpu_ns;           // CPU time of the server threads that worked on it, from their thread clocks
+    uint64_t bytes_in;         // Request bytes, headers and key included
+    uint64_t bytes_out;        // Reply bytes
+    uint64_t len;              // Symbols transformed or stored
+    int32_t pid;               // Process that served it
+    int32_t status;            // STATUS_* of the reply
+    char mode[TRACE_MODE_LEN]; // "single", "stream", "framed", "packed" or "shared"
+    char peer[TRACE_PEER_LEN]; // Client address and port, or "local" for a Unix socket
+};
+
+// Ring of the slowest requests' traces, in shared memory that other processes can map
+struct trace_ring;
+
+// Name of the shared memory a server listening on address (a port or Unix socket path) keeps its ring in
+void trace_ring_name(const char *address, char *name, size_t size);
+
+// Create the ring for address, replacing any left by an earlier run, and trace every request that
+// takes at least slow_us microseconds from now on. Call before forking, so child processes and
+// threads all write into it; returns 0, or -1 on failure.
+int trace_start(const char *address, long slow_us);
+
+// Check whether requests are being traced, so that measuring them can be skipped otherwise
+int trace_enabled(void);
+
+// Monotonic time, and the calling thread's CPU time, in nanoseconds
+uint64_t trace_now(void);
+uint64_t trace_thread_cpu(void);
+
+// Add a finished request to the ring, filling in pid, if it took at least the threshold. Writers
+// never wait for each other or for readers; a request under the threshold costs one comparison.
+void trace_submit(struct trace_record *record);
+
+// Map the ring of the server listening on address read-only; returns NULL with errno set on failure
+const struct trace_ring *trace_open(const char *address);
+
+// Position of the oldest record still in the ring, to start reading from
+uint64_t trace_oldest(const struct trace_ring *ring);
+
+// Copy the record at *cursor, or the oldest after it that is still there, and move *cursor past it.
+// Returns 1, or 0 when no record has been written there yet. Records overwritten before they were
+// read are skipped and counted in *missed. Reading never holds up the server.
+int trace_next(const struct trace_ring *ring, uint64_t *cursor, struct trace_record *record, uint64_t *missed);
+
+#endif
@@ -0,0 +1,81 @@
+// tracedump.c
+
+#define _DEFAULT_SOURCE // For usleep
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+// How long -f waits before looking for new records
+#define FOLLOW_INTERVAL_US 100000
+
+// Names of the stages, in the order of enum metric_stage
+static const char *const stage_names[STAGE_COUNT] = {"handshake", "read", "queue", "transform", "write"};
+
+// Function to print the usage message and exit
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-f] port|socket_path\n", program);
+    exit(1);
+}
+
+// Function to print one record as a line of JSON
+static void print_record(const struct trace_record *t) {
+    printf("{\"pid\":%d,\"peer\":\"%.*s\",\"mode\":\"%.*s\",\"status\":%d,\"len\":%llu,\"bytes_in\":%llu,"
+           "\"bytes_out\":%llu,\"cpu_us\":%.3f,\"start_ns\":%llu,\"total_us\":%.3f",
+           t->pid, TRACE_PEER_LEN, t->peer, TRACE_MODE_LEN, t->mode, t->status, (unsigned long long)t->len,
+           (unsigned long long)t->bytes_in, (unsigned long long)t->bytes_out, t->cpu_ns / 1e3,
+           (unsigned long long)t->at[0], (t->at[STAGE_COUNT] - t->at[0]) / 1e3);
+    for (int k = 0; k < STAGE_COUNT; k++) printf(",\"%s_us\":%.3f", stage_names[k], (t->at[k + 1] - t->at[k]) / 1e3);
+    printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+    int follow = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "f")) != -1) {
+        if (opt == 'f') {
+            follow = 1;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) usage(argv[0]);
+
+    // Ports are named the way the server prints them, so "07001" finds the ring of port 7001
+    char port[16];
+    const char *address = argv[optind];
+    if (!strchr(address, '/')) {
+        snprintf(port, sizeof(port), "%d", atoi(address));
+        address = port;
+    }
+
+    const struct trace_ring *ring = trace_open(address);
+    if (!ring) {
+        char name[256];
+        trace_ring_name(address, name, sizeof(name));
+        fprintf(stderr, "Error: no trace ring %s (%s); is the server running with -T?\n", name, strerror(errno));
+        return 1;
+    }
+
+    // The ring is only ever read: the server's writers never wait for this process
+    uint64_t cursor = trace_oldest(ring);
+    uint64_t missed = 0;
+    uint64_t reported = 0;
+    struct trace_record record;
+    while (1) {
+        while (trace_next(ring, &cursor, &record, &missed)) print_record(&record);
+        if (missed > reported) {
+            fprintf(stderr, "tracedump: %llu records overwritten before they were read\n",
+                    (unsigned long long)(missed - reported));
+            reported = missed;
+        }
+        if (!follow) break;
+        fflush(stdout);
+        usleep(FOLLOW_INTERVAL_US);
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+// uring.c
+
+#define _GNU_SOURCE // For syscall
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>    // For mapping the rings
+#include <sys/syscall.h> // For the io_uring system call numbers
+
+#include "uring.h"
+
+// Function to create the ring and map its submission queue, completion queue and entries
+int uring_init(struct uring *ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) return -errno;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    // Kernels with IORING_FEAT_SINGLE_MMAP share one mapping for both rings
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = 0;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+
+    ring->cq_ring = ring->sq_ring;
+    if (ring->cq_ring_size) {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto fail;
+    }
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    return 0;
+
+fail: {
+        int err = -errno;
+        uring_exit(ring);
+        return err;
+    }
+}
+
+// Function to release everything uring_init set up
+void uring_exit(struct uring *ring) {
+    if (ring->sqes && ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring_size && ring->cq_ring && ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+// Function to enter the kernel: submit queued entries and optionally wait for completions
+static int enter(struct uring *ring, unsigned wait) {
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    while (1) {
+        int n = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait, flags, NULL, 0);
+        if (n >= 0) {
+            ring->queued -= (unsigned)n < ring->queued ? (unsigned)n : ring->queued;
+            return 0;
+        }
+        if (errno != EINTR) return -errno;
+    }
+}
+
+// Function to hand out the next submission entry
+struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head == ring->sq_entries) {
+        // The queue is full: let the kernel consume it, then check again
+        if (enter(ring, 0) < 0) return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if (tail - head == ring->sq_entries) return NULL;
+    }
+
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+
+    // Publish the entry; the kernel reads it at the next io_uring_enter
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+    return sqe;
+}
+
+// Function to submit every queued entry in one system call and wait for completions
+int uring_submit_and_wait(struct uring *ring, unsigned wait) {
+    return enter(ring, wait);
+}
+
+// Function to look at the oldest completion without consuming it
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+// Function to consume the completion uring_peek_cqe returned
+void uring_cqe_seen(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Function to register resources with the ring
+int uring_register(struct uring *ring, unsigned opcode, const void *arg, unsigned count) {
+    if (syscall(__NR_io_uring_register, ring->fd, opcode, arg, count) < 0) return -errno;
+    return 0;
+}
@@ -0,0 +1,48 @@
+// uring.h
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+// The parts of an io_uring instance the server uses, set up with the raw system calls
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sq_entries;
+    unsigned queued;   // SQEs filled in since the last submit
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// Create a ring with room for entries submissions; returns 0 or a negative errno
+int uring_init(struct uring *ring, unsigned entries);
+
+// Unmap and close a ring
+void uring_exit(struct uring *ring);
+
+// Next free submission entry, zeroed, submitting queued entries first if the queue is full
+struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+// Submit every queued entry and wait for at least wait completions; returns 0 or a negative errno
+int uring_submit_and_wait(struct uring *ring, unsigned wait);
+
+// Oldest unread completion, or NULL; uring_cqe_seen releases it
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+void uring_cqe_seen(struct uring *ring);
+
+// Register resources (buffers, files, ...) with io_uring_register; returns 0 or a negative errno
+int uring_register(struct uring *ring, unsigned opcode, const void *arg, unsigned count);
+
+#endif